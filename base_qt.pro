@@ -11,6 +11,10 @@ HEADERS += \
 INCLUDEPATH += \
 	$$PWD/include
 
+# Shaders are compiled into the binary, read back from :/shaders/
+RESOURCES += \
+	shaders/shaders.qrc
+
 MOC_DIR     = build/moc
 OBJECTS_DIR = build/obj
 RCC_DIR     = build/qrc
@@ -0,0 +1,8 @@
+# Command line benchmarks for the terrain generator, no GUI needed
+# Build with `qmake && make` inside this folder
+
+TEMPLATE = subdirs
+SUBDIRS = \
+	eval_bench.pro \
+	terrain_bench.pro \
+	terrain_check.pro
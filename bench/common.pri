@@ -0,0 +1,34 @@
+# Terrain sources shared by every benchmark, no GUI needed
+
+SOURCES += \
+	$$PWD/../src/terrain.cpp \
+	$$PWD/../src/scheduler.cpp \
+	$$PWD/../src/profiler.cpp \
+	$$PWD/../src/heightcache.cpp \
+	$$PWD/../src/mappedfile.cpp \
+	$$PWD/../src/programcache.cpp \
+	$$PWD/../src/shaderprogram.cpp \
+	$$PWD/../src/util.cpp \
+	$$PWD/../src/fparser.cc \
+	$$PWD/../src/fpoptimizer.cc \
+	$$PWD/../src/gl_core_3_3.c
+
+HEADERS += \
+	$$PWD/../src/terrain.hpp \
+	$$PWD/../src/scheduler.hpp \
+	$$PWD/../src/profiler.hpp \
+	$$PWD/../src/heightcache.hpp \
+	$$PWD/../src/mappedfile.hpp \
+	$$PWD/../src/programcache.hpp \
+	$$PWD/../src/shaderprogram.hpp \
+	$$PWD/../src/util.hpp \
+	$$PWD/../src/fparser.hh \
+	$$PWD/../src/gl_core_3_3.h
+
+INCLUDEPATH += \
+	$$PWD/../include \
+	$$PWD/../src
+
+CONFIG += console c++17 release thread
+CONFIG -= qt app_bundle
+unix:LIBS += -lGL -ldl
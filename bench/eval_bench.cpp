@@ -0,0 +1,137 @@
+// Compare tiled evaluation against the layer-major order
+//
+// Usage: eval_bench [size] [layers] [funcs per layer]
+//
+// Every layer is made of cheap functions so the run is bound by memory
+// traffic rather than by the parser. Layer-major order streams the whole
+// layer through memory once per function, the tiled order keeps a tile
+// of every layer in cache until all functions are done with it.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "terrain.hpp"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// Count last level cache misses of this process, which is the closest
+// thing to DRAM traffic that is available without root
+class CacheMissCounter {
+public:
+    CacheMissCounter() {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.inherit = 1;   // Include worker threads
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~CacheMissCounter() {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    // Misses since start()
+    long long stop() {
+        long long count = 0;
+#ifdef __linux__
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+#endif
+        return count;
+    }
+
+private:
+    int fd = -1;
+};
+
+struct Result {
+    double ms;
+    long long misses;
+};
+
+static Result run(Terrain& terrain, uint32_t tile, unsigned threads, CacheMissCounter& counter) {
+    terrain.setTileSize(tile);
+    terrain.setThreadCount(threads);
+
+    counter.start();
+    auto begin = std::chrono::steady_clock::now();
+    terrain.evaluate();
+    auto end = std::chrono::steady_clock::now();
+    long long misses = counter.stop();
+
+    return Result{std::chrono::duration<double, std::milli>(end - begin).count(), misses};
+}
+
+static void report(const char* label, const Result& r, double samples, double modelled_bytes) {
+    printf("%-22s %9.1f ms  %8.2f Msamples/s  modelled %8.1f MB",
+        label, r.ms, samples / r.ms / 1e3, modelled_bytes / 1e6);
+    if (r.misses >= 0)
+        printf("  measured %8.1f MB", r.misses * 64.0 / 1e6);
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    uint32_t size   = argc > 1 ? atoi(argv[1]) : 2048;
+    int layers      = argc > 2 ? atoi(argv[2]) : Terrain::MAX_LAYERS;
+    int funcs       = argc > 3 ? atoi(argv[3]) : 4;
+
+    Terrain terrain;
+    terrain.setSize(size, size);
+    terrain.setSeed(1);
+    for (int l = 0; l < layers; l++) {
+        std::vector<std::string> layer_funcs;
+        for (int f = 0; f < funcs; f++)
+            layer_funcs.push_back("0.01*x + 0.02*y + " + std::to_string(0.001 * (l * funcs + f)));
+        terrain.pushLayer(std::pair(layer_funcs, Terrain::PhongConfig()));
+    }
+
+    CacheMissCounter counter;
+    double grid = (double)size * size;
+    double samples = grid * layers * funcs;
+
+    // Layer-major: every function pass reads and writes the whole layer
+    double layer_major_bytes = grid * sizeof(GLfloat) * layers * (1 + 2.0 * funcs);
+    // Tiled: every layer is zeroed once and written back once
+    double tiled_bytes = grid * sizeof(GLfloat) * layers * 2;
+
+    printf("grid %ux%u, %d layers x %d funcs, %s\n", size, size, layers, funcs,
+        counter.available() ? "LLC misses counted with perf" : "perf counters unavailable");
+
+    Result layer_major = run(terrain, 0, 1, counter);
+    report("layer-major, 1 thread", layer_major, samples, layer_major_bytes);
+    Result tiled = run(terrain, Terrain::EVAL_TILE_SIZE, 1, counter);
+    report("tiled, 1 thread", tiled, samples, tiled_bytes);
+    Result tiled_mt = run(terrain, Terrain::EVAL_TILE_SIZE, 0, counter);
+    report("tiled, all threads", tiled_mt, samples, tiled_bytes);
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+TEMPLATE = app
+TARGET = eval_bench
+
+include(common.pri)
+
+SOURCES += eval_bench.cpp
+
+OBJECTS_DIR = build/eval_bench
@@ -0,0 +1,334 @@
+// Time terrain generation over the configs shipped in the repo root
+//
+// Usage: terrain_bench [options]
+//   --configs DIR      folder holding the *.config files (default ..)
+//   --sizes A,B,...    grid sizes to run every config at
+//                      (default 256,512,1024,2048,4096)
+//   --mesh-limit N     skip mesh building above this size, a drawn layer
+//                      takes 16 bytes per grid point (default 2048)
+//   --threads N        workers to run on, 1 runs on the calling thread
+//                      only, 0 uses every core (default 0)
+//   --out PREFIX       write PREFIX.json and PREFIX.csv
+//                      (default terrain_bench)
+//   --baseline FILE    csv of an earlier run to compare against
+//   --cache DIR        evaluate through a height cache in DIR, a
+//                      second run then measures warm starts
+//
+// Every stage is timed on its own: reading the config, parsing the layer
+// functions, evaluating each layer, building the mesh and assigning the
+// smooth normals. Per layer and mesh times come from the profiler and
+// are summed over worker threads, i.e. they are CPU time, while the
+// evaluate and mesh totals are wall time.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "terrain.hpp"
+#include "profiler.hpp"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+// Exposes the CPU side of mesh generation
+class BenchTerrain : public Terrain {
+public:
+    size_t buildNormals() {
+        std::vector<std::vector<PackedNormal>> normals;
+        buildMesh(normals);
+        size_t count = 0;
+        for (auto& layer : normals)
+            count += layer.size();
+        return count;
+    }
+};
+
+// Peak resident memory, reset between runs where the kernel allows it
+class PeakMemory {
+public:
+    // Returns false when the peak cannot be reset, later readings are
+    // then the peak of the whole process
+    static bool reset() {
+#ifdef __linux__
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5";
+        clear_refs.flush();
+        return (bool)clear_refs;
+#else
+        return false;
+#endif
+    }
+
+    static double megabytes() {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+            if (line.compare(0, 6, "VmHWM:") == 0)
+                return atof(line.c_str() + 6) / 1024.0;
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss / 1024.0;
+#else
+        return 0.0;
+#endif
+    }
+};
+
+struct Result {
+    std::string config;
+    uint32_t size;
+    size_t funcs;
+    double load_ms;
+    double parse_ms;
+    double eval_ms;
+    std::vector<double> layer_ms;   // CPU time of each layer
+    double samples_per_s;           // Grid points times functions
+    bool meshed;
+    double mesh_ms;                 // Wall time of buildMesh()
+    double cells_cpu_ms;
+    double normals_cpu_ms;
+    double peak_mb;
+    bool peak_reset;
+    uint64_t lost_events;
+};
+
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// CPU time of every profiler event with the given name
+static double eventMs(const std::vector<Profiler::Record>& records, const char* name) {
+    double ns = 0;
+    for (auto& record : records)
+        if (record.name && strcmp(record.name, name) == 0)
+            ns += record.end - record.start;
+    return ns / 1e6;
+}
+
+static std::vector<std::string> listConfigs(const std::string& dir) {
+    std::vector<std::string> configs;
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return configs;
+    while (dirent* entry = readdir(d)) {
+        std::string file = entry->d_name;
+        if (file.size() > 7 && file.compare(file.size() - 7, 7, ".config") == 0)
+            configs.push_back(file);
+    }
+    closedir(d);
+    std::sort(configs.begin(), configs.end());
+    return configs;
+}
+
+static Result run(const std::string& dir, const std::string& config, uint32_t size,
+        unsigned threads, uint32_t mesh_limit, std::shared_ptr<HeightCache> cache) {
+    Result result = {};
+    result.config = config;
+    result.size = size;
+
+    Profiler& profiler = Profiler::instance();
+    profiler.clear();
+    result.peak_reset = PeakMemory::reset();
+
+    BenchTerrain terrain;
+    terrain.setThreadCount(threads);
+    terrain.setCache(cache);
+
+    auto start = std::chrono::steady_clock::now();
+    std::string path = dir + "/" + config;
+    terrain.load(path);
+    result.load_ms = elapsedMs(start);
+    terrain.setSize(size, size);
+
+    start = std::chrono::steady_clock::now();
+    terrain.evaluate();
+    result.eval_ms = elapsedMs(start);
+
+    std::vector<Profiler::Record> records = profiler.collect(&result.lost_events);
+    result.parse_ms = eventMs(records, "Parse functions");
+    for (size_t i = 0; i < terrain.getLayerCount(); i++)
+        result.layer_ms.push_back(eventMs(records, ("Layer " + std::to_string(i)).c_str()));
+
+    // Every evaluated function sample, the unit of work of evaluate()
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+        if (line.compare(0, 5, "func=") == 0)
+            result.funcs++;
+    result.samples_per_s = (double)size * size * result.funcs / (result.eval_ms / 1e3);
+
+    result.meshed = size <= mesh_limit;
+    if (result.meshed) {
+        profiler.clear();
+        start = std::chrono::steady_clock::now();
+        terrain.buildNormals();
+        result.mesh_ms = elapsedMs(start);
+
+        uint64_t lost;
+        records = profiler.collect(&lost);
+        result.lost_events += lost;
+        result.cells_cpu_ms = eventMs(records, "Build cells");
+        result.normals_cpu_ms = eventMs(records, "Smooth normals");
+    }
+
+    result.peak_mb = PeakMemory::megabytes();
+    return result;
+}
+
+static void writeJson(const std::string& filename, const std::vector<Result>& results, unsigned threads) {
+    std::ofstream out(filename);
+    out << "{\n  \"threads\": " << threads << ",\n  \"runs\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"config\": \"" << r.config << "\", \"size\": " << r.size
+            << ", \"funcs\": " << r.funcs
+            << ", \"load_ms\": " << r.load_ms << ", \"parse_ms\": " << r.parse_ms
+            << ", \"eval_ms\": " << r.eval_ms << ", \"layer_cpu_ms\": [";
+        for (size_t l = 0; l < r.layer_ms.size(); l++)
+            out << (l ? ", " : "") << r.layer_ms[l];
+        out << "], \"samples_per_s\": " << r.samples_per_s;
+        if (r.meshed)
+            out << ", \"mesh_ms\": " << r.mesh_ms << ", \"cells_cpu_ms\": " << r.cells_cpu_ms
+                << ", \"normals_cpu_ms\": " << r.normals_cpu_ms;
+        else
+            out << ", \"mesh_ms\": null, \"cells_cpu_ms\": null, \"normals_cpu_ms\": null";
+        out << ", \"peak_rss_mb\": " << r.peak_mb << ", \"peak_rss_reset\": " << (r.peak_reset ? "true" : "false")
+            << ", \"lost_events\": " << r.lost_events << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+static const char* CSV_HEADER = "config,size,funcs,load_ms,parse_ms,eval_ms,samples_per_s,"
+    "mesh_ms,cells_cpu_ms,normals_cpu_ms,peak_rss_mb,layer_cpu_ms";
+
+static void writeCsv(const std::string& filename, const std::vector<Result>& results) {
+    std::ofstream out(filename);
+    out << CSV_HEADER << "\n";
+    for (const Result& r : results) {
+        out << r.config << "," << r.size << "," << r.funcs << "," << r.load_ms << "," << r.parse_ms
+            << "," << r.eval_ms << "," << r.samples_per_s << ",";
+        if (r.meshed)
+            out << r.mesh_ms << "," << r.cells_cpu_ms << "," << r.normals_cpu_ms;
+        else
+            out << ",,";
+        out << "," << r.peak_mb << ",";
+        // Layers are ';' separated to keep one column
+        for (size_t l = 0; l < r.layer_ms.size(); l++)
+            out << (l ? ";" : "") << r.layer_ms[l];
+        out << "\n";
+    }
+}
+
+// Evaluate and mesh times of an earlier csv, keyed by config and size
+static std::map<std::pair<std::string, uint32_t>, std::pair<double, double>> readBaseline(const std::string& filename) {
+    std::map<std::pair<std::string, uint32_t>, std::pair<double, double>> baseline;
+    std::ifstream in(filename);
+    std::string line;
+    std::getline(in, line);
+    if (line != CSV_HEADER) {
+        fprintf(stderr, "%s is not a terrain_bench csv\n", filename.c_str());
+        return baseline;
+    }
+    while (std::getline(in, line)) {
+        std::vector<std::string> cols;
+        std::stringstream fields(line);
+        std::string field;
+        while (std::getline(fields, field, ','))
+            cols.push_back(field);
+        if (cols.size() < 8)
+            continue;
+        double mesh = cols[7].empty() ? 0 : atof(cols[7].c_str());
+        baseline[std::make_pair(cols[0], (uint32_t)atoi(cols[1].c_str()))] = std::make_pair(atof(cols[5].c_str()), mesh);
+    }
+    return baseline;
+}
+
+int main(int argc, char** argv) {
+    std::string dir = "..";
+    std::vector<uint32_t> sizes = {256, 512, 1024, 2048, 4096};
+    uint32_t mesh_limit = 2048;
+    unsigned threads = 0;
+    std::string out = "terrain_bench";
+    std::string baseline_file;
+    std::shared_ptr<HeightCache> cache;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", arg.c_str());
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--configs") {
+            dir = value;
+        } else if (arg == "--sizes") {
+            sizes.clear();
+            std::stringstream list(value);
+            std::string item;
+            while (std::getline(list, item, ','))
+                sizes.push_back(atoi(item.c_str()));
+        } else if (arg == "--mesh-limit") {
+            mesh_limit = atoi(value.c_str());
+        } else if (arg == "--threads") {
+            threads = atoi(value.c_str());
+        } else if (arg == "--out") {
+            out = value;
+        } else if (arg == "--baseline") {
+            baseline_file = value;
+        } else if (arg == "--cache") {
+            // Large enough for every config at every size
+            cache = std::make_shared<HeightCache>(value, 64ull << 30);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<std::string> configs = listConfigs(dir);
+    if (configs.empty()) {
+        fprintf(stderr, "No *.config files in %s\n", dir.c_str());
+        return 1;
+    }
+
+    auto baseline = baseline_file.empty() ? decltype(readBaseline("")){} : readBaseline(baseline_file);
+    unsigned workers = threads == 0 ? TaskScheduler::instance().getWorkerCount() : threads;
+
+    std::vector<Result> results;
+    for (const std::string& config : configs) {
+        for (uint32_t size : sizes) {
+            Result r = run(dir, config, size, threads, mesh_limit, cache);
+            results.push_back(r);
+
+            fprintf(stderr, "%-30s %5u  load %7.2f  parse %7.2f  eval %9.2f ms  %7.2f Msamples/s",
+                config.c_str(), size, r.load_ms, r.parse_ms, r.eval_ms, r.samples_per_s / 1e6);
+            if (r.meshed)
+                fprintf(stderr, "  mesh %8.2f ms (cells %8.2f, normals %8.2f cpu)",
+                    r.mesh_ms, r.cells_cpu_ms, r.normals_cpu_ms);
+            fprintf(stderr, "  peak %7.1f MB", r.peak_mb);
+
+            auto base = baseline.find(std::make_pair(config, size));
+            if (base != baseline.end()) {
+                fprintf(stderr, "  eval x%.2f", base->second.first / r.eval_ms);
+                if (r.meshed && base->second.second > 0)
+                    fprintf(stderr, "  mesh x%.2f", base->second.second / r.mesh_ms);
+            }
+            if (r.lost_events)
+                fprintf(stderr, "  (%llu profiler events lost, layer times are low)", (unsigned long long)r.lost_events);
+            fprintf(stderr, "\n");
+        }
+    }
+
+    writeJson(out + ".json", results, workers);
+    writeCsv(out + ".csv", results);
+    fprintf(stderr, "Wrote %s.json and %s.csv\n", out.c_str(), out.c_str());
+    return 0;
+}
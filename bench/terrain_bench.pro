@@ -0,0 +1,8 @@
+TEMPLATE = app
+TARGET = terrain_bench
+
+include(common.pri)
+
+SOURCES += terrain_bench.cpp
+
+OBJECTS_DIR = build/terrain_bench
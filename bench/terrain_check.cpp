@@ -0,0 +1,313 @@
+// Check that every evaluation path produces the reference terrain
+//
+// Usage: terrain_check [options]
+//   --configs DIR      folder holding the *.config files (default ..)
+//   --golden FILE      reference checksums (default golden.csv)
+//   --sizes A,B,...    grid sizes (default 129,257)
+//   --record           rewrite FILE from the reference path instead of
+//                      checking
+//
+// The reference is Terrain::evaluate() run layer by layer on a single
+// thread, the order the terrain was originally computed in. Its per
+// layer checksums are stored in the golden file so drift of the
+// reference itself shows up. Every other path is then compared value by
+// value against the reference computed in the same run: the checksum,
+// the largest absolute error and a histogram of the error in ULPs are
+// reported, and a path fails when it goes over its tolerance.
+//
+// Checksums are FNV-1a over the raw float bits, so the golden file has
+// to be recorded again when the math library or compiler flags change
+// the last bits of exp(), pow() and friends.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "terrain.hpp"
+
+// Way of evaluating a terrain that must match the reference
+struct EvalPath {
+    const char* name;
+    uint32_t tile_size;     // Terrain::setTileSize()
+    unsigned threads;       // Terrain::setThreadCount()
+    // A value passes when it is within either bound, so values near
+    // zero are not held to ULPs
+    uint32_t max_ulp;       // Largest error allowed, in ULPs
+    double max_abs;         // Largest error allowed, absolute
+    bool quantized;         // Terrain::setQuantizeHeights(), allows
+                            // one quantization step on top
+};
+
+static const EvalPath REFERENCE = {"reference", 0, 1, 0, 0.0, false};
+
+static const EvalPath PATHS[] = {
+    {"tiled",           Terrain::EVAL_TILE_SIZE, 1, 0, 0.0, false},
+    {"tiled-parallel",  Terrain::EVAL_TILE_SIZE, 0, 0, 0.0, false},
+    {"odd-tiles",       7,                       0, 0, 0.0, false},
+    {"quantized-16",    Terrain::EVAL_TILE_SIZE, 0, 0, 0.0, true},
+};
+
+// Summary of one evaluated layer
+struct LayerSum {
+    uint64_t fnv;
+    double min, max, mean;
+};
+
+static uint64_t fnv1a(const std::vector<GLfloat>& heights) {
+    uint64_t hash = 1469598103934665603ull;
+    for (GLfloat h : heights) {
+        uint32_t bits;
+        memcpy(&bits, &h, sizeof(bits));
+        for (int b = 0; b < 4; b++)
+            hash = (hash ^ ((bits >> (8 * b)) & 0xff)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static LayerSum summarize(const std::vector<GLfloat>& heights) {
+    LayerSum sum = {fnv1a(heights), INFINITY, -INFINITY, 0.0};
+    for (GLfloat h : heights) {
+        sum.min = std::min(sum.min, (double)h);
+        sum.max = std::max(sum.max, (double)h);
+        sum.mean += h;
+    }
+    if (!heights.empty())
+        sum.mean /= heights.size();
+    return sum;
+}
+
+// Distance between two floats in representable steps
+static uint32_t ulpDistance(GLfloat a, GLfloat b) {
+    if (a == b)
+        return 0;
+    if (std::isnan(a) || std::isnan(b))
+        return UINT32_MAX;
+    int32_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    // Map the sign-magnitude layout onto a monotonic integer line
+    int64_t la = ia < 0 ? (int64_t)INT32_MIN - ia : ia;
+    int64_t lb = ib < 0 ? (int64_t)INT32_MIN - ib : ib;
+    return (uint32_t)std::min<int64_t>(std::llabs(la - lb), UINT32_MAX);
+}
+
+// Error of a layer against the reference
+struct LayerDiff {
+    static const int BUCKETS = 6;
+    uint64_t histogram[BUCKETS] = {0};   // 0, 1, 2-3, 4-15, 16-255, more
+    uint32_t max_ulp = 0;
+    double max_abs = 0.0;
+    uint64_t over = 0;      // Values out of tolerance
+
+    void add(GLfloat value, GLfloat reference, const EvalPath& path, double step) {
+        uint32_t ulp = ulpDistance(value, reference);
+        double abs = std::fabs((double)value - reference);
+        max_ulp = std::max(max_ulp, ulp);
+        max_abs = std::max(max_abs, abs);
+        if (ulp > path.max_ulp && !(abs <= path.max_abs + step))
+            over++;
+        int bucket = ulp == 0 ? 0 : ulp == 1 ? 1 : ulp < 4 ? 2 : ulp < 16 ? 3 : ulp < 256 ? 4 : 5;
+        histogram[bucket]++;
+    }
+};
+
+static std::vector<std::string> listConfigs(const std::string& dir) {
+    std::vector<std::string> configs;
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return configs;
+    while (dirent* entry = readdir(d)) {
+        std::string file = entry->d_name;
+        if (file.size() > 7 && file.compare(file.size() - 7, 7, ".config") == 0)
+            configs.push_back(file);
+    }
+    closedir(d);
+    std::sort(configs.begin(), configs.end());
+    return configs;
+}
+
+// Evaluate a config at size x size through one path, steps receives
+// the quantization step of every layer
+static std::vector<std::vector<GLfloat>> evaluate(const std::string& path, uint32_t size,
+        const EvalPath& eval, std::vector<double>* steps = nullptr) {
+    Terrain terrain;
+    std::string file = path;
+    terrain.load(file);
+    terrain.setSize(size, size);
+    terrain.setTileSize(eval.tile_size);
+    terrain.setThreadCount(eval.threads);
+    terrain.setQuantizeHeights(eval.quantized);
+    terrain.evaluate();
+
+    std::vector<std::vector<GLfloat>> layers;
+    for (size_t i = 0; i < terrain.getLayerCount(); i++) {
+        layers.push_back(terrain.getLayerHeights(i));
+        if (steps)
+            steps->push_back(terrain.isQuantized() ? terrain.getQuantizedLayer(i).scale / 65535.0 : 0.0);
+    }
+    return layers;
+}
+
+typedef std::map<std::pair<std::string, uint32_t>, std::vector<LayerSum>> Golden;
+
+static const char* GOLDEN_HEADER = "config,size,layer,fnv1a,min,max,mean";
+
+static bool readGolden(const std::string& filename, Golden& golden) {
+    std::ifstream in(filename);
+    std::string line;
+    if (!std::getline(in, line) || line != GOLDEN_HEADER)
+        return false;
+    while (std::getline(in, line)) {
+        std::vector<std::string> cols;
+        std::stringstream fields(line);
+        std::string field;
+        while (std::getline(fields, field, ','))
+            cols.push_back(field);
+        if (cols.size() < 7)
+            continue;
+        LayerSum sum = {strtoull(cols[3].c_str(), nullptr, 16),
+            atof(cols[4].c_str()), atof(cols[5].c_str()), atof(cols[6].c_str())};
+        golden[std::make_pair(cols[0], (uint32_t)atoi(cols[1].c_str()))].push_back(sum);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string dir = "..";
+    std::string golden_file = "golden.csv";
+    std::vector<uint32_t> sizes = {129, 257};
+    bool record = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--record") {
+            record = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", arg.c_str());
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--configs") {
+            dir = value;
+        } else if (arg == "--golden") {
+            golden_file = value;
+        } else if (arg == "--sizes") {
+            sizes.clear();
+            std::stringstream list(value);
+            std::string item;
+            while (std::getline(list, item, ','))
+                sizes.push_back(atoi(item.c_str()));
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<std::string> configs = listConfigs(dir);
+    if (configs.empty()) {
+        fprintf(stderr, "No *.config files in %s\n", dir.c_str());
+        return 1;
+    }
+
+    Golden golden;
+    if (!record && !readGolden(golden_file, golden)) {
+        fprintf(stderr, "Cannot read %s, create it with --record\n", golden_file.c_str());
+        return 1;
+    }
+
+    std::ofstream out;
+    if (record) {
+        out.open(golden_file);
+        out << GOLDEN_HEADER << "\n";
+        out.precision(9);
+    }
+
+    int failures = 0;
+    for (const std::string& config : configs) {
+        for (uint32_t size : sizes) {
+            std::vector<std::vector<GLfloat>> reference = evaluate(dir + "/" + config, size, REFERENCE);
+
+            if (record) {
+                for (size_t l = 0; l < reference.size(); l++) {
+                    LayerSum sum = summarize(reference[l]);
+                    char hash[17];
+                    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)sum.fnv);
+                    out << config << "," << size << "," << l << "," << hash << ","
+                        << sum.min << "," << sum.max << "," << sum.mean << "\n";
+                }
+                fprintf(stderr, "%-30s %5u  recorded %zu layers\n", config.c_str(), size, reference.size());
+                continue;
+            }
+
+            // The reference itself against the stored checksums
+            auto stored = golden.find(std::make_pair(config, size));
+            if (stored == golden.end()) {
+                fprintf(stderr, "%-30s %5u  %-15s no golden entry\n", config.c_str(), size, REFERENCE.name);
+                failures++;
+            } else if (stored->second.size() != reference.size()) {
+                fprintf(stderr, "%-30s %5u  %-15s FAIL %zu layers, golden has %zu\n",
+                    config.c_str(), size, REFERENCE.name, reference.size(), stored->second.size());
+                failures++;
+            } else {
+                for (size_t l = 0; l < reference.size(); l++) {
+                    LayerSum sum = summarize(reference[l]);
+                    const LayerSum& want = stored->second[l];
+                    if (sum.fnv != want.fnv) {
+                        fprintf(stderr, "%-30s %5u  %-15s FAIL layer %zu checksum %016llx, golden %016llx"
+                            " (min %+.3g, max %+.3g, mean %+.3g off)\n",
+                            config.c_str(), size, REFERENCE.name, l,
+                            (unsigned long long)sum.fnv, (unsigned long long)want.fnv,
+                            sum.min - want.min, sum.max - want.max, sum.mean - want.mean);
+                        failures++;
+                    }
+                }
+            }
+
+            // Every fast path against the reference
+            for (const EvalPath& path : PATHS) {
+                std::vector<double> steps;
+                std::vector<std::vector<GLfloat>> layers = evaluate(dir + "/" + config, size, path, &steps);
+                bool ok = layers.size() == reference.size();
+                LayerDiff total;
+                for (size_t l = 0; ok && l < layers.size(); l++) {
+                    LayerDiff diff;
+                    for (size_t i = 0; i < layers[l].size(); i++)
+                        diff.add(layers[l][i], reference[l][i], path, steps[l]);
+                    total.over += diff.over;
+
+                    for (int b = 0; b < LayerDiff::BUCKETS; b++)
+                        total.histogram[b] += diff.histogram[b];
+                    total.max_ulp = std::max(total.max_ulp, diff.max_ulp);
+                    total.max_abs = std::max(total.max_abs, diff.max_abs);
+                }
+                ok = ok && total.over == 0;
+
+                fprintf(stderr, "%-30s %5u  %-15s %s  max %u ulp, %.3g abs  ulps [0]=%llu [1]=%llu"
+                    " [2,4)=%llu [4,16)=%llu [16,256)=%llu [256,)=%llu\n",
+                    config.c_str(), size, path.name, ok ? "ok  " : "FAIL",
+                    total.max_ulp, total.max_abs,
+                    (unsigned long long)total.histogram[0], (unsigned long long)total.histogram[1],
+                    (unsigned long long)total.histogram[2], (unsigned long long)total.histogram[3],
+                    (unsigned long long)total.histogram[4], (unsigned long long)total.histogram[5]);
+                if (!ok)
+                    failures++;
+            }
+        }
+    }
+
+    if (record) {
+        fprintf(stderr, "Wrote %s\n", golden_file.c_str());
+        return 0;
+    }
+    fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
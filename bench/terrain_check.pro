@@ -0,0 +1,8 @@
+TEMPLATE = app
+TARGET = terrain_check
+
+include(common.pri)
+
+SOURCES += terrain_check.cpp
+
+OBJECTS_DIR = build/terrain_check
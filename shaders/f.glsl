@@ -1,8 +1,23 @@
 #version 330
 
-const int SHADINGMODE_NORMALS = 0;		// Show normals as colors
-const int SHADINGMODE_PHONG = 1;		// Phong shading + illumination
-const int SHADINGMODE_GOURAUD = 2;		// Gouraud shading
+#define SHADINGMODE_NORMALS 0		// Show normals as colors
+#define SHADINGMODE_PHONG 1			// Phong shading + illumination
+#define SHADINGMODE_GOURAUD 2		// Gouraud shading
+
+#define NORMALMODE_FACE 0			// Flat normals
+#define NORMALMODE_SMOOTH 1			// Smooth normals
+
+// The program is compiled once per combination of modes, GLState
+// defines these after #version
+#ifndef NORMAL_MODE
+#define NORMAL_MODE NORMALMODE_SMOOTH
+#endif
+#ifndef SHADING_MODE
+#define SHADING_MODE SHADINGMODE_PHONG
+#endif
+#ifndef PAINTED
+#define PAINTED 1					// Other layers paint the terrain
+#endif
 
 const int LIGHTTYPE_POINT = 0;			// Point light
 const int LIGHTTYPE_DIRECTIONAL = 1;	// Directional light
@@ -11,7 +26,8 @@ smooth in vec3 fragPos;		// Interpolated position in world-space
 smooth in vec3 fragNorm;	// Interpolated normal in world-space
 smooth in vec3 gouraudCol;	// Interpolated frag color
 smooth in vec3 localFragPos;	// Interpolated local pos
-smooth in vec2 fragTextureCoord;
+smooth in vec2 fragGridPoint;	// Interpolated row and column
+flat in int fragLayer;			// Layer of this surface
 
 out vec3 outCol;	// Final pixel color
 
@@ -34,6 +50,8 @@ struct PhongConfig {
 	int   enable;
 	int   drawSurface;
 	int   coverBottom;
+	float heightScale;	// Height map texel to height
+	float heightBias;
 };
 
 // Array of lights
@@ -46,7 +64,6 @@ layout (std140) uniform PhongConfigBlock {
 	PhongConfig configs [MAX_LAYERS];
 };
 
-uniform int shadingMode;		// Which shading mode
 uniform vec3 camPos;			// World-space camera position
 uniform float ambStr;			// Ambient strength
 uniform float diffStr;			// Diffuse strength
@@ -56,94 +73,175 @@ uniform vec3 objColor;			// Object color
 uniform bool drawSurface;		// If draw the surface
 uniform bool coverBottom;		// If dye the area below it to the config
 
-uniform sampler2DArray heightMap;
-uniform int originalPhongIndx;	// The initial phong config to use for the terrainbool
+uniform sampler2DArray heightMap;	// Heights of every layer
+uniform usampler2D materialMap;	// Config painting the terrain at every grid point
+
+// Short range point lights binned into froxels on the CPU, see
+// lightclusters.hpp. Froxels are ordered by slice, row and column and
+// slices grow exponentially in depth
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+uniform int localLightCount;		// 0 skips them altogether
+uniform samplerBuffer localLights;	// Position and radius, then color
+uniform usamplerBuffer lightClusters;	// Offset and count in lightIndices
+uniform usamplerBuffer lightIndices;	// Lights of every froxel
+uniform mat4 viewMat;			// World-to-view transform matrix
+uniform vec2 viewportSize;		// In pixels
+uniform vec2 clusterDepth;		// Slice of a depth is log(depth) * x + y
 
 void main() {
-	if (shadingMode == SHADINGMODE_NORMALS)
-		outCol = normalize(fragNorm) * 0.5 + vec3(0.5);
-
-	else if (shadingMode == SHADINGMODE_PHONG) {
-		// TODO ====================================================================
-		// Implement Phong illumination
-		outCol = vec3(0.0);
-
-		// TODO TESTING
-		// int i = 1;
-		// if (configs[i].enable == 1)
-		// 	outCol = configs[i].color;
-		// else
-		// 	outCol = vec3(1.0, 0.3, 0.2);
-		// return;
-		// End testing
-
-		// Determine which region this frag lies in and use the 
-		// corresponding config
-		int configIdx = originalPhongIndx;
-
-		// Only plot regions if this shape is the terrain
-		// which is the first surface
-		// we don't want ocean to be separated by forest
-		if (originalPhongIndx == 0) {
-			bool foundPhong2Use = false;
-			// Starts from the bottom, as we treat the frag below the surface
-			// to be the corresponding Phong Config
-			for (configIdx = MAX_LAYERS - 1; configIdx >= 0; configIdx--) {
-				PhongConfig config = configs[configIdx];
-
-				// Skip disable surface
-				if (configIdx == originalPhongIndx || config.enable == 0)
-					continue;
-				
-				// Below the surface, choose this config
-				// TODO Looks like the texture is not correctly read...
-				vec4 texValue = texture(heightMap, vec3(fragTextureCoord.y, fragTextureCoord.x, configIdx));
-				// vec4 texValue = texture(heightMap, vec3(localFragPos.x * 0.5 + 0.5, (-localFragPos.z) * 0.5 + 0.5, configIdx));
-				float height = texValue.r;
-				if (localFragPos.y < height) {
-					foundPhong2Use = true;
-					break;
-				}
+	// Face normal from how the position changes across the triangle
+#if NORMAL_MODE == NORMALMODE_FACE
+	vec3 norm = normalize(cross(dFdx(fragPos), dFdy(fragPos)));
+#else
+	vec3 norm = normalize(fragNorm);
+#endif
+
+#if SHADING_MODE == SHADINGMODE_NORMALS
+	outCol = norm * 0.5 + vec3(0.5);
+
+#elif SHADING_MODE == SHADINGMODE_GOURAUD && NORMAL_MODE == NORMALMODE_FACE
+	// Face normals only exist per fragment, so the Gouraud lighting of
+	// the vertex shader is evaluated here with the face normal
+	outCol = vec3(0);
+	for (int i = 0; i < MAX_LIGHTS; i++) {
+		if (!lights[i].enabled) {
+			continue;
+		} else {
+			// Add light components
+			vec3 ambient = ambStr * lights[i].color;
+
+			// Compute light direction and diffuse
+			vec3 lightDir = vec3(0);
+			if (lights[i].type == LIGHTTYPE_POINT) {
+				lightDir = normalize(lights[i].pos - fragPos);
+			} else if (lights[i].type == LIGHTTYPE_DIRECTIONAL) {
+				lightDir = normalize(lights[i].pos);
 			}
+			vec3 diffuse = diffStr * max(dot(norm, lightDir), 0) * lights[i].color;
+
+			// Specular component
+			vec3 reflection = normalize(reflect(-lightDir, norm));
+			vec3 viewDir    = normalize(camPos - fragPos);
+			vec3 specular = specStr * pow(max(dot(viewDir, reflection), 0), specExp) * lights[i].color;
 
-			// If not found, use own texture
-			if (!foundPhong2Use)
-				configIdx = originalPhongIndx;
+			outCol += (ambient + diffuse + specular) * objColor;
 		}
+	}
 
-		for (int i = 0; i < MAX_LIGHTS; i++) {
-			if (!lights[i].enabled) {
-				continue;
-			} else {
-				// Normalized
-				vec3 norm = normalize(fragNorm);
-				// Add light components
-				vec3 ambient = configs[configIdx].ambient * lights[i].color;
-
-				// Compute light direction and diffuse
-				vec3 lightDir = vec3(0);
-				if (lights[i].type == LIGHTTYPE_POINT) {
-					lightDir = normalize(lights[i].pos - fragPos);
-				} else if (lights[i].type == LIGHTTYPE_DIRECTIONAL) {
-					lightDir = normalize(lights[i].pos);
-				}
-				// vec3 diffuse = diffStr * max(dot(norm, lightDir), 0) * lights[i].color;
-				vec3 diffuse = configs[configIdx].diffuse * max(dot(norm, lightDir), 0) * lights[i].color;
-
-				// Specular component
-				vec3 reflection = normalize(reflect(-lightDir, norm));
-				vec3 viewDir    = normalize(camPos - fragPos);
-				// vec3 specular = specStr * pow(max(dot(viewDir, reflection), 0), specExp) * lights[i].color;
-				
-				vec3 specular = configs[configIdx].specular * pow(max(dot(viewDir, reflection), 0), configs[configIdx].exponent) * lights[i].color;
-
-				// outCol += (ambient + diffuse + specular) * objColor;
-				outCol += (ambient + diffuse + specular) * configs[configIdx].color;
+#elif SHADING_MODE == SHADINGMODE_PHONG
+	// TODO ====================================================================
+	// Implement Phong illumination
+	outCol = vec3(0.0);
+
+	// TODO TESTING
+	// int i = 1;
+	// if (configs[i].enable == 1)
+	// 	outCol = configs[i].color;
+	// else
+	// 	outCol = vec3(1.0, 0.3, 0.2);
+	// return;
+	// End testing
+
+	// Determine which region this frag lies in and use the 
+	// corresponding config
+	int configIdx = fragLayer;
+
+	// Only plot regions if this shape is the terrain
+	// which is the first surface
+	// we don't want ocean to be separated by forest
+	// The highest layer above the terrain at every grid point was found
+	// on the CPU, 0 keeps its own config. Inside a cell whose corners
+	// agree that is the answer, on a border only the layers of the
+	// corners are tested against the interpolated heights
+#if PAINTED
+	if (fragLayer == 0) {
+		ivec2 last = textureSize(materialMap, 0).yx - 1;
+		ivec2 cell = clamp(ivec2(floor(fragGridPoint)), ivec2(0), last);
+		ivec2 next = min(cell + 1, last);
+		uint corners[4] = uint[4](
+			texelFetch(materialMap, cell.yx, 0).r,
+			texelFetch(materialMap, ivec2(cell.y, next.x), 0).r,
+			texelFetch(materialMap, ivec2(next.y, cell.x), 0).r,
+			texelFetch(materialMap, next.yx, 0).r);
+		if (corners[0] == corners[1] && corners[0] == corners[2] && corners[0] == corners[3]) {
+			configIdx = int(corners[0]);
+		} else {
+			// Columns along s, rows along t, from the local position
+			vec2 texCoord = vec2(-localFragPos.z, localFragPos.x) * 0.5 + vec2(0.5);
+			for (int i = 0; i < 4; i++) {
+				// The highest numbered layer above the ground wins
+				int candidate = int(corners[i]);
+				if (candidate <= configIdx)
+					continue;
+				PhongConfig config = configs[candidate];
+				float height = texture(heightMap, vec3(texCoord, candidate)).r * config.heightScale + config.heightBias;
+				if (localFragPos.y < height)
+					configIdx = candidate;
+			}
+		}
+	}
+#endif
+
+	for (int i = 0; i < MAX_LIGHTS; i++) {
+		if (!lights[i].enabled) {
+			continue;
+		} else {
+			// Add light components
+			vec3 ambient = configs[configIdx].ambient * lights[i].color;
+
+			// Compute light direction and diffuse
+			vec3 lightDir = vec3(0);
+			if (lights[i].type == LIGHTTYPE_POINT) {
+				lightDir = normalize(lights[i].pos - fragPos);
+			} else if (lights[i].type == LIGHTTYPE_DIRECTIONAL) {
+				lightDir = normalize(lights[i].pos);
 			}
+			// vec3 diffuse = diffStr * max(dot(norm, lightDir), 0) * lights[i].color;
+			vec3 diffuse = configs[configIdx].diffuse * max(dot(norm, lightDir), 0) * lights[i].color;
+
+			// Specular component
+			vec3 reflection = normalize(reflect(-lightDir, norm));
+			vec3 viewDir    = normalize(camPos - fragPos);
+			// vec3 specular = specStr * pow(max(dot(viewDir, reflection), 0), specExp) * lights[i].color;
+			
+			vec3 specular = configs[configIdx].specular * pow(max(dot(viewDir, reflection), 0), configs[configIdx].exponent) * lights[i].color;
+
+			// outCol += (ambient + diffuse + specular) * objColor;
+			outCol += (ambient + diffuse + specular) * configs[configIdx].color;
+		}
+	}
+
+	// Only the lights reaching the froxel of this fragment, they fade
+	// out at their radius and add no ambient
+	if (localLightCount > 0) {
+		float depth = -(viewMat * vec4(fragPos, 1.0)).z;
+		ivec3 cluster = ivec3(ivec2(gl_FragCoord.xy / viewportSize * vec2(CLUSTER_X, CLUSTER_Y)),
+			int(floor(log(max(depth, 1e-6)) * clusterDepth.x + clusterDepth.y)));
+		cluster = clamp(cluster, ivec3(0), ivec3(CLUSTER_X - 1, CLUSTER_Y - 1, CLUSTER_Z - 1));
+		uvec2 range = texelFetch(lightClusters, (cluster.z * CLUSTER_Y + cluster.y) * CLUSTER_X + cluster.x).rg;
+		vec3 viewDir = normalize(camPos - fragPos);
+		for (uint i = 0u; i < range.y; i++) {
+			int light = int(texelFetch(lightIndices, int(range.x + i)).r);
+			vec4 posRadius = texelFetch(localLights, 2 * light);
+			vec3 lightColor = texelFetch(localLights, 2 * light + 1).rgb;
+
+			vec3 toLight = posRadius.xyz - fragPos;
+			float dist2 = dot(toLight, toLight);
+			float falloff = max(1.0 - dist2 / (posRadius.w * posRadius.w), 0.0);
+			falloff *= falloff;
+			vec3 lightDir = toLight * inversesqrt(max(dist2, 1e-12));
+
+			vec3 diffuse = configs[configIdx].diffuse * max(dot(norm, lightDir), 0) * lightColor;
+			vec3 reflection = reflect(-lightDir, norm);
+			vec3 specular = configs[configIdx].specular * pow(max(dot(viewDir, reflection), 0), configs[configIdx].exponent) * lightColor;
+			outCol += falloff * (diffuse + specular) * configs[configIdx].color;
 		}
-	} else if (shadingMode == SHADINGMODE_GOURAUD) {
-		// TODO (Extra credit) =====================================================
-		// Use Gouraud shading color
-		outCol = gouraudCol;
 	}
+#elif SHADING_MODE == SHADINGMODE_GOURAUD
+	// TODO (Extra credit) =====================================================
+	// Use Gouraud shading color
+	outCol = gouraudCol;
+#endif
 }
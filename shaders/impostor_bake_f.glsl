@@ -0,0 +1,13 @@
+#version 330
+
+smooth in vec3 fragNorm;	// Interpolated normal in species-space
+
+layout(location = 0) out vec4 outNormal;	// Normal as a color, alpha is coverage
+layout(location = 1) out float outPart;		// Part index plus one, 0 is empty
+
+uniform int part;			// Part being drawn
+
+void main() {
+	outNormal = vec4(normalize(fragNorm) * 0.5 + vec3(0.5), 1.0);
+	outPart = float(part + 1) / 255.0;
+}
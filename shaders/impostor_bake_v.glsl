@@ -0,0 +1,15 @@
+#version 330
+
+layout(location = 0) in vec3 pos;				// Model-space position
+layout(location = 2) in vec3 smooth_norm;		// Model-space smoothed normal
+
+smooth out vec3 fragNorm;	// Interpolated normal in species-space
+
+uniform mat4 bakeMat;		// Species-space to atlas tile transform matrix
+uniform mat4 speciesMat;	// Model space to unit height, base at the origin
+
+void main() {
+	// Scaling is uniform, normals keep their direction
+	fragNorm = smooth_norm;
+	gl_Position = bakeMat * speciesMat * vec4(pos, 1.0);
+}
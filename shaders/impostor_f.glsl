@@ -0,0 +1,78 @@
+#version 330
+
+const int SHADINGMODE_NORMALS = 0;		// Show normals as colors
+
+const int LIGHTTYPE_POINT = 0;			// Point light
+const int LIGHTTYPE_DIRECTIONAL = 1;	// Directional light
+
+const int IMPOSTOR_PARTS = 4;			// Parts with their own material
+
+smooth in vec3 fragPos;			// Interpolated position in world-space
+smooth in vec2 fragTexCoord;	// Position in the atlas
+flat in vec2 fragRotation;		// Cosine and sine of the yaw
+
+out vec3 outCol;	// Final pixel color
+
+// Light information
+struct LightData {
+	bool enabled;	// Whether the light is on
+	int type;		// Type of light (0 = point, 1 = directional)
+	vec3 pos;		// World-space position/direction of light source
+	vec3 color;		// Color of light
+};
+
+// Array of lights
+const int MAX_LIGHTS = 8;
+layout (std140) uniform LightBlock {
+	LightData lights [MAX_LIGHTS];
+};
+
+uniform mat4 modelMat;			// Terrain-to-world transform matrix
+uniform int shadingMode;		// Which shading mode
+uniform vec3 camPos;			// World-space camera position
+uniform sampler2D normalAtlas;	// Species-space normals, alpha is coverage
+uniform sampler2D partAtlas;	// Part index plus one
+uniform vec3 partColors[IMPOSTOR_PARTS];		// Object color of every part
+uniform vec4 partMaterials[IMPOSTOR_PARTS];	// Ambient, diffuse, specular strength and exponent
+
+void main() {
+	vec4 texel = texture(normalAtlas, fragTexCoord);
+	if (texel.a < 0.5)
+		discard;
+
+	// Filtered together with empty texels, so divide by the coverage
+	vec3 local = texel.rgb / texel.a * 2.0 - vec3(1.0);
+	float c = fragRotation.x, s = fragRotation.y;
+	mat3 yaw = mat3(c, 0.0, -s, 0.0, 1.0, 0.0, s, 0.0, c);
+	vec3 norm = normalize(vec3(modelMat * vec4(yaw * local, 0.0)));
+	if (shadingMode == SHADINGMODE_NORMALS) {
+		outCol = norm * 0.5 + vec3(0.5);
+		return;
+	}
+
+	int part = clamp(int(texture(partAtlas, fragTexCoord).r * 255.0 + 0.5) - 1, 0, IMPOSTOR_PARTS - 1);
+	vec3 objColor = partColors[part];
+	vec4 material = partMaterials[part];
+
+	// Phong illumination, also for Gouraud mode
+	outCol = vec3(0.0);
+	for (int i = 0; i < MAX_LIGHTS; i++) {
+		if (!lights[i].enabled)
+			continue;
+
+		vec3 ambient = material.x * lights[i].color;
+
+		vec3 lightDir = vec3(0);
+		if (lights[i].type == LIGHTTYPE_POINT)
+			lightDir = normalize(lights[i].pos - fragPos);
+		else if (lights[i].type == LIGHTTYPE_DIRECTIONAL)
+			lightDir = normalize(lights[i].pos);
+		vec3 diffuse = material.y * max(dot(norm, lightDir), 0) * lights[i].color;
+
+		vec3 reflection = normalize(reflect(-lightDir, norm));
+		vec3 viewDir = normalize(camPos - fragPos);
+		vec3 specular = material.z * pow(max(dot(viewDir, reflection), 0), material.w) * lights[i].color;
+
+		outCol += (ambient + diffuse + specular) * objColor;
+	}
+}
@@ -0,0 +1,40 @@
+#version 330
+
+const int IMPOSTOR_VIEWS = 8;				// Views in the atlas, around the up axis
+
+layout(location = 0) in vec2 corner;			// Billboard corner in [-1, 1]
+layout(location = 4) in vec4 instancePosScale;	// Ground point and scale
+layout(location = 5) in vec2 instanceRotation;	// Cosine and sine of the yaw
+
+smooth out vec3 fragPos;		// Interpolated position in world-space
+smooth out vec2 fragTexCoord;	// Position in the atlas
+flat out vec2 fragRotation;		// Cosine and sine of the yaw
+
+uniform mat4 modelMat;		// Terrain-to-world transform matrix
+uniform mat4 viewProjMat;	// World-to-clip transform matrix
+uniform vec3 camera;		// Terrain-space camera position
+uniform float impostorSize;	// Half the side of a billboard at unit height
+
+void main() {
+	float scale = instancePosScale.w;
+	vec3 center = instancePosScale.xyz + vec3(0.0, 0.5 * scale, 0.0);
+
+	// Turn about the up axis to face the camera
+	vec3 toCamera = vec3(camera.x - center.x, 0.0, camera.z - center.z);
+	toCamera = dot(toCamera, toCamera) > 0.0 ? normalize(toCamera) : vec3(0.0, 0.0, 1.0);
+	vec3 up = vec3(0.0, 1.0, 0.0);
+	vec3 right = cross(-toCamera, up);
+	vec3 terrainPos = center + scale * impostorSize * (corner.x * right + corner.y * up);
+
+	// Nearest baked view, from the camera side in species-space
+	float c = instanceRotation.x, s = instanceRotation.y;
+	mat3 yaw = mat3(c, 0.0, -s, 0.0, 1.0, 0.0, s, 0.0, c);
+	vec3 dir = transpose(yaw) * toCamera;
+	float views = float(IMPOSTOR_VIEWS);
+	float view = mod(round(atan(dir.x, dir.z) * views / 6.28318531), views);
+	fragTexCoord = vec2((view + corner.x * 0.5 + 0.5) / views, corner.y * 0.5 + 0.5);
+	fragRotation = instanceRotation;
+
+	fragPos = vec3(modelMat * vec4(terrainPos, 1.0));
+	gl_Position = viewProjMat * vec4(fragPos, 1.0);
+}
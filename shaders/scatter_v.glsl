@@ -0,0 +1,28 @@
+#version 330
+
+layout(location = 0) in vec3 pos;				// Model-space position
+layout(location = 2) in vec3 smooth_norm;		// Model-space smoothed normal
+layout(location = 4) in vec4 instancePosScale;	// Ground point and scale
+layout(location = 5) in vec2 instanceRotation;	// Cosine and sine of the yaw
+
+smooth out vec3 fragPos;	// Interpolated position in world-space
+smooth out vec3 fragNorm;	// Interpolated normal in world-space
+
+uniform mat4 modelMat;		// Terrain-to-world transform matrix
+uniform mat4 viewProjMat;	// World-to-clip transform matrix
+uniform mat4 speciesMat;	// Model space to unit height, base at the origin
+
+void main() {
+	// Rotate about the up axis, scale and move onto the ground
+	float c = instanceRotation.x, s = instanceRotation.y;
+	mat3 yaw = mat3(c, 0.0, -s, 0.0, 1.0, 0.0, s, 0.0, c);
+	vec3 local = yaw * vec3(speciesMat * vec4(pos, 1.0));
+	vec3 terrainPos = instancePosScale.xyz + instancePosScale.w * local;
+
+	// Get world-space position and normal
+	fragPos = vec3(modelMat * vec4(terrainPos, 1.0));
+	fragNorm = vec3(modelMat * vec4(yaw * smooth_norm, 0.0));
+
+	// Output clip-space position
+	gl_Position = viewProjMat * vec4(fragPos, 1.0);
+}
@@ -1,25 +1,57 @@
 #version 330
 
-const int NORMALMODE_FACE = 0;			// Flat normals
-const int NORMALMODE_SMOOTH = 1;		// Smooth normals
+#define NORMALMODE_FACE 0			// Flat normals
+#define NORMALMODE_SMOOTH 1			// Smooth normals
 
-const int SHADINGMODE_GOURAUD = 2;
+#define SHADINGMODE_GOURAUD 2
 
-layout(location = 0) in vec3 pos;			// Model-space position
-layout(location = 1) in vec3 face_norm;		// Model-space face normal
-layout(location = 2) in vec3 smooth_norm;	// Model-space smoothed normal
-layout(location = 3) in vec2 texture_coord;	// texture coordinate
+// Modes the program is compiled for, see f.glsl
+#ifndef NORMAL_MODE
+#define NORMAL_MODE NORMALMODE_SMOOTH
+#endif
+#ifndef SHADING_MODE
+#define SHADING_MODE 1
+#endif
 
 smooth out vec3 fragPos;	// Interpolated position in world-space
 smooth out vec3 fragNorm;	// Interpolated normal in world-space
 smooth out vec3 gouraudCol;	// Interpolated frag color
 smooth out vec3 localFragPos;	// Local interpolated frag pos
-smooth out vec2 fragTextureCoord;
+smooth out vec2 fragGridPoint;	// Interpolated row and column
 
 uniform mat4 modelMat;		// Model-to-world transform matrix
 uniform mat4 viewProjMat;	// World-to-clip transform matrix
-uniform int normalMode;		// Face normals or smooth normals
-uniform int shadingMode;	// Shading mode
+uniform ivec2 gridSize;		// Rows and columns of the grid
+
+// Layers configuration, for turning height map texels into heights
+const int MAX_LAYERS = 10;
+struct PhongConfig {
+	float ambient;
+	float diffuse;
+	float specular;
+	float exponent;
+	vec3   color;
+	int   enable;
+	int   drawSurface;
+	int   coverBottom;
+	float heightScale;	// Height map texel to height
+	float heightBias;
+};
+
+layout (std140) uniform PhongConfigBlock {
+	PhongConfig configs [MAX_LAYERS];
+};
+
+uniform sampler2DArray heightMap;	// Heights of every layer
+uniform sampler2DArray normalMap;	// Octahedral smoothed normals of every layer
+uniform int drawnLayers[MAX_LAYERS];	// Layer drawn by every instance
+
+flat out int fragLayer;		// Layer of this surface
+
+// Grid points of the two triangles of a cell, c4 c1 c2 and c2 c3 c4, as
+// row and column offsets
+const ivec2 CELL_CORNERS[6] = ivec2[6](
+	ivec2(0, 0), ivec2(1, 0), ivec2(1, 1), ivec2(1, 1), ivec2(0, 1), ivec2(0, 0));
 
 // For Gourand shading
 const int LIGHTTYPE_POINT = 0;			// Point light
@@ -46,26 +78,47 @@ uniform float diffStr;			// Diffuse strength
 uniform float specStr;			// Specular strength
 uniform float specExp;			// Specular exponent
 
+// Unfold a normal from the octahedron, the lower half sits in the corners
+vec3 decodeOctahedral(vec2 e) {
+	vec3 n = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+	if (n.y < 0.0) {
+		vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.z >= 0.0 ? 1.0 : -1.0);
+		n.xz = (vec2(1.0) - abs(n.zx)) * signs;
+	}
+	return normalize(n);
+}
+
 void main() {
-	// Choose which normals to use
-	vec3 norm;
-	if (normalMode == NORMALMODE_FACE)
-		norm = face_norm;
-	else if (normalMode == NORMALMODE_SMOOTH)
-		norm = smooth_norm;
+	// Six vertices per cell, cells row after row
+	int layer = drawnLayers[gl_InstanceID];
+	int cell = gl_VertexID / 6;
+	ivec2 point = ivec2(cell / (gridSize.y - 1), cell % (gridSize.y - 1)) + CELL_CORNERS[gl_VertexID % 6];
+	ivec3 texel = ivec3(point.y, point.x, layer);
+	float height = texelFetch(heightMap, texel, 0).r * configs[layer].heightScale + configs[layer].heightBias;
+	fragLayer = layer;
+
+	// Grid x runs along rows, height is up and columns run along -z
+	vec3 pos = vec3(2.0 * point.x / gridSize.x - 1.0, height, 1.0 - 2.0 * point.y / gridSize.y);
+	// Face normals are derived per fragment, smooth ones are read
+#if NORMAL_MODE == NORMALMODE_SMOOTH
+	vec3 norm = decodeOctahedral(texelFetch(normalMap, texel, 0).rg);
+#else
+	vec3 norm = vec3(0.0, 1.0, 0.0);
+#endif
 
 	// Get world-space position and normal
 	fragPos = vec3(modelMat * vec4(pos, 1.0));
 	fragNorm = vec3(modelMat * vec4(norm, 0.0));
 	localFragPos = pos;
-	fragTextureCoord = texture_coord;
+	fragGridPoint = vec2(point);
 
 	// Output clip-space position
 	gl_Position = viewProjMat * vec4(fragPos, 1.0);
 
 	// TODO (Extra credit) =========================================================
-	// Implement Gouraud shading
-	if (shadingMode == SHADINGMODE_GOURAUD) {
+	// Implement Gouraud shading, per fragment for face normals
+#if SHADING_MODE == SHADINGMODE_GOURAUD && NORMAL_MODE == NORMALMODE_SMOOTH
+	{
 		// Use gouraud shading
 		gouraudCol = vec3(0);
 		vec3 vertPos = fragPos;
@@ -94,4 +147,5 @@ void main() {
 			}
 		}
 	}
+#endif
 }
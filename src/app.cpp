@@ -12,8 +12,13 @@
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QFile>
+#include <QBuffer>
+#include <QMessageBox>
+#include <QInputDialog>
+#include <sstream>
 #include "app.hpp"
 #include "terrain.hpp"
+#include "profiler.hpp"
 
 // Constructor
 App::App(std::string configFile, QWidget* parent) : QWidget(parent) {
@@ -89,6 +94,8 @@ void App::initLayout(std::string configFile) {
 	terrainSizeControlLayout->addWidget(terrainWidth);
 	terrainSizeControlLayout->addWidget(new QLabel("Length:"));
 	terrainSizeControlLayout->addWidget(terrainLength);
+	quantizeHeightsCB = new QCheckBox("16-bit heights", this);
+	terrainSizeControlLayout->addWidget(quantizeHeightsCB);
 	generalLayout->addLayout(terrainSizeControlLayout, 2, 0, 1, 2);
 
 	// Randomized seed and generate terrain button
@@ -140,6 +147,23 @@ void App::initLayout(std::string configFile) {
 	shadingLayout->addWidget(normalsShadingRadio);
 	shadingGroup->addButton(normalsShadingRadio);
 	generalLayout->addLayout(shadingLayout, 7, 0, 1, 2);
+
+	// Vegetation
+	QHBoxLayout* vegetationLayout = new QHBoxLayout;
+	vegetationCB = new QCheckBox("Trees", this);
+	vegetationLayout->addWidget(vegetationCB);
+	vegetationLayout->addWidget(new QLabel("Spacing:"));
+	vegetationSpacingSpin = new QDoubleSpinBox(this);
+	vegetationSpacingSpin->setDecimals(3);
+	vegetationSpacingSpin->setRange(0.002, 0.5);
+	vegetationSpacingSpin->setSingleStep(0.005);
+	vegetationSpacingSpin->setValue(0.03);
+	vegetationLayout->addWidget(vegetationSpacingSpin);
+	generalLayout->addLayout(vegetationLayout, 8, 0, 1, 2);
+
+	// Many small point lights
+	villageLightsCB = new QCheckBox("Village lights", this);
+	generalLayout->addWidget(villageLightsCB, 9, 0, 1, 2);
 	// End of general control
 
 	// Material properties
@@ -378,6 +402,10 @@ void App::initLayout(std::string configFile) {
 	// Save image button
 	saveImageBtn = new QPushButton("Save Image", this);
 	lightLayout->addWidget(saveImageBtn);
+	exportHeightsBtn = new QPushButton("Export Heights", this);
+	lightLayout->addWidget(exportHeightsBtn);
+	exportMeshBtn = new QPushButton("Export Mesh", this);
+	lightLayout->addWidget(exportMeshBtn);
 
 	topLayout->addLayout(lightLayout);
 
@@ -395,6 +423,24 @@ void App::initLayout(std::string configFile) {
 	connect(terrainLength, QOverload<int>::of(&QSpinBox::valueChanged), [=] {
 		setTerrainSize();});
 
+	// Height storage, applies from the next generation on
+	connect(quantizeHeightsCB, &QCheckBox::clicked, [=](bool quantize) {
+		glView->getGLState().terrain->setQuantizeHeights(quantize); });
+
+	// Vegetation, placed right away on the current terrain
+	auto updateVegetation = [=] {
+		glView->getGLState().setVegetation(vegetationCB->isChecked(), vegetationSpacingSpin->value());
+		glView->update();
+	};
+	connect(vegetationCB, &QCheckBox::clicked, updateVegetation);
+	connect(vegetationSpacingSpin, QOverload<double>::of(&QDoubleSpinBox::valueChanged), updateVegetation);
+
+	// Village lights, placed right away like the trees
+	connect(villageLightsCB, &QCheckBox::clicked, [=](bool enabled) {
+		glView->getGLState().setVillageLights(enabled);
+		glView->update();
+	});
+
 	// Random button
 	connect(randomizedBtn, &QPushButton::clicked, [=] {
 		int rand_seed = dist(rd);
@@ -848,6 +894,38 @@ void App::initLayout(std::string configFile) {
 		QString filename = QFileDialog::getSaveFileName(this, tr("Save screenshot"), "./screenshot.png", tr("Images (*.png *.jpg)"));
 		image.save(filename);
 	});
+
+	connect(exportHeightsBtn, &QPushButton::clicked, [=] {
+		GLState& state = glView->getGLState();
+		QStringList layers = {"Composite terrain"};
+		for (size_t i = 0; i < state.terrain->getLayerCount(); i++)
+			layers << QString("Layer %1").arg(i);
+		bool ok = false;
+		QString layer = QInputDialog::getItem(this, tr("Export heights"), tr("Layer:"), layers, 0, false, &ok);
+		if (!ok)
+			return;
+		QString filename = QFileDialog::getSaveFileName(this, tr("Export heights"), "./heights.png",
+			tr("Height maps (*.png *.pgm *.r16 *.raw *.asc)"));
+		if (filename.isEmpty())
+			return;
+		try {
+			state.exportTerrainHeights(filename.toStdString(), layers.indexOf(layer) - 1);
+		} catch (const std::exception& e) {
+			QMessageBox::warning(this, tr("Export heights"), e.what());
+		}
+	});
+
+	connect(exportMeshBtn, &QPushButton::clicked, [=] {
+		QString filename = QFileDialog::getSaveFileName(this, tr("Export mesh"), "./terrain.glb",
+			tr("Meshes (*.glb *.gltf *.ply)"));
+		if (filename.isEmpty())
+			return;
+		try {
+			glView->getGLState().exportTerrainMesh(filename.toStdString());
+		} catch (const std::exception& e) {
+			QMessageBox::warning(this, tr("Export mesh"), e.what());
+		}
+	});
 }
 
 // Search the models/ directory for any .obj files and adds them to the combo box
@@ -1154,12 +1232,16 @@ void App::generateLayers() {
 		}
 
 		// Make sure we don't pass empty funcs vector
-		if (!funcStrings.empty())
-			state.pushTerrainLayer(std::pair(funcStrings, config));
+		try {
+			if (!funcStrings.empty())
+				state.pushTerrainLayer(std::pair(funcStrings, config));
+		} catch (const std::exception& e) {
+			QMessageBox::warning(this, "Generate", e.what());
+			return;
+		}
 	}
 
-	state.evaluateTerrain();
-	state.generateTerrain();
+	state.buildTerrain();
 	state.paintGL();
 }
 
@@ -1172,13 +1254,42 @@ void App::setTerrainSize() {
 	int width = terrainWidth->value();
 	int length = terrainLength->value();
 	printf("W: %d L: %d\n", width, length);
-	glView->getGLState().terrain->setSize(width, length);
+	glView->getGLState().resizeTerrain(width, length);
 }
 
 void App::loadConfigFile(QString& filepath) {
+	PROFILE_SCOPE("App::loadConfigFile");
+	if (filepath.endsWith(".tproj", Qt::CaseInsensitive)) {
+		// Binary project, already evaluated and meshed
+		GLState& state = glView->getGLState();
+		try {
+			state.openTerrainProject(filepath.toStdString());
+		} catch (const std::exception& e) {
+			QMessageBox::warning(this, "Open project", e.what());
+			return;
+		}
+
+		// Show its config without regenerating
+		std::ostringstream config;
+		state.terrain->dump(config);
+		QByteArray bytes = QByteArray::fromStdString(config.str());
+		QBuffer configBuf(&bytes);
+		configBuf.open(QIODevice::Text | QIODevice::ReadOnly);
+		readConfig(&configBuf);
+		glView->update();
+		return;
+	}
+
 	QFile* configFp = new QFile(filepath);
 	configFp->open(QIODevice::Text | QIODevice::ReadOnly);
+	readConfig(configFp);
+	configFp->close();
+	delete configFp;
 
+	generateLayers();
+}
+
+void App::readConfig(QIODevice* configFp) {
 	// Clear current surfaces
 	clearLayers();
 
@@ -1266,14 +1377,19 @@ void App::loadConfigFile(QString& filepath) {
 			}
 		}
 	}
-
-	configFp->close();
-	delete configFp;
-
-	generateLayers();
 }
 
 void App::saveConfigFile(QString& filepath) {
+	if (filepath.endsWith(".tproj", Qt::CaseInsensitive)) {
+		// Binary project of what is on screen
+		try {
+			glView->getGLState().saveTerrainProject(filepath.toStdString());
+		} catch (const std::exception& e) {
+			QMessageBox::warning(this, "Save project", e.what());
+		}
+		return;
+	}
+
 	// Open file to write
 	QFile* saveFp = new QFile(filepath);
 	saveFp->open(QIODevice::Text | QIODevice::WriteOnly);
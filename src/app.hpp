@@ -130,8 +130,11 @@ protected:
 	void setRandomSeed();
 	void setTerrainSize();
 	void generateLayers();
+	// *.tproj files are binary projects, anything else a config file
 	void loadConfigFile(QString& filepath);
 	void saveConfigFile(QString& filepath);
+	// Fill the widgets from config text
+	void readConfig(QIODevice* configFp);
 
 
 	// Event handlers
@@ -171,6 +174,10 @@ private:
 	QLineEdit* terrainName;
 	QSpinBox* terrainWidth;
 	QSpinBox* terrainLength;
+	QCheckBox* quantizeHeightsCB;		// Keep heights as 16-bit unorm
+	QCheckBox* vegetationCB;			// Scatter trees over the terrain
+	QDoubleSpinBox* vegetationSpacingSpin;	// Least distance between trees
+	QCheckBox* villageLightsCB;			// Point lights on flat ground
 	QPushButton* randomizedBtn;			// Roll for a new seed
 	QPushButton* generateTerrainBtn;	// Generate terrain based on current config
 	QPushButton* addSurfaceBtn;			// Add a surface control
@@ -178,6 +185,8 @@ private:
 	QPushButton* loadTerrainConfigBtn;
 	QPushButton* dumpTerrainConfigBtn;
 	QPushButton* saveImageBtn;
+	QPushButton* exportHeightsBtn;
+	QPushButton* exportMeshBtn;
 
 	// Surface control
 	QVBoxLayout* surfacesLayout;
@@ -2127,3 +2127,21 @@ static void  GL_APIENTRY _impl_glCullFace (GLenum mode) {
 }
 PFN_glCullFace _glptr_glCullFace = _impl_glCullFace;
 
+/* GL_ARB_get_program_binary, core since 4.1 */
+static void  GL_APIENTRY _impl_glGetProgramBinary (GLuint program, GLsizei bufSize, GLsizei * length, GLenum * binaryFormat, void * binary) {
+  _glptr_glGetProgramBinary = (PFN_glGetProgramBinary)GalogenGetProcAddress("glGetProgramBinary");
+   _glptr_glGetProgramBinary(program, bufSize, length, binaryFormat, binary);
+}
+PFN_glGetProgramBinary _glptr_glGetProgramBinary = _impl_glGetProgramBinary;
+
+static void  GL_APIENTRY _impl_glProgramBinary (GLuint program, GLenum binaryFormat, const void * binary, GLsizei length) {
+  _glptr_glProgramBinary = (PFN_glProgramBinary)GalogenGetProcAddress("glProgramBinary");
+   _glptr_glProgramBinary(program, binaryFormat, binary, length);
+}
+PFN_glProgramBinary _glptr_glProgramBinary = _impl_glProgramBinary;
+
+static void  GL_APIENTRY _impl_glProgramParameteri (GLuint program, GLenum pname, GLint value) {
+  _glptr_glProgramParameteri = (PFN_glProgramParameteri)GalogenGetProcAddress("glProgramParameteri");
+   _glptr_glProgramParameteri(program, pname, value);
+}
+PFN_glProgramParameteri _glptr_glProgramParameteri = _impl_glProgramParameteri;
@@ -15,22 +15,18 @@ GLState::GLState() :
 	fovy(45.0f),
 	camCoords(0.0f, 0.0f, 1.5f),
 	camRotating(false),
-	shader(0),
-	modelMatLoc(0),
-	viewProjMatLoc(0),
-	normalModeLoc(0),
-	shadingModeLoc(0),
-	camPosLoc(0),
-	objColorLoc(0),
-	ambStrLoc(0),
-	diffStrLoc(0),
-	specStrLoc(0),
-	specExpLoc(0) {}
+	objColor(0.0f),
+	ambStr(0.0f),
+	diffStr(0.0f),
+	specStr(0.0f),
+	specExp(0.0f) {
+	// Reopened configs reuse their evaluated layers
+	terrain->setCache(std::make_shared<HeightCache>(HeightCache::defaultDir()));
+}
 
 // Destructor
 GLState::~GLState() {
-	// Release OpenGL resources
-	if (shader)	glDeleteProgram(shader);
+	// OpenGL resources are released by their owners
 }
 
 // Called when OpenGL context is created (some time after construction)
@@ -53,8 +49,21 @@ void GLState::initializeGL() {
 
 	// Initialize terrain
 	// TODO: Initialize for testing purpose only
-	terrain->setShader(shader);
 	terrain->initGL();
+	localLights.initGL();
+
+	// Forest of the bundled tree model, shown once enabled
+	scatter.initGL();
+	Scatter::Species forest;
+	forest.name = "Forest";
+	forest.parts.push_back({"models/trunk.obj", Terrain::PhongConfig(0.1f, 0.7f, 0.05f, 8.0f, glm::vec3(102, 72, 40))});
+	forest.parts.push_back({"models/leaves.obj", Terrain::PhongConfig(0.1f, 0.8f, 0.1f, 16.0f, glm::vec3(58, 112, 36))});
+	forest.maxSlope = 30.0f;
+	try {
+		scatter.addSpecies(forest);
+	} catch (const std::exception& e) {
+		printf("Vegetation not available: %s\n", e.what());
+	}
 
 	// Set initialized state
 	init = true;
@@ -65,14 +74,22 @@ void GLState::paintGL() {
 	// Clear the color and depth buffers
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	// Set shader to draw with
-	glUseProgram(shader);
+	// Set shader to draw with, uploading what changed since the last frame
+	selectShader();
+	ShaderProgram& program = shader->program;
+	program.use();
+	program.set(shader->objColorLoc, objColor);
+	program.set(shader->ambStrLoc, ambStr);
+	program.set(shader->diffStrLoc, diffStr);
+	program.set(shader->specStrLoc, specStr);
+	program.set(shader->specExpLoc, specExp);
 
 	// Construct a transformation matrix for the camera
 	glm::mat4 viewProjMat(1.0f);
 	// Perspective projection
 	float aspect = (float)width / (float)height;
-	glm::mat4 proj = glm::perspective(glm::radians(fovy), aspect, 0.1f, 100.0f);
+	float zNear = 0.1f, zFar = 100.0f;
+	glm::mat4 proj = glm::perspective(glm::radians(fovy), aspect, zNear, zFar);
 	// Camera viewpoint
 	glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -camCoords.z));
 	view = glm::rotate(view, glm::radians(camCoords.y), glm::vec3(1.0f, 0.0f, 0.0f));
@@ -82,25 +99,31 @@ void GLState::paintGL() {
 	viewProjMat = proj * view;
 
 	if (terrain) {
-		// Scale and center mesh using its bounding box
-		auto terrainBB = std::pair(glm::vec3(1), glm::vec3(-1));
-		glm::mat4 modelMat = glm::scale(glm::mat4(1.0f),
-			glm::vec3(1.0f / glm::length(terrainBB.second - terrainBB.first)));
-		modelMat = glm::translate(modelMat, -(terrainBB.first + terrainBB.second) / 2.0f);
+		glm::mat4 modelMat = terrainModelMat();
 		// modelMat *= transformAxe;
 		// Upload transform matrices to shader
-		glUniformMatrix4fv(modelMatLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
-		glUniformMatrix4fv(viewProjMatLoc, 1, GL_FALSE, glm::value_ptr(viewProjMat));
+		program.set(shader->modelMatLoc, modelMat);
+		program.set(shader->viewProjMatLoc, viewProjMat);
 
 		// Get camera position and upload to shader
 		glm::vec3 camPos = glm::vec3(glm::inverse(view)[3]);
-		glUniform3fv(camPosLoc, 1, glm::value_ptr(camPos));
+		program.set(shader->camPosLoc, camPos);
+
+		// Village lights binned for this camera
+		localLights.setShader(&program);
+		localLights.bind({view, glm::radians(fovy), aspect, zNear, zFar}, glm::vec2(width, height));
 
 		// Draw the mesh
+		terrain->setShader(&program);
 		terrain->draw();
+
+		// Vegetation, in a program of its own, with the pixels a unit
+		// takes at distance 1 to pick the level of detail
+		float pixelScale = height / (2.0f * std::tan(glm::radians(fovy) / 2.0f));
+		scatter.draw(modelMat, viewProjMat, camPos, (int)shadingMode, pixelScale);
 	}
 
-	glUseProgram(0);
+	ShaderProgram::unbind();
 
 	// Draw enabled light icons (if in lighting mode)
 	if (shadingMode != SHADINGMODE_NORMALS)
@@ -116,99 +139,128 @@ void GLState::resizeGL(int w, int h) {
 	glViewport(0, 0, w, h);
 }
 
+// Show or hide the vegetation
+void GLState::setVegetation(bool enabled, float spacing) {
+	vegetationEnabled = enabled;
+	for (size_t i = 0; i < scatter.getSpeciesCount(); i++)
+		scatter.getSpecies(i).spacing = spacing;
+	placeVegetation();
+}
+
+// Scatter the vegetation over the current terrain
+void GLState::placeVegetation() {
+	if (vegetationEnabled)
+		scatter.place(*terrain, terrain->getSeed());
+	else
+		scatter.clearInstances();
+}
+
+// Show or hide the village lights
+void GLState::setVillageLights(bool enabled) {
+	villageLightsEnabled = enabled;
+	placeVillageLights();
+}
+
+// Light the flat dry spots of the terrain, spaced like a trees species
+void GLState::placeVillageLights() {
+	std::vector<LightClusters::PointLight> villageLights;
+	if (villageLightsEnabled) {
+		Scatter::Field field;
+		Scatter::readField(*terrain, field);
+		Scatter::Species villages;
+		villages.spacing = 0.1f;
+		villages.maxSlope = 15.0f;
+		std::vector<Scatter::Instance> sites;
+		Scatter::sample(field, villages, (uint64_t)terrain->getSeed() ^ 0x5eed1175u, sites);
+
+		// Hung a little above the ground, warm and short ranged
+		glm::mat4 modelMat = terrainModelMat();
+		float scale = glm::length(glm::vec3(modelMat[0]));
+		for (const Scatter::Instance& site : sites) {
+			LightClusters::PointLight light;
+			light.pos = glm::vec3(modelMat * glm::vec4(site.pos + glm::vec3(0.0f, 0.02f, 0.0f), 1.0f));
+			light.radius = 0.12f * scale;
+			light.color = glm::vec3(1.0f, 0.7f, 0.4f) * (site.scale / villages.size);
+			villageLights.push_back(light);
+		}
+	}
+	localLights.setLights(villageLights);
+	printf("Placed %zu village lights\n", villageLights.size());
+}
+
+// Scale and center the terrain using its bounding box
+glm::mat4 GLState::terrainModelMat() const {
+	auto terrainBB = std::pair(glm::vec3(1), glm::vec3(-1));
+	glm::mat4 modelMat = glm::scale(glm::mat4(1.0f),
+		glm::vec3(1.0f / glm::length(terrainBB.second - terrainBB.first)));
+	return glm::translate(modelMat, -(terrainBB.first + terrainBB.second) / 2.0f);
+}
+
 // Set the normal mode (face or smooth)
 void GLState::setNormalMode(NormalMode nm) {
+	// Picks the shader variant of the next frame
 	normalMode = nm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(normalModeLoc, (int)normalMode);
-	glUseProgram(0);
 }
 
 // Set the shading mode (normals or lighting)
 void GLState::setShadingMode(ShadingMode sm) {
+	// Picks the shader variant of the next frame
 	shadingMode = sm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(shadingModeLoc, (int)shadingMode);
-	glUseProgram(0);
 }
 
 // Get object color
 glm::vec3 GLState::getObjectColor() const {
-	glm::vec3 objColor;
-	glGetUniformfv(shader, objColorLoc, glm::value_ptr(objColor));
 	return objColor;
 }
 
 // Get ambient strength
 float GLState::getAmbientStrength() const {
-	float ambStr;
-	glGetUniformfv(shader, ambStrLoc, &ambStr);
 	return ambStr;
 }
 
 // Get diffuse strength
 float GLState::getDiffuseStrength() const {
-	float diffStr;
-	glGetUniformfv(shader, diffStrLoc, &diffStr);
 	return diffStr;
 }
 
 // Get specular strength
 float GLState::getSpecularStrength() const {
-	float specStr;
-	glGetUniformfv(shader, specStrLoc, &specStr);
 	return specStr;
 }
 
 // Get specular exponent
 float GLState::getSpecularExponent() const {
-	float specExp;
-	glGetUniformfv(shader, specExpLoc, &specExp);
 	return specExp;
 }
 
 // Set object color
 void GLState::setObjectColor(glm::vec3 color) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform3fv(objColorLoc, 1, glm::value_ptr(color));
-	glUseProgram(0);
+	// Set on the shader with the next frame
+	objColor = color;
 }
 
 // Set ambient strength
 void GLState::setAmbientStrength(float ambStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(ambStrLoc, ambStr);
-	glUseProgram(0);
+	// Set on the shader with the next frame
+	this->ambStr = ambStr;
 }
 
 // Set diffuse strength
 void GLState::setDiffuseStrength(float diffStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(diffStrLoc, diffStr);
-	glUseProgram(0);
+	// Set on the shader with the next frame
+	this->diffStr = diffStr;
 }
 
 // Set specular strength
 void GLState::setSpecularStrength(float specStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(specStrLoc, specStr);
-	glUseProgram(0);
+	// Set on the shader with the next frame
+	this->specStr = specStr;
 }
 
 // Set specular exponent
 void GLState::setSpecularExponent(float specExp) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(specExpLoc, specExp);
-	glUseProgram(0);
+	// Set on the shader with the next frame
+	this->specExp = specExp;
 }
 
 // Start rotating the camera (click + drag)
@@ -255,33 +307,45 @@ void GLState::offsetCamera(float offset) {
 
 // Create shaders and associated state
 void GLState::initShaders() {
-	// Compile and link shader files
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/v.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/f.glsl"));
-	shader = linkProgram(shaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
-
-	// Get uniform locations
-	modelMatLoc = glGetUniformLocation(shader, "modelMat");
-	viewProjMatLoc = glGetUniformLocation(shader, "viewProjMat");
-	normalModeLoc = glGetUniformLocation(shader, "normalMode");
-	shadingModeLoc = glGetUniformLocation(shader, "shadingMode");
-	camPosLoc = glGetUniformLocation(shader, "camPos");
-	objColorLoc = glGetUniformLocation(shader, "objColor");
-	ambStrLoc = glGetUniformLocation(shader, "ambStr");
-	diffStrLoc = glGetUniformLocation(shader, "diffStr");
-	specStrLoc = glGetUniformLocation(shader, "specStr");
-	specExpLoc = glGetUniformLocation(shader, "specExp");
+	// The variant of the starting modes, others as they are picked
+	selectShader();
+}
+
+void GLState::selectShader() {
+	// Without other layers there is no painting to look up
+	bool painted = terrain->getLayerCount() > 1;
+	int key = ((int)normalMode * 3 + (int)shadingMode) * 2 + (painted ? 1 : 0);
+	auto found = shaderVariants.find(key);
+	if (found != shaderVariants.end()) {
+		shader = found->second.get();
+		return;
+	}
+
+	// Compile and link shader files, uniforms are reflected once here
+	std::string defines = "#define NORMAL_MODE " + std::to_string((int)normalMode) + "\n" +
+		"#define SHADING_MODE " + std::to_string((int)shadingMode) + "\n" +
+		"#define PAINTED " + std::to_string(painted ? 1 : 0) + "\n";
+	auto variant = std::make_unique<TerrainShader>();
+	variant->program.load(":/shaders/v.glsl", ":/shaders/f.glsl", defines);
+
+	// Get uniform indices
+	ShaderProgram& program = variant->program;
+	variant->modelMatLoc = program.uniform("modelMat");
+	variant->viewProjMatLoc = program.uniform("viewProjMat");
+	variant->camPosLoc = program.uniform("camPos");
+	variant->objColorLoc = program.uniform("objColor");
+	variant->ambStrLoc = program.uniform("ambStr");
+	variant->diffStrLoc = program.uniform("diffStr");
+	variant->specStrLoc = program.uniform("specStr");
+	variant->specExpLoc = program.uniform("specExp");
 
 	// Bind lights uniform block to binding index
-	glUseProgram(shader);
-	GLuint lightBlockIndex = glGetUniformBlockIndex(shader, "LightBlock");
-	glUniformBlockBinding(shader, lightBlockIndex, Light::BIND_PT);
-	glUseProgram(0);
+	program.bindBlock("LightBlock", Light::BIND_PT);
+
+	shader = variant.get();
+	shaderVariants[key] = std::move(variant);
+	printf("Compiled terrain shader for normal mode %d, shading mode %d, painted %d\n",
+		(int)normalMode, (int)shadingMode, painted ? 1 : 0);
 }
 
 
@@ -4,11 +4,17 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <map>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
 #include "mesh.hpp"
 #include "light.hpp"
 #include "terrain.hpp"
+#include "heightexport.hpp"
+#include "meshexport.hpp"
+#include "scatter.hpp"
+#include "lightclusters.hpp"
+#include "shaderprogram.hpp"
 
 // Manages OpenGL state, e.g. camera transform, objects, shaders
 class GLState {
@@ -77,22 +83,104 @@ public:
 
 	// TODO Terrain control function goes here
 	void clearTerrainLayers() {
+		waitForExports();
 		terrain->clearAllLayers();
 	};
 
 	void pushTerrainLayer(std::pair<std::vector<std::string>, Terrain::PhongConfig> layer) {
 		printf("%s:%s:%d pushing functions with first one: %s and color of %f %f %f\n", __FILE__, __func__, __LINE__, layer.first[0].c_str(), layer.second.color.r, layer.second.color.g, layer.second.color.b);
-		
+		waitForExports();
 		terrain->pushLayer(layer);
 	}
 
 	void evaluateTerrain() {
 		printf("%s:%s:%d computing height map\n", __FILE__, __func__, __LINE__);
+		waitForExports();
 		terrain->evaluate();
 	};
 	void generateTerrain() {
 		printf("%s:%s:%d generate terrain vertices\n", __FILE__, __func__, __LINE__);
+		waitForExports();
 		terrain->generate();
+		placeVegetation();
+		placeVillageLights();
+	};
+	void resizeTerrain(uint32_t width, uint32_t length) {
+		waitForExports();
+		terrain->setSize(width, length);
+	};
+	// Evaluate and generate in one pipelined pass
+	void buildTerrain() {
+		printf("%s:%s:%d building terrain\n", __FILE__, __func__, __LINE__);
+		waitForExports();
+		terrain->build();
+		placeVegetation();
+		placeVillageLights();
+	};
+	// Binary projects, see project.hpp
+	void openTerrainProject(const std::string& filename) {
+		printf("%s:%s:%d opening project %s\n", __FILE__, __func__, __LINE__, filename.c_str());
+		waitForExports();
+		terrain->openProject(filename);
+		placeVegetation();
+		placeVillageLights();
+	};
+	void saveTerrainProject(const std::string& filename) {
+		printf("%s:%s:%d saving project %s\n", __FILE__, __func__, __LINE__, filename.c_str());
+		terrain->saveProject(filename);
+	};
+	// Write the heights of a layer, -1 for the composite terrain, in the
+	// format given by the extension. Runs in the background, changes to
+	// the terrain wait for it
+	void exportTerrainHeights(const std::string& filename, int layer) {
+		printf("%s:%s:%d exporting layer %d heights to %s\n", __FILE__, __func__, __LINE__, layer, filename.c_str());
+		HeightExporter::Format format = HeightExporter::formatOf(filename);
+		if (layer >= (int)terrain->getLayerCount())
+			throw std::out_of_range("No evaluated layer " + std::to_string(layer));
+
+		HeightExporter::Source source;
+		source.rows = terrain->getWidth();
+		source.cols = terrain->getLength();
+		Terrain* t = terrain.get();
+		source.readRow = [t, layer](uint32_t row, float* heights) { t->readHeightRow(layer, row, heights); };
+		heightExporter.start(filename, format, source);
+	};
+	// Write every drawn surface as an indexed mesh, in the format given
+	// by the extension. Runs in the background like height exports
+	void exportTerrainMesh(const std::string& filename) {
+		printf("%s:%s:%d exporting terrain mesh to %s\n", __FILE__, __func__, __LINE__, filename.c_str());
+		MeshExporter::Format format = MeshExporter::formatOf(filename);
+
+		MeshExporter::Source source;
+		source.rows = terrain->getWidth();
+		source.cols = terrain->getLength();
+		Terrain* t = terrain.get();
+		for (int layer : terrain->drawnLayers()) {
+			MeshExporter::Layer surface;
+			surface.name = "Layer " + std::to_string(layer);
+			glm::vec3 color = terrain->getLayerConfig(layer).color / 255.0f;
+			surface.color[0] = color.r;
+			surface.color[1] = color.g;
+			surface.color[2] = color.b;
+			surface.readRow = [t, layer](uint32_t row, float* heights) { t->readHeightRow(layer, row, heights); };
+			source.layers.push_back(surface);
+		}
+		meshExporter.start(filename, format, source);
+	};
+	// Trees scattered over the terrain, spacing is the least distance
+	// between two in terrain units. Placed again whenever the terrain is
+	// rebuilt
+	void setVegetation(bool enabled, float spacing);
+	bool getVegetationEnabled() const { return vegetationEnabled; }
+	size_t getVegetationCount() const { return scatter.getInstanceCount(); }
+	// Hundreds of short range point lights on flat ground above water,
+	// placed again with the terrain like the trees
+	void setVillageLights(bool enabled);
+	bool getVillageLightsEnabled() const { return villageLightsEnabled; }
+	size_t getVillageLightCount() const { return localLights.getLightCount(); }
+	void waitForExports() {
+		heightExporter.wait();
+		meshExporter.wait();
 	};
 
 protected:
@@ -100,6 +188,12 @@ protected:
 
 	// Initialization
 	void initShaders();
+	// Terrain shader variant for the current modes, compiled on first use
+	void selectShader();
+	void placeVegetation();
+	void placeVillageLights();
+	// Terrain space to world space
+	glm::mat4 terrainModelMat() const;
 
 	// Drawing modes
 	NormalMode normalMode;
@@ -117,19 +211,36 @@ protected:
 	std::string meshFilename;		// Name of the obj file being shown
 	// std::unique_ptr<Mesh> mesh;		// Pointer to mesh object
 	std::vector<Light> lights;		// Lights
-
-	// Shader state
-	GLuint shader;			// GPU shader program
-	GLuint modelMatLoc;		// Model-to-world matrix location
-	GLuint viewProjMatLoc;	// World-to-clip matrix location
-	GLuint normalModeLoc;	// Normal mode location
-	GLuint shadingModeLoc;	// Shading mode location
-	GLuint camPosLoc;		// Camera position location
-	GLuint objColorLoc;		// Object color
-	GLuint ambStrLoc;		// Ambient strength location
-	GLuint diffStrLoc;		// Diffuse strength location
-	GLuint specStrLoc;		// Specular strength location
-	GLuint specExpLoc;		// Specular exponent location
+	HeightExporter heightExporter;	// Background height map exports
+	MeshExporter meshExporter;		// Background mesh exports
+	Scatter scatter;				// Vegetation instances
+	bool vegetationEnabled = false;
+	LightClusters localLights;		// Village lights
+	bool villageLightsEnabled = false;
+
+	// Object properties, set on the shader in use every frame
+	glm::vec3 objColor;		// Object color
+	float ambStr;			// Ambient strength
+	float diffStr;			// Diffuse strength
+	float specStr;			// Specular strength
+	float specExp;			// Specular exponent
+
+	// Shader state. The terrain shader is compiled with the normal mode,
+	// the shading mode and whether other layers paint the terrain as
+	// #defines, so every pixel only runs the code of the modes in use
+	struct TerrainShader {
+		ShaderProgram program;	// GPU shader program
+		int modelMatLoc;		// Model-to-world matrix location
+		int viewProjMatLoc;		// World-to-clip matrix location
+		int camPosLoc;			// Camera position location
+		int objColorLoc;		// Object color
+		int ambStrLoc;			// Ambient strength location
+		int diffStrLoc;			// Diffuse strength location
+		int specStrLoc;			// Specular strength location
+		int specExpLoc;			// Specular exponent location
+	};
+	std::map<int, std::unique_ptr<TerrainShader>> shaderVariants;	// By mode key
+	TerrainShader* shader = nullptr;	// Variant drawing the current frame
 };
 
 #endif
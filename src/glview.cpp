@@ -2,6 +2,7 @@
 #include "glview.hpp"
 #include <QTimer>
 #include <iostream>
+#include "profiler.hpp"
 
 // Constructor
 GLView::GLView(QWidget* parent) :
@@ -263,6 +264,16 @@ void GLView::keyPressEvent(QKeyEvent* e) {
 		emit lightTypeChanged(activeLight);
 		update();
 		break; }
+	// Dump the profiler events as Chrome trace, Shift also clears them
+	case Qt::Key_P: {
+		Profiler& profiler = Profiler::instance();
+		if (!profiler.dump("trace.json"))
+			std::cout << "Failed to write trace.json" << std::endl;
+		if (e->modifiers() & Qt::ShiftModifier) {
+			profiler.clear();
+			std::cout << "Cleared profiler events" << std::endl;
+		}
+		break; }
 	default:
 		QOpenGLWidget::keyPressEvent(e);
 		break;
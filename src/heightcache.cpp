@@ -0,0 +1,172 @@
+#include "heightcache.hpp"
+#include "mappedfile.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+static const char CACHE_MAGIC[4] = {'T', 'R', 'H', 'C'};
+
+// 64-bit FNV-1a
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+HeightCache::HeightCache(const std::string& dir, uint64_t maxBytes) :
+	dir(dir),
+	maxBytes(maxBytes) {}
+
+std::string HeightCache::defaultDir() {
+#ifdef _WIN32
+	const char* base = getenv("LOCALAPPDATA");
+	if (base && *base)
+		return std::string(base) + "/terrain-modeling/cache";
+#else
+	const char* base = getenv("XDG_CACHE_HOME");
+	if (base && *base)
+		return std::string(base) + "/terrain-modeling";
+	const char* home = getenv("HOME");
+	if (home && *home)
+		return std::string(home) + "/.cache/terrain-modeling";
+#endif
+	return ".terrain-cache";
+}
+
+uint64_t HeightCache::fingerprint(int64_t seed, uint32_t width, uint32_t length,
+		const std::vector<std::string>& funcs) {
+	uint64_t hash = 1469598103934665603ull;
+	uint32_t version = EVALUATOR_VERSION;
+	hash = fnv1a(&version, sizeof(version), hash);
+	hash = fnv1a(&seed, sizeof(seed), hash);
+	hash = fnv1a(&width, sizeof(width), hash);
+	hash = fnv1a(&length, sizeof(length), hash);
+	for (const std::string& func : funcs) {
+		// Lengths keep {"ab", "c"} apart from {"a", "bc"}
+		uint64_t size = func.size();
+		hash = fnv1a(&size, sizeof(size), hash);
+		hash = fnv1a(func.data(), func.size(), hash);
+	}
+	return hash;
+}
+
+std::string HeightCache::pathOf(uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.layer", (unsigned long long)key);
+	return dir + "/" + name;
+}
+
+bool HeightCache::load(uint64_t key, uint32_t width, uint32_t length, float* heights) {
+	std::string path = pathOf(key);
+	MappedFile file;
+	if (!file.open(path))
+		return false;
+
+	// Reject files of another version, size or key
+	size_t bytes = (size_t)width * length * sizeof(float);
+	Header header;
+	if (file.size() != sizeof(Header) + bytes)
+		return false;
+	memcpy(&header, file.data(), sizeof(Header));
+	if (memcmp(header.magic, CACHE_MAGIC, 4) != 0 || header.version != EVALUATOR_VERSION ||
+			header.key != key || header.width != width || header.length != length)
+		return false;
+
+	memcpy(heights, file.data() + sizeof(Header), bytes);
+
+	// Mark as recently used
+	std::error_code ec;
+	fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+	return true;
+}
+
+void HeightCache::store(uint64_t key, uint32_t width, uint32_t length, const float* heights) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::error_code ec;
+	fs::create_directories(dir, ec);
+
+	// Write aside and rename, readers never see a partial file
+	std::string path = pathOf(key);
+	std::string temp = path + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary);
+		Header header;
+		memcpy(header.magic, CACHE_MAGIC, 4);
+		header.version = EVALUATOR_VERSION;
+		header.key = key;
+		header.width = width;
+		header.length = length;
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)heights, (std::streamsize)width * length * sizeof(float));
+		if (!out) {
+			printf("Cannot write height cache file %s\n", temp.c_str());
+			out.close();
+			fs::remove(temp, ec);
+			return;
+		}
+	}
+	fs::rename(temp, path, ec);
+	if (ec) {
+		printf("Cannot move height cache file to %s: %s\n", path.c_str(), ec.message().c_str());
+		fs::remove(temp, ec);
+		return;
+	}
+
+	evictLocked();
+}
+
+void HeightCache::evict() {
+	std::lock_guard<std::mutex> guard(lock);
+	evictLocked();
+}
+
+void HeightCache::evictLocked() {
+	struct Entry {
+		fs::path path;
+		uint64_t size;
+		fs::file_time_type used;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+
+	std::error_code ec;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+		if (it->path().extension() != ".layer")
+			continue;
+		std::error_code entry_ec;
+		Entry entry = {it->path(), (uint64_t)it->file_size(entry_ec), it->last_write_time(entry_ec)};
+		if (entry_ec)
+			continue;
+		total += entry.size;
+		entries.push_back(entry);
+	}
+	if (total <= maxBytes)
+		return;
+
+	// Oldest first
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.used < b.used;
+	});
+	for (const Entry& entry : entries) {
+		if (total <= maxBytes)
+			break;
+		if (fs::remove(entry.path, ec))
+			total -= entry.size;
+	}
+}
+
+void HeightCache::clear() {
+	std::lock_guard<std::mutex> guard(lock);
+	std::error_code ec;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+		std::error_code remove_ec;
+		if (it->path().extension() == ".layer")
+			fs::remove(it->path(), remove_ec);
+	}
+}
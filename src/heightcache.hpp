@@ -0,0 +1,72 @@
+#ifndef HEIGHTCACHE_HPP
+#define HEIGHTCACHE_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// On-disk cache of evaluated layers
+//
+// A layer only depends on the seed, the grid size and its own functions,
+// so each one is stored under a fingerprint of exactly those plus the
+// evaluator version, one file per layer. Editing one layer of a config
+// leaves the other layers cached. Files are memory mapped when read and
+// written through a temporary file, so a crash never leaves half a layer
+// behind. Once the directory grows past its budget the least recently
+// used files are deleted, hits refresh a file's modification time.
+class HeightCache {
+public:
+	// Bump whenever evaluation changes its results, which invalidates
+	// every cached layer
+	static const uint32_t EVALUATOR_VERSION = 1;
+	static const uint64_t DEFAULT_MAX_BYTES = 1ull << 30;
+
+	// dir is created on first store
+	HeightCache(const std::string& dir, uint64_t maxBytes = DEFAULT_MAX_BYTES);
+
+	// Per user cache folder, $XDG_CACHE_HOME/terrain-modeling or the
+	// platform equivalent
+	static std::string defaultDir();
+
+	// Fingerprint of one layer
+	static uint64_t fingerprint(int64_t seed, uint32_t width, uint32_t length,
+		const std::vector<std::string>& funcs);
+
+	// Copy the heights stored under key into heights, which must hold
+	// width * length values. Returns false on a miss
+	bool load(uint64_t key, uint32_t width, uint32_t length, float* heights);
+	// Store width * length heights under key, failures are only logged
+	void store(uint64_t key, uint32_t width, uint32_t length, const float* heights);
+
+	// Delete least recently used files until the cache fits maxBytes
+	void evict();
+	void clear();
+
+	const std::string& getDir() const { return dir; }
+	uint64_t getMaxBytes() const { return maxBytes; }
+	void setMaxBytes(uint64_t b) { maxBytes = b; }
+
+	// Disallow copy & assignment
+	HeightCache(const HeightCache& other) = delete;
+	HeightCache& operator=(const HeightCache& other) = delete;
+
+protected:
+	// File header, followed by width * length floats
+	struct Header {
+		char magic[4];		// "TRHC"
+		uint32_t version;	// EVALUATOR_VERSION
+		uint64_t key;
+		uint32_t width;
+		uint32_t length;
+	};
+
+	std::string pathOf(uint64_t key) const;
+	void evictLocked();
+
+	std::string dir;
+	uint64_t maxBytes;
+	std::mutex lock;	// Serializes eviction against stores
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include "heightexport.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+// PNG chunks are checksummed with CRC-32, the zlib stream with Adler-32
+static uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc) {
+	static uint32_t table[256];
+	static bool tableReady = [] {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return true;
+	}();
+	(void)tableReady;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler) {
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	for (size_t i = 0; i < size; i++) {
+		a = (a + data[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+static void putBE32(unsigned char* out, uint32_t v) {
+	out[0] = v >> 24;
+	out[1] = v >> 16;
+	out[2] = v >> 8;
+	out[3] = v;
+}
+
+// Streams a PNG: a chunk per row, each one stored deflate block
+class PNGWriter {
+public:
+	PNGWriter(std::ofstream& out) : out(out) {}
+
+	void begin(uint32_t width, uint32_t height) {
+		static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+		out.write((const char*)signature, sizeof(signature));
+
+		unsigned char header[13];
+		putBE32(header, width);
+		putBE32(header + 4, height);
+		header[8] = 16;		// Bit depth
+		header[9] = 0;		// Grayscale
+		header[10] = 0;		// Deflate
+		header[11] = 0;		// Adaptive filtering
+		header[12] = 0;		// Not interlaced
+		chunk("IHDR", header, sizeof(header));
+	}
+
+	// One scanline, filter byte included
+	void row(const unsigned char* data, size_t size, bool last) {
+		std::vector<unsigned char>& block = buffer;
+		block.clear();
+		if (first) {
+			block.push_back(0x78);	// zlib header, deflate with 32K window
+			block.push_back(0x01);
+			first = false;
+		}
+
+		// Stored blocks hold at most 65535 bytes
+		size_t done = 0;
+		do {
+			size_t n = std::min<size_t>(size - done, 65535);
+			bool final = last && done + n == size;
+			block.push_back(final ? 1 : 0);
+			block.push_back(n & 0xff);
+			block.push_back(n >> 8);
+			block.push_back(~n & 0xff);
+			block.push_back((~n >> 8) & 0xff);
+			block.insert(block.end(), data + done, data + done + n);
+			done += n;
+		} while (done < size);
+		adler = adler32(data, size, adler);
+
+		if (last) {
+			unsigned char checksum[4];
+			putBE32(checksum, adler);
+			block.insert(block.end(), checksum, checksum + 4);
+		}
+		chunk("IDAT", block.data(), block.size());
+	}
+
+	void end() {
+		chunk("IEND", nullptr, 0);
+	}
+
+protected:
+	void chunk(const char* type, const unsigned char* data, size_t size) {
+		unsigned char word[4];
+		putBE32(word, size);
+		out.write((const char*)word, 4);
+		out.write(type, 4);
+		if (size)
+			out.write((const char*)data, size);
+		uint32_t crc = crc32((const unsigned char*)type, 4, 0);
+		crc = crc32(data, size, crc);
+		putBE32(word, crc);
+		out.write((const char*)word, 4);
+	}
+
+	std::ofstream& out;
+	std::vector<unsigned char> buffer;
+	uint32_t adler = 1;
+	bool first = true;
+};
+
+HeightExporter::Format HeightExporter::formatOf(const std::string& filename) {
+	std::string ext = filename.substr(std::min(filename.rfind('.'), filename.size()));
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return tolower(c); });
+	if (ext == ".pgm")
+		return FORMAT_PGM16;
+	if (ext == ".png")
+		return FORMAT_PNG16;
+	if (ext == ".r16")
+		return FORMAT_RAW16;
+	if (ext == ".raw")
+		return FORMAT_RAW32F;
+	if (ext == ".asc")
+		return FORMAT_ASCII_GRID;
+	throw std::invalid_argument("Unknown height map format: " + filename);
+}
+
+void HeightExporter::write(const std::string& filename, Format format, const Source& source,
+		const std::atomic<bool>* stop, std::atomic<uint32_t>* rowsDone) {
+	if (source.rows == 0 || source.cols == 0 || !source.readRow)
+		throw std::runtime_error("Nothing to export");
+
+	auto stopped = [&] { return stop && stop->load(std::memory_order_relaxed); };
+	auto progress = [&](uint32_t row) {
+		if (rowsDone)
+			rowsDone->store(row, std::memory_order_relaxed);
+	};
+	std::vector<float> heights(source.cols);
+
+	// Range for the 16-bit formats
+	bool is16 = format == FORMAT_PGM16 || format == FORMAT_PNG16 || format == FORMAT_RAW16;
+	float lo = INFINITY, hi = -INFINITY;
+	if (is16) {
+		for (uint32_t row = 0; row < source.rows && !stopped(); row++) {
+			source.readRow(row, heights.data());
+			for (float h : heights) {
+				lo = std::min(lo, h);
+				hi = std::max(hi, h);
+			}
+			progress(row + 1);
+		}
+	}
+	float scale = hi > lo ? 65535.0f / (hi - lo) : 0.0f;
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		throw std::runtime_error("Cannot write " + filename);
+
+	// Headers
+	PNGWriter png(out);
+	if (format == FORMAT_PGM16) {
+		out << "P5\n" << source.cols << " " << source.rows << "\n65535\n";
+	} else if (format == FORMAT_PNG16) {
+		png.begin(source.cols, source.rows);
+	} else if (format == FORMAT_ASCII_GRID) {
+		// Grid spans [-1, 1] in both directions, as evaluated
+		char header[256];
+		double dx = 2.0 / source.cols, dy = 2.0 / source.rows;
+		if (dx == dy)
+			snprintf(header, sizeof(header), "ncols %u\nnrows %u\nxllcorner -1\nyllcorner -1\ncellsize %.17g\n",
+				source.cols, source.rows, dx);
+		else
+			snprintf(header, sizeof(header), "ncols %u\nnrows %u\nxllcorner -1\nyllcorner -1\ndx %.17g\ndy %.17g\n",
+				source.cols, source.rows, dx, dy);
+		out << header << "NODATA_value -9999\n";
+	}
+
+	// Rows, the same buffer is reused for every one
+	size_t rowBytes = format == FORMAT_PNG16 ? 1 + source.cols * 2 :
+		format == FORMAT_RAW32F ? source.cols * 4 : source.cols * 2;
+	std::vector<unsigned char> bytes(format == FORMAT_ASCII_GRID ? 0 : rowBytes);
+	std::string text;
+	for (uint32_t row = 0; row < source.rows && !stopped(); row++) {
+		source.readRow(row, heights.data());
+
+		if (format == FORMAT_ASCII_GRID) {
+			text.clear();
+			char value[32];
+			for (uint32_t col = 0; col < source.cols; col++) {
+				int n = snprintf(value, sizeof(value), col ? " %.9g" : "%.9g", heights[col]);
+				text.append(value, n);
+			}
+			text.push_back('\n');
+			out.write(text.data(), text.size());
+		} else if (format == FORMAT_RAW32F) {
+			for (uint32_t col = 0; col < source.cols; col++) {
+				uint32_t bits;
+				memcpy(&bits, &heights[col], 4);
+				unsigned char* b = &bytes[col * 4];
+				b[0] = bits;
+				b[1] = bits >> 8;
+				b[2] = bits >> 16;
+				b[3] = bits >> 24;
+			}
+			out.write((const char*)bytes.data(), bytes.size());
+		} else {
+			// PGM and PNG are big endian, PNG rows start with a filter byte
+			bool bigEndian = format != FORMAT_RAW16;
+			unsigned char* b = bytes.data();
+			if (format == FORMAT_PNG16)
+				*b++ = 0;
+			for (uint32_t col = 0; col < source.cols; col++, b += 2) {
+				uint16_t v = (uint16_t)std::lround(std::clamp((heights[col] - lo) * scale, 0.0f, 65535.0f));
+				b[bigEndian ? 0 : 1] = v >> 8;
+				b[bigEndian ? 1 : 0] = v & 0xff;
+			}
+			if (format == FORMAT_PNG16)
+				png.row(bytes.data(), bytes.size(), row + 1 == source.rows);
+			else
+				out.write((const char*)bytes.data(), bytes.size());
+		}
+		progress(row + 1);
+	}
+	if (format == FORMAT_PNG16 && !stopped())
+		png.end();
+
+	if (!out)
+		throw std::runtime_error("Cannot write " + filename);
+	if (is16 && !stopped())
+		printf("Height range %g to %g mapped to 0 to 65535\n", lo, hi);
+}
+
+void HeightExporter::start(const std::string& filename, Format format, Source source) {
+	wait();
+	stop = false;
+	rowsDone = 0;
+	running = true;
+	worker = std::thread([this, filename, format, source] {
+		auto begin = std::chrono::steady_clock::now();
+		try {
+			write(filename, format, source, &stop, &rowsDone);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			if (stop)
+				printf("Export of %s cancelled\n", filename.c_str());
+			else
+				printf("Exported %s, %ux%u in %.1f ms\n", filename.c_str(), source.cols, source.rows, elapsed.count());
+		} catch (const std::exception& e) {
+			printf("Export of %s failed: %s\n", filename.c_str(), e.what());
+		}
+		running = false;
+	});
+}
+
+void HeightExporter::wait() {
+	if (worker.joinable())
+		worker.join();
+}
+
+void HeightExporter::cancel() {
+	stop = true;
+	wait();
+}
@@ -0,0 +1,65 @@
+#ifndef HEIGHTEXPORT_HPP
+#define HEIGHTEXPORT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Writes height maps in interchange formats
+//
+// Heights are pulled one row at a time from a Source and written out
+// right away, so only a row or two are ever held in memory whatever
+// the size of the grid. 16-bit formats map the range of the heights to
+// 0..65535, which takes a first pass over the rows to find it. Exports
+// run on a thread of their own, see start().
+class HeightExporter {
+public:
+	enum Format {
+		FORMAT_PGM16 = 0,		// Binary PGM, 16-bit big endian
+		FORMAT_PNG16 = 1,		// Grayscale PNG, 16-bit, stored uncompressed
+		FORMAT_RAW16 = 2,		// Headerless 16-bit little endian
+		FORMAT_RAW32F = 3,		// Headerless float little endian
+		FORMAT_ASCII_GRID = 4,	// ESRI ASCII grid
+	};
+
+	// Heights of a grid with rows rows of cols values
+	struct Source {
+		uint32_t rows = 0;
+		uint32_t cols = 0;
+		std::function<void(uint32_t row, float* heights)> readRow;
+	};
+
+	HeightExporter() {}
+	~HeightExporter() { cancel(); }
+	// Disallow copy & assignment
+	HeightExporter(const HeightExporter& other) = delete;
+	HeightExporter& operator=(const HeightExporter& other) = delete;
+
+	// Format from the extension: .pgm, .png, .r16, .raw and .asc
+	// Throws std::invalid_argument on anything else
+	static Format formatOf(const std::string& filename);
+
+	// Export on the calling thread, throws std::runtime_error on failure.
+	// Setting stop makes it return early, leaving a partial file
+	static void write(const std::string& filename, Format format, const Source& source,
+		const std::atomic<bool>* stop = nullptr, std::atomic<uint32_t>* rowsDone = nullptr);
+
+	// Export in the background, waiting for the previous one first.
+	// source must stay valid until it finishes, failures are logged
+	void start(const std::string& filename, Format format, Source source);
+	void wait();
+	void cancel();		// Stop the running export and wait for it
+	bool isRunning() const { return running; }
+	// Rows written by the current export, a second pass for 16-bit formats
+	uint32_t getRowsDone() const { return rowsDone; }
+
+protected:
+	std::thread worker;
+	std::atomic<bool> running{false};
+	std::atomic<bool> stop{false};
+	std::atomic<uint32_t> rowsDone{0};
+};
+
+#endif
@@ -258,14 +258,7 @@ int Light::findAvailableIndex() {
 
 // Compile and link shader
 void Light::initShader() {
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/icon_v.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/icon_f.glsl"));
-	shader = linkProgram(shaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
+	shader = loadProgram(":/shaders/icon_v.glsl", ":/shaders/icon_f.glsl");
 
 	// Get uniform locations
 	colorLoc = glGetUniformLocation(shader, "color");
@@ -0,0 +1,215 @@
+#include "lightclusters.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <glm/gtc/type_ptr.hpp>
+#include "scheduler.hpp"
+#include "profiler.hpp"
+
+// Texture units of the buffers, after those of the terrain
+static const GLint LIGHT_UNIT = 3;
+static const GLint RANGE_UNIT = 4;
+static const GLint INDEX_UNIT = 5;
+
+bool LightClusters::Camera::operator==(const Camera& other) const {
+	return std::memcmp(glm::value_ptr(view), glm::value_ptr(other.view), sizeof(view)) == 0 &&
+		fovy == other.fovy && aspect == other.aspect && zNear == other.zNear && zFar == other.zFar;
+}
+
+void LightClusters::initGL() {
+	GLuint* bufs[] = {&lightBuf, &rangeBuf, &indexBuf};
+	GLuint* texs[] = {&lightTex, &rangeTex, &indexTex};
+	GLenum formats[] = {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+	for (int i = 0; i < 3; i++) {
+		glGenBuffers(1, bufs[i]);
+		glBindBuffer(GL_TEXTURE_BUFFER, *bufs[i]);
+		glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_DYNAMIC_DRAW);
+		glGenTextures(1, texs[i]);
+		glBindTexture(GL_TEXTURE_BUFFER, *texs[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], *bufs[i]);
+	}
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void LightClusters::setShader(ShaderProgram* s) {
+	if (s == shader)
+		return;
+	shader = s;
+	shader->set("localLights", LIGHT_UNIT);
+	shader->set("lightClusters", RANGE_UNIT);
+	shader->set("lightIndices", INDEX_UNIT);
+	lightCountLoc = shader->uniform("localLightCount");
+	viewMatLoc = shader->uniform("viewMat");
+	viewportLoc = shader->uniform("viewportSize");
+	clusterDepthLoc = shader->uniform("clusterDepth");
+}
+
+void LightClusters::release() {
+	GLuint bufs[] = {lightBuf, rangeBuf, indexBuf};
+	GLuint texs[] = {lightTex, rangeTex, indexTex};
+	for (int i = 0; i < 3; i++) {
+		if (bufs[i])
+			glDeleteBuffers(1, &bufs[i]);
+		if (texs[i])
+			glDeleteTextures(1, &texs[i]);
+	}
+	lightBuf = rangeBuf = indexBuf = 0;
+	lightTex = rangeTex = indexTex = 0;
+}
+
+void LightClusters::setLights(const std::vector<PointLight>& lights) {
+	if (lights.size() > MAX_LIGHTS)
+		throw std::runtime_error("Cannot place more than " + std::to_string(MAX_LIGHTS) + " point lights");
+	this->lights = lights;
+	binned = false;
+
+	glBindBuffer(GL_TEXTURE_BUFFER, lightBuf);
+	glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(lights.size() * sizeof(PointLight), 16),
+		lights.empty() ? nullptr : lights.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void LightClusters::bind(const Camera& camera, glm::vec2 viewport) {
+	shader->set(lightCountLoc, (int)lights.size());
+	if (lights.empty())
+		return;
+
+	if (!binned || !(camera == lastCamera)) {
+		bin(lights, camera, ranges, indices);
+		// Orphan the old contents, the last frame may still read them
+		glBindBuffer(GL_TEXTURE_BUFFER, rangeBuf);
+		glBufferData(GL_TEXTURE_BUFFER, ranges.size() * sizeof(uint32_t), ranges.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, indexBuf);
+		glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(indices.size() * sizeof(uint16_t), 16),
+			indices.empty() ? nullptr : indices.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		lastCamera = camera;
+		binned = true;
+	}
+
+	// Slice of a depth is log(depth) * x + y
+	float depthScale = GRID_Z / std::log(camera.zFar / camera.zNear);
+	shader->set(viewMatLoc, camera.view);
+	shader->set(viewportLoc, viewport);
+	shader->set(clusterDepthLoc, glm::vec2(depthScale, -std::log(camera.zNear) * depthScale));
+
+	glActiveTexture(GL_TEXTURE0 + INDEX_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, indexTex);
+	glActiveTexture(GL_TEXTURE0 + RANGE_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, rangeTex);
+	glActiveTexture(GL_TEXTURE0 + LIGHT_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, lightTex);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void LightClusters::bin(const std::vector<PointLight>& lights, const Camera& camera,
+		std::vector<uint32_t>& ranges, std::vector<uint16_t>& indices) {
+	PROFILE_SCOPE("LightClusters::bin");
+	float tanY = std::tan(camera.fovy / 2.0f);
+	float tanX = tanY * camera.aspect;
+	float zNear = camera.zNear, zFar = camera.zFar;
+	auto sliceDepth = [&](int slice) { return zNear * std::pow(zFar / zNear, (float)slice / GRID_Z); };
+	auto sliceOf = [&](float depth) {
+		return std::clamp((int)std::floor(std::log(depth / zNear) / std::log(zFar / zNear) * GRID_Z), 0, GRID_Z - 1);
+	};
+	auto tileOf = [](float ndc, int tiles) {
+		return std::clamp((int)std::floor((ndc * 0.5f + 0.5f) * tiles), 0, tiles - 1);
+	};
+
+	// Froxels every light may touch, in view space where the camera
+	// looks down -z
+	struct Bounds {
+		glm::vec3 center;
+		int slices[2];
+		int cols[2];
+		int rows[2];
+	};
+	std::vector<Bounds> bounds;
+	std::vector<uint16_t> visible;
+	for (size_t i = 0; i < lights.size(); i++) {
+		const PointLight& light = lights[i];
+		glm::vec3 c = glm::vec3(camera.view * glm::vec4(light.pos, 1.0f));
+		float r = light.radius;
+		float nearest = -c.z - r, farthest = -c.z + r;
+		if (r <= 0 || farthest < zNear || nearest > zFar)
+			continue;
+
+		// The corners of the box around the sphere bound its
+		// projection, depths clamped to the near plane
+		Bounds b;
+		b.center = c;
+		b.slices[0] = sliceOf(std::max(nearest, zNear));
+		b.slices[1] = sliceOf(std::min(farthest, zFar));
+		float ndc[4] = {INFINITY, -INFINITY, INFINITY, -INFINITY};
+		for (int corner = 0; corner < 8; corner++) {
+			glm::vec3 p = c + r * glm::vec3(corner & 1 ? 1 : -1, corner & 2 ? 1 : -1, corner & 4 ? 1 : -1);
+			float depth = std::max(-p.z, zNear);
+			ndc[0] = std::min(ndc[0], p.x / (depth * tanX));
+			ndc[1] = std::max(ndc[1], p.x / (depth * tanX));
+			ndc[2] = std::min(ndc[2], p.y / (depth * tanY));
+			ndc[3] = std::max(ndc[3], p.y / (depth * tanY));
+		}
+		if (ndc[0] > 1 || ndc[1] < -1 || ndc[2] > 1 || ndc[3] < -1)
+			continue;
+		b.cols[0] = tileOf(ndc[0], GRID_X);
+		b.cols[1] = tileOf(ndc[1], GRID_X);
+		b.rows[0] = tileOf(ndc[2], GRID_Y);
+		b.rows[1] = tileOf(ndc[3], GRID_Y);
+		bounds.push_back(b);
+		visible.push_back((uint16_t)i);
+	}
+
+	// Every slice lists its froxels on its own, the box of a froxel is
+	// tested against the spheres of the lights that may reach it
+	std::vector<std::vector<uint16_t>> slice_indices(GRID_Z);
+	std::vector<std::vector<uint32_t>> slice_counts(GRID_Z);
+	TaskScheduler::instance().parallelFor(0, GRID_Z, 1, [&](unsigned, size_t begin, size_t end) {
+		std::vector<std::vector<uint16_t>> lists(GRID_X * GRID_Y);
+		for (size_t slice = begin; slice < end; slice++) {
+			float z0 = sliceDepth((int)slice), z1 = sliceDepth((int)slice + 1);
+			for (auto& list : lists)
+				list.clear();
+
+			for (size_t i = 0; i < bounds.size(); i++) {
+				const Bounds& b = bounds[i];
+				if ((int)slice < b.slices[0] || (int)slice > b.slices[1])
+					continue;
+				float r2 = lights[visible[i]].radius * lights[visible[i]].radius;
+				float dz = std::max({z0 + b.center.z, 0.0f, -b.center.z - z1});
+				for (int row = b.rows[0]; row <= b.rows[1]; row++) {
+					float y0 = -1.0f + 2.0f * row / GRID_Y, y1 = -1.0f + 2.0f * (row + 1) / GRID_Y;
+					float ymin = std::min(y0 * z0, y0 * z1) * tanY, ymax = std::max(y1 * z0, y1 * z1) * tanY;
+					float dy = std::max({ymin - b.center.y, 0.0f, b.center.y - ymax});
+					for (int col = b.cols[0]; col <= b.cols[1]; col++) {
+						float x0 = -1.0f + 2.0f * col / GRID_X, x1 = -1.0f + 2.0f * (col + 1) / GRID_X;
+						float xmin = std::min(x0 * z0, x0 * z1) * tanX, xmax = std::max(x1 * z0, x1 * z1) * tanX;
+						float dx = std::max({xmin - b.center.x, 0.0f, b.center.x - xmax});
+						if (dx * dx + dy * dy + dz * dz <= r2)
+							lists[row * GRID_X + col].push_back(visible[i]);
+					}
+				}
+			}
+
+			for (auto& list : lists) {
+				slice_counts[slice].push_back((uint32_t)list.size());
+				slice_indices[slice].insert(slice_indices[slice].end(), list.begin(), list.end());
+			}
+		}
+	});
+
+	ranges.resize(2 * CLUSTER_COUNT);
+	indices.clear();
+	for (int slice = 0; slice < GRID_Z; slice++) {
+		uint32_t offset = (uint32_t)indices.size();
+		for (int tile = 0; tile < GRID_X * GRID_Y; tile++) {
+			size_t cluster = (size_t)slice * GRID_X * GRID_Y + tile;
+			ranges[2 * cluster] = offset;
+			ranges[2 * cluster + 1] = slice_counts[slice][tile];
+			offset += slice_counts[slice][tile];
+		}
+		indices.insert(indices.end(), slice_indices[slice].begin(), slice_indices[slice].end());
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef LIGHTCLUSTERS_HPP
+#define LIGHTCLUSTERS_HPP
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+#include "shaderprogram.hpp"
+
+// Short range point lights, as many as there are villages
+//
+// The view frustum is split into froxels, tiles of the screen cut into
+// slices of exponentially growing depth. Whenever the camera moves the
+// lights are binned on the CPU into every froxel their sphere touches,
+// one slice per task, and the fragment shader only lights a fragment
+// with the list of its froxel. The lights, the range of every froxel in
+// the list and the list itself go to the shader as texture buffers.
+//
+// Lights fade to nothing at their radius, so a light missing from a
+// froxel cannot be seen there. The lights of the Light class stay in
+// their uniform block and reach everything.
+class LightClusters {
+public:
+	LightClusters() {}
+	~LightClusters() { release(); }
+	// Disallow copy, move, & assignment
+	LightClusters(const LightClusters& other) = delete;
+	LightClusters& operator=(const LightClusters& other) = delete;
+	LightClusters(LightClusters&& other) = delete;
+	LightClusters& operator=(LightClusters&& other) = delete;
+
+	// Froxels across, up and in depth, the shader has the same numbers
+	static const int GRID_X = 16;
+	static const int GRID_Y = 9;
+	static const int GRID_Z = 24;
+	static const int CLUSTER_COUNT = GRID_X * GRID_Y * GRID_Z;
+	// Lights are listed by 16-bit index
+	static const size_t MAX_LIGHTS = 65535;
+
+	// World space, two texels of the light buffer
+	struct PointLight {
+		glm::vec3 pos;
+		float radius;		// Distance where the light is gone
+		glm::vec3 color;
+		float padding = 0.0f;
+	};
+	static_assert(sizeof(PointLight) == 32, "Point light layout");
+
+	// Perspective camera the lights are binned for
+	struct Camera {
+		glm::mat4 view;
+		float fovy;			// Vertical field of view, radians
+		float aspect;
+		float zNear;
+		float zFar;
+		bool operator==(const Camera& other) const;
+	};
+
+	// Program lighting with the clusters, its samplers and uniforms are
+	// looked up whenever it is a different one
+	void setShader(ShaderProgram* s);
+	void initGL();
+
+	// Replace the lights, throws std::runtime_error beyond MAX_LIGHTS
+	void setLights(const std::vector<PointLight>& lights);
+	size_t getLightCount() const { return lights.size(); }
+
+	// Bin the lights for camera unless they are binned for it already,
+	// and bind the buffers and uniforms, the program must be in use
+	void bind(const Camera& camera, glm::vec2 viewport);
+
+	// Binning without OpenGL: every froxel gets the offset and count
+	// of its lights in indices, froxels ordered by slice, row, column
+	static void bin(const std::vector<PointLight>& lights, const Camera& camera,
+		std::vector<uint32_t>& ranges, std::vector<uint16_t>& indices);
+
+protected:
+	std::vector<PointLight> lights;
+	std::vector<uint32_t> ranges;
+	std::vector<uint16_t> indices;
+	Camera lastCamera = {};
+	bool binned = false;	// Buffers hold the lists for lastCamera
+
+	void release();
+
+	// Texture buffers and their storage
+	GLuint lightBuf = 0;
+	GLuint lightTex = 0;
+	GLuint rangeBuf = 0;
+	GLuint rangeTex = 0;
+	GLuint indexBuf = 0;
+	GLuint indexTex = 0;
+
+	// Shader state, uniform indices in shader
+	ShaderProgram* shader = nullptr;
+	int lightCountLoc = -1;
+	int viewMatLoc = -1;
+	int viewportLoc = -1;
+	int clusterDepthLoc = -1;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "mappedfile.hpp"
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) {
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+	if (this != &other) {
+		close();
+		std::swap(mapped, other.mapped);
+		std::swap(length, other.length);
+		std::swap(opened, other.opened);
+#ifdef _WIN32
+		std::swap(mapping, other.mapping);
+#endif
+	}
+	return *this;
+}
+
+bool MappedFile::open(const std::string& filename) {
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		return false;
+	}
+	length = (size_t)fileSize.QuadPart;
+	if (length > 0) {
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+			mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	// The mapping keeps the file alive
+	CloseHandle(file);
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+	length = (size_t)st.st_size;
+	if (length > 0) {
+		mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED)
+			mapped = nullptr;
+	}
+	// The mapping keeps the file alive
+	::close(fd);
+#endif
+
+	opened = true;
+	if (length > 0 && !mapped) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+	if (mapped)
+		UnmapViewOfFile(mapped);
+	if (mapping)
+		CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	if (mapped)
+		munmap(mapped, length);
+#endif
+	mapped = nullptr;
+	length = 0;
+	opened = false;
+}
@@ -0,0 +1,35 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+	// Disallow copy & assignment, moving hands the mapping over
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile& operator=(const MappedFile& other) = delete;
+	MappedFile(MappedFile&& other);
+	MappedFile& operator=(MappedFile&& other);
+
+	// Map filename, returns false if it cannot be opened or mapped
+	bool open(const std::string& filename);
+	void close();
+
+	bool isOpen() const { return opened; }
+	const char* data() const { return (const char*)mapped; }
+	size_t size() const { return length; }
+
+protected:
+	void* mapped = nullptr;
+	size_t length = 0;
+	bool opened = false;	// Empty files are open without a mapping
+#ifdef _WIN32
+	void* mapping = nullptr;	// HANDLE of the file mapping
+#endif
+};
+
+#endif
@@ -1,14 +1,64 @@
 #define NOMINMAX
 #include "mesh.hpp"
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
-#include "terrain.hpp"
+#include "profiler.hpp"
+#include "mappedfile.hpp"
+#include "scheduler.hpp"
+#include "meshcache.hpp"
+#include "simplify.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Geometry read from an OBJ file
+struct ObjData {
+	std::vector<glm::vec3> positions;
+	std::vector<unsigned int> elements;	// Position indices, three per triangle
+	std::vector<unsigned int> groups;	// Smoothing group per triangle, 0 for none
+	glm::vec3 minBB = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+
+	// Files without s records are smoothed as a whole
+	unsigned int group = 1;			// Group of the next faces
+	bool groupSet = false;			// An s record was read
+	size_t inheritedGroups = 0;		// Triangles before the first s record
+};
+
+// Malformed line, numbered from the start of the parsed range
+struct ObjParseError : std::runtime_error {
+	size_t line;
+	ObjParseError(size_t line, const char* what) : std::runtime_error(what), line(line) {}
+};
+
+// Files from this size on are parsed in parallel, in chunks of about
+// OBJ_CHUNK_SIZE bytes
+static const size_t OBJ_PARALLEL_SIZE = 1 << 20;
+static const size_t OBJ_CHUNK_SIZE = 1 << 19;
+
+// Vertex cache size the triangle order is optimized for
+static const int VERTEX_CACHE_SIZE = 32;
+
+// Levels of detail keep at least this many triangles, or all of them
+static const size_t LOD_MIN_TRIANGLES = 32;
 
 // Helper functions
-int indexOfNumberLetter(std::string& str, int offset);
-int lastIndexOfNumberLetter(std::string& str);
-std::vector<std::string> split(const std::string &s, char delim);
+static const char* findNewline(const char* p, const char* end);
+static void parseObj(const char* begin, const char* end, ObjData& obj, std::vector<size_t>* relative = nullptr);
+static void loadObj(const char* begin, const char* end, ObjData& obj);
+static void parseGeometry(const std::string& filename, MeshCache::Geometry& geometry);
+static void optimizeVertexCache(std::vector<unsigned int>& elements, size_t vertex_count);
+static float cacheMissRatio(const std::vector<unsigned int>& elements, size_t vertex_count, size_t cache_size);
 
 // Vertex constructor
 Mesh::Vertex::Vertex() :
@@ -23,174 +73,456 @@ Mesh::Mesh(std::string filename, bool keepLocalGeometry) {
 
 	vao = 0;
 	vbuf = 0;
-	vcount = 0;
+	ibuf = 0;
+	itype = GL_UNSIGNED_INT;
+	icount = 0;
 	load(filename, keepLocalGeometry);
 }
 
 // Draw the mesh
 void Mesh::draw() {
-	terrain.draw();
-	// glBindVertexArray(vao);
-	// glDrawArrays(GL_TRIANGLES, 0, vcount);
-	// glBindVertexArray(0);
+	glBindVertexArray(vao);
+	glDrawElements(GL_TRIANGLES, icount, itype, NULL);
+	glBindVertexArray(0);
+}
+
+// Draw many copies of the mesh
+void Mesh::drawInstanced(GLsizei instances, int level) {
+	const Level& range = levels.at(level);
+	glBindVertexArray(vao);
+	glDrawElementsInstanced(GL_TRIANGLES, range.count, itype, (GLvoid*)range.offset, instances);
+	glBindVertexArray(0);
 }
 
 // Load a wavefront OBJ file
 void Mesh::load(std::string filename, bool keepLocalGeometry) {
+	PROFILE_SCOPE("Mesh::load");
 	// Release resources
-	// release();
-
-	// TODO Temp: testing generator
-	terrain.setSize(100, 100);
-	terrain.setSeed(1);
-	std::string name("Test");
-	terrain.setName(name);
-	std::vector<std::string> functions;
-	glm::vec3 color(12, 323, 23);
-
-	functions.push_back("pyramid(x, y, 0, 0, 0, 0, 0.5, -0.3, 1)");
-	functions.push_back("pyramid(x, y, 0, 0, 0, 0, -0.5, 0.3, 1)");
-	functions.push_back("pyramid(x, y, 0, 0, 0, 0.3, -0.3, 0, -1)");
-	functions.push_back("perlin(x, y, 2^(N/2)) * 0.5");
-	functions.push_back("perlin(x, y, 2^(N/2)) * 0.05");
-	functions.push_back("perlin(x, y, 2^(N/2)) * 0.01");
-	functions.push_back("perlin(x, y, 2^(N/2)) * 0.005");
-
-
-	// terrain.pushLayer(std::pair(functions, color));
-	terrain.evaluate();
-	// terrain.printMatrix(0);
-	terrain.generate();
-	// terrain.draw();
-
-	std::ifstream file(filename);
-	if (!file.is_open()) {
-		std::stringstream ss;
-		ss << "Error reading " << filename << ": failed to open file";
-		throw std::runtime_error(ss.str());
+	release();
+
+	// Parsed geometry and normals come from the sidecar cache while the
+	// OBJ is unchanged
+	MeshCache::Geometry geometry;
+	if (!MeshCache::load(filename, geometry)) {
+		parseGeometry(filename, geometry);
+		MeshCache::store(filename, geometry);
+	}
+	minBB = geometry.minBB;
+	maxBB = geometry.maxBB;
+
+	// Create vertex array, welded vertices have a single normal so the
+	// face normal is the smooth one
+	vertices = std::vector<Vertex>(geometry.positions.size());
+	for (size_t i = 0; i < vertices.size(); i++) {
+		vertices[i].pos = geometry.positions[i];
+		vertices[i].face_norm = geometry.normals[i];
+		vertices[i].smooth_norm = geometry.normals[i];
 	}
+	indices = std::move(geometry.elements);
 
-	// Store vertex data while reading
-	std::vector<glm::vec3> raw_vertices;	// Vertices data
-	std::vector<unsigned int> v_elements;	// Vertices indices forming faces
+	// Load vertices into OpenGL
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	glGenBuffers(1, &vbuf);
+	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(2 * sizeof(glm::vec3)));
+
+	// Indices are 16-bit whenever the vertices allow it. The levels of
+	// detail follow level 0 in the same buffer
+	std::vector<unsigned int> all_indices = indices;
+	levels.clear();
+	levels.push_back({0, (GLsizei)indices.size()});
+	for (const auto& lod : geometry.lods) {
+		levels.push_back({all_indices.size(), (GLsizei)lod.size()});
+		all_indices.insert(all_indices.end(), lod.begin(), lod.end());
+	}
+	glGenBuffers(1, &ibuf);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibuf);
+	if (vertices.size() <= 65536) {
+		std::vector<GLushort> short_indices(all_indices.begin(), all_indices.end());
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, short_indices.size() * sizeof(GLushort), short_indices.data(), GL_STATIC_DRAW);
+		itype = GL_UNSIGNED_SHORT;
+	} else {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, all_indices.size() * sizeof(GLuint), all_indices.data(), GL_STATIC_DRAW);
+		itype = GL_UNSIGNED_INT;
+	}
+	for (Level& level : levels)
+		level.offset *= itype == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	icount = (GLsizei)indices.size();
 
-	std::string line;
-	while (getline(file, line)) {
-		if (line.substr(0, 2) == "v ") {
-			// Read position data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			glm::vec3 vert(stof(values[0]), stof(values[1]), stof(values[2]));
-			raw_vertices.push_back(vert);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-			// Update bounding box
-			minBB = glm::min(minBB, vert);
-			maxBB = glm::max(maxBB, vert);
-
-		} else if (line.substr(0, 2) == "f ") {
-			// Read face data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			for (int i = 0; i < int(values.size()) - 2; i++) {
-				// Split up vertex indices
-				std::vector<std::string> v1 = split(values[0], '/');		// Triangle fan for ngons
-				std::vector<std::string> v2 = split(values[i+1], '/');
-				std::vector<std::string> v3 = split(values[i+2], '/');
-
-				// Store position indices
-				v_elements.push_back(stoul(v1[0]) - 1);
-				v_elements.push_back(stoul(v2[0]) - 1);
-				v_elements.push_back(stoul(v3[0]) - 1);
+	// Delete local copy of geometry
+	if (!keepLocalGeometry) {
+		vertices.clear();
+		indices.clear();
+	}
+}
+
+// Parse a whole OBJ file, in parallel chunks when it is large. Throws
+// std::runtime_error naming the line of the first malformed record
+static void loadObj(const char* begin, const char* end, ObjData& obj) {
+	if ((size_t)(end - begin) < OBJ_PARALLEL_SIZE) {
+		try {
+			parseObj(begin, end, obj);
+		} catch (const ObjParseError& e) {
+			std::stringstream ss;
+			ss << "line " << e.line << ": " << e.what();
+			throw std::runtime_error(ss.str());
+		}
+		return;
+	}
+
+	// Chunks end after a newline, so no record is split
+	std::vector<const char*> bounds = {begin};
+	while (bounds.back() < end) {
+		const char* next = bounds.back() + std::min<size_t>(OBJ_CHUNK_SIZE, end - bounds.back());
+		bounds.push_back(next < end ? std::min(findNewline(next, end) + 1, end) : end);
+	}
+	size_t chunks = bounds.size() - 1;
+
+	// Parse every chunk on its own, exceptions are kept for later
+	std::vector<ObjData> parts(chunks);
+	std::vector<std::vector<size_t>> relative(chunks);
+	std::vector<std::exception_ptr> errors(chunks);
+	TaskScheduler& scheduler = TaskScheduler::instance();
+	scheduler.parallelFor(0, chunks, 1, [&](unsigned, size_t chunk_begin, size_t chunk_end) {
+		for (size_t i = chunk_begin; i < chunk_end; i++) {
+			try {
+				parseObj(bounds[i], bounds[i + 1], parts[i], &relative[i]);
+			} catch (...) {
+				errors[i] = std::current_exception();
 			}
 		}
+	});
+	for (size_t i = 0; i < chunks; i++) {
+		if (!errors[i])
+			continue;
+		try {
+			std::rethrow_exception(errors[i]);
+		} catch (const ObjParseError& e) {
+			// Line numbers restart in every chunk
+			size_t line = e.line + std::count(begin, bounds[i], '\n');
+			std::stringstream ss;
+			ss << "line " << line << ": " << e.what();
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	// Offsets of every chunk in the whole file
+	std::vector<size_t> vertex_base(chunks + 1, 0), element_base(chunks + 1, 0);
+	for (size_t i = 0; i < chunks; i++) {
+		vertex_base[i + 1] = vertex_base[i] + parts[i].positions.size();
+		element_base[i + 1] = element_base[i] + parts[i].elements.size();
+		obj.minBB = glm::min(obj.minBB, parts[i].minBB);
+		obj.maxBB = glm::max(obj.maxBB, parts[i].maxBB);
+	}
+
+	// Faces before the first s record of a chunk belong to the group
+	// the chunks before it left off with
+	std::vector<unsigned int> group_base(chunks, obj.group);
+	for (size_t i = 1; i < chunks; i++)
+		group_base[i] = parts[i - 1].groupSet ? parts[i - 1].group : group_base[i - 1];
+
+	// Gather, moving relative indices to the global numbering
+	obj.positions.resize(vertex_base[chunks]);
+	obj.elements.resize(element_base[chunks]);
+	obj.groups.resize(element_base[chunks] / 3);
+	scheduler.parallelFor(0, chunks, 1, [&](unsigned, size_t chunk_begin, size_t chunk_end) {
+		for (size_t i = chunk_begin; i < chunk_end; i++) {
+			std::copy(parts[i].positions.begin(), parts[i].positions.end(), obj.positions.begin() + vertex_base[i]);
+			unsigned int* elements = obj.elements.data() + element_base[i];
+			std::copy(parts[i].elements.begin(), parts[i].elements.end(), elements);
+			for (size_t at : relative[i]) {
+				long resolved = (long)(int)parts[i].elements[at] + (long)vertex_base[i];
+				// Out of range ones are caught with the other indices
+				elements[at] = resolved < 0 ? UINT_MAX : (unsigned int)resolved;
+			}
+			unsigned int* groups = obj.groups.data() + element_base[i] / 3;
+			std::copy(parts[i].groups.begin(), parts[i].groups.end(), groups);
+			std::fill(groups, groups + parts[i].inheritedGroups, group_base[i]);
+		}
+	});
+}
+
+// Parse an OBJ file and compute its normals
+static void parseGeometry(const std::string& filename, MeshCache::Geometry& geometry) {
+	// Parse straight from the mapped file
+	MappedFile file;
+	if (!file.open(filename)) {
+		std::stringstream ss;
+		ss << "Error reading " << filename << ": failed to open file";
+		throw std::runtime_error(ss.str());
+	}
+
+	ObjData obj;
+	try {
+		loadObj(file.data(), file.data() + file.size(), obj);
+	} catch (const std::runtime_error& e) {
+		std::stringstream ss;
+		ss << "Error reading " << filename << ": " << e.what();
+		throw std::runtime_error(ss.str());
 	}
 	file.close();
 
+	std::vector<glm::vec3>& raw_vertices = obj.positions;	// Vertices data
+	std::vector<unsigned int>& v_elements = obj.elements;	// Vertices indices forming faces
+
 	// Check if the file was invalid
 	if (raw_vertices.empty() || v_elements.empty()) {
 		std::stringstream ss;
 		ss << "Error reading " << filename << ": invalid file or no geometry";
 		throw std::runtime_error(ss.str());
 	}
+	for (unsigned int element : v_elements) {
+		if (element >= raw_vertices.size()) {
+			std::stringstream ss;
+			ss << "Error reading " << filename << ": face index " << element + 1 << " out of range";
+			throw std::runtime_error(ss.str());
+		}
+	}
 
-	// TODO ========================================================================
-	// Calculate face and smoothed normals
-	std::vector<glm::vec3> face_normals(v_elements.size());
-	std::vector<glm::vec3> accumulated_normals(raw_vertices.size(), glm::vec3(0.0f));
-
-	// Compute face normals first
-	for (int i = 0; i< int(face_normals.size()); i += 3) {
+	// Calculate face normals and the corner angles weighting them
+	size_t triangle_count = v_elements.size() / 3;
+	std::vector<glm::vec3> face_normals(triangle_count);
+	std::vector<glm::vec3> corner_angles(triangle_count);
+	for (size_t i = 0; i < triangle_count; i++) {
 		// All three vertices in a triangle shared the same face normal
-		// ? Order of the two edges?
-		int A = v_elements[i];
-		int B = v_elements[i + 1];
-		int C = v_elements[i + 2];
-		glm::vec3 AB = glm::normalize(raw_vertices[B] - raw_vertices[A]);
-		glm::vec3 AC = glm::normalize(raw_vertices[C] - raw_vertices[A]);
-		glm::vec3 n  = glm::normalize(glm::cross(AB, AC));
-		face_normals[i] = n;
-		face_normals[i + 1] = n;
-		face_normals[i + 2] = n;
-
-		// For angles
-		glm::vec3 BA = -AB;
-		glm::vec3 BC = glm::normalize(raw_vertices[C] - raw_vertices[B]);
-		glm::vec3 CA = -AC;
-		glm::vec3 CB = -BC;
-
-		// Weighted accumlate
-		accumulated_normals[A] += n * glm::acos(glm::dot(AB, AC));
-		accumulated_normals[B] += n * glm::acos(glm::dot(BA, BC));
-		accumulated_normals[C] += n * glm::acos(glm::dot(CA, CB));
-	}
-
-	// Based on face normals, compute smoothed normal for each vertices
-	for (int i = 0; i < int(accumulated_normals.size()); i++) {
-		accumulated_normals[i] = glm::normalize(accumulated_normals[i]);
-	}
-
-	// Create vertex array
-	vertices = std::vector<Vertex>(v_elements.size());
-	for (int i = 0; i < int(v_elements.size()); i += 3) {
-		// Store positions
-		vertices[i+0].pos = raw_vertices[v_elements[i+0]];
-		vertices[i+1].pos = raw_vertices[v_elements[i+1]];
-		vertices[i+2].pos = raw_vertices[v_elements[i+2]];
-
-		// Store face and smoothed normals in each vertex
-		vertices[i+0].face_norm = face_normals[i+0];
-		vertices[i+1].face_norm = face_normals[i+1];
-		vertices[i+2].face_norm = face_normals[i+2];
-
-		vertices[i+0].smooth_norm = accumulated_normals[v_elements[i+0]];
-		vertices[i+1].smooth_norm = accumulated_normals[v_elements[i+1]];
-		vertices[i+2].smooth_norm = accumulated_normals[v_elements[i+2]];
-	}
-	// vcount = (GLsizei)vertices.size();
+		glm::vec3 A = raw_vertices[v_elements[3 * i]];
+		glm::vec3 B = raw_vertices[v_elements[3 * i + 1]];
+		glm::vec3 C = raw_vertices[v_elements[3 * i + 2]];
+		glm::vec3 AB = glm::normalize(B - A);
+		glm::vec3 AC = glm::normalize(C - A);
+		glm::vec3 BC = glm::normalize(C - B);
+		face_normals[i] = glm::normalize(glm::cross(AB, AC));
+		corner_angles[i] = glm::vec3(
+			glm::acos(glm::dot(AB, AC)),
+			glm::acos(glm::dot(-AB, BC)),
+			glm::acos(glm::dot(-AC, -BC)));
+	}
 
-	// Load vertices into OpenGL
-	// glGenVertexArrays(1, &vao);
-	// glBindVertexArray(vao);
+	// Weld corners into vertices: the triangles of a smoothing group
+	// share one vertex per position, triangles outside any group get
+	// their own. Vertices of a position are chained from first_vertex
+	std::vector<unsigned int> first_vertex(raw_vertices.size(), UINT_MAX);
+	std::vector<unsigned int> next_vertex, vertex_position, vertex_group;
+	std::vector<glm::vec3> accumulated_normals;
+	std::vector<unsigned int> elements(v_elements.size());
+	for (size_t i = 0; i < triangle_count; i++) {
+		unsigned int group = obj.groups[i];
+		for (int k = 0; k < 3; k++) {
+			unsigned int position = v_elements[3 * i + k];
+			unsigned int v = UINT_MAX;
+			if (group) {
+				v = first_vertex[position];
+				while (v != UINT_MAX && vertex_group[v] != group)
+					v = next_vertex[v];
+			}
+			if (v == UINT_MAX) {
+				v = (unsigned int)vertex_position.size();
+				vertex_position.push_back(position);
+				vertex_group.push_back(group);
+				next_vertex.push_back(first_vertex[position]);
+				first_vertex[position] = v;
+				accumulated_normals.push_back(glm::vec3(0.0f));
+			}
+			// Weighted accumulate
+			accumulated_normals[v] += face_normals[i] * corner_angles[i][k];
+			elements[3 * i + k] = v;
+		}
+	}
+	size_t vertex_count = vertex_position.size();
+
+	// Coarser levels in parallel, each decimated from the full mesh to
+	// half the triangles of the one before. Vertices shared by several
+	// smoothing groups sit on seams and stay put
+	std::vector<glm::vec3> welded_positions(vertex_count);
+	std::vector<unsigned int> position_uses(raw_vertices.size(), 0);
+	for (size_t v = 0; v < vertex_count; v++) {
+		welded_positions[v] = raw_vertices[vertex_position[v]];
+		position_uses[vertex_position[v]]++;
+	}
+	std::vector<bool> locked(vertex_count);
+	for (size_t v = 0; v < vertex_count; v++)
+		locked[v] = position_uses[vertex_position[v]] > 1;
+	std::vector<std::vector<unsigned int>> lods(Mesh::LOD_LEVELS - 1);
+	TaskScheduler::instance().parallelFor(0, lods.size(), 1, [&](unsigned, size_t level_begin, size_t level_end) {
+		for (size_t i = level_begin; i < level_end; i++) {
+			size_t target = std::max(triangle_count >> (i + 1), std::min(triangle_count, LOD_MIN_TRIANGLES));
+			lods[i] = Simplify::decimate(welded_positions, elements, locked, target);
+			optimizeVertexCache(lods[i], vertex_count);
+		}
+	});
+
+	// Reorder triangles for the post-transform cache, unless the file's
+	// order already does better, then vertices in the order they are
+	// first used
+	float acmr = cacheMissRatio(elements, vertex_count, VERTEX_CACHE_SIZE);
+	std::vector<unsigned int> optimized = elements;
+	optimizeVertexCache(optimized, vertex_count);
+	float optimized_acmr = cacheMissRatio(optimized, vertex_count, VERTEX_CACHE_SIZE);
+	if (optimized_acmr < acmr)
+		elements.swap(optimized);
+	printf("%s: %zu positions welded to %zu vertices, %zu triangles, ACMR %.3f -> %.3f, levels of",
+		filename.c_str(), raw_vertices.size(), vertex_count, triangle_count,
+		acmr, std::min(acmr, optimized_acmr));
+	for (auto& lod : lods)
+		printf(" %zu", lod.size() / 3);
+	printf(" triangles\n");
+
+	std::vector<unsigned int> remap(vertex_count, UINT_MAX);
+	geometry.positions.resize(vertex_count);
+	geometry.normals.resize(vertex_count);
+	unsigned int next = 0;
+	for (unsigned int& element : elements) {
+		if (remap[element] == UINT_MAX) {
+			geometry.positions[next] = welded_positions[element];
+			geometry.normals[next] = glm::normalize(accumulated_normals[element]);
+			remap[element] = next++;
+		}
+		element = remap[element];
+	}
+	for (auto& lod : lods)
+		for (unsigned int& element : lod)
+			element = remap[element];
+	geometry.elements = std::move(elements);
+	geometry.lods = std::move(lods);
+	geometry.minBB = obj.minBB;
+	geometry.maxBB = obj.maxBB;
+}
 
-	// glGenBuffers(1, &vbuf);
-	// glBindBuffer(GL_ARRAY_BUFFER, vbuf);
-	// glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+// Forsyth's linear-speed vertex cache optimisation: triangles are
+// emitted greedily, always the best scored one using vertices in the
+// simulated LRU cache. Vertices score for a recent cache position and
+// for few remaining triangles, so fans are finished before moving on
+static void optimizeVertexCache(std::vector<unsigned int>& elements, size_t vertex_count) {
+	const float CACHE_DECAY_POWER = 1.5f;
+	const float LAST_TRI_SCORE = 0.75f;
+	const float VALENCE_BOOST_SCALE = 2.0f;
+	const float VALENCE_BOOST_POWER = 0.5f;
+
+	size_t triangle_count = elements.size() / 3;
+	if (triangle_count == 0)
+		return;
+
+	// Triangles of every vertex, the live ones first
+	std::vector<unsigned int> remaining(vertex_count, 0), offset(vertex_count + 1, 0);
+	for (unsigned int element : elements)
+		remaining[element]++;
+	for (size_t v = 0; v < vertex_count; v++)
+		offset[v + 1] = offset[v] + remaining[v];
+	std::vector<unsigned int> adjacency(elements.size());
+	{
+		std::vector<unsigned int> fill(offset.begin(), offset.end() - 1);
+		for (size_t i = 0; i < elements.size(); i++)
+			adjacency[fill[elements[i]]++] = (unsigned int)(i / 3);
+	}
 
-	// glEnableVertexAttribArray(0);
-	// glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
-	// glEnableVertexAttribArray(1);
-	// glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
-	// glEnableVertexAttribArray(2);
-	// glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(2 * sizeof(glm::vec3)));
+	std::vector<int> cache_position(vertex_count, -1);
+	std::vector<float> vertex_score(vertex_count);
+	auto score = [&](unsigned int v) {
+		if (remaining[v] == 0)
+			return -1.0f;
+		float s = 0.0f;
+		int position = cache_position[v];
+		if (position >= 0) {
+			// The last triangle's vertices are equally good
+			if (position < 3)
+				s = LAST_TRI_SCORE;
+			else
+				s = std::pow(1.0f - (position - 3) / float(VERTEX_CACHE_SIZE - 3), CACHE_DECAY_POWER);
+		}
+		return s + VALENCE_BOOST_SCALE * std::pow((float)remaining[v], -VALENCE_BOOST_POWER);
+	};
+	for (size_t v = 0; v < vertex_count; v++)
+		vertex_score[v] = score(v);
+
+	std::vector<float> triangle_score(triangle_count);
+	std::vector<bool> emitted(triangle_count, false);
+	int best = 0;
+	for (size_t t = 0; t < triangle_count; t++) {
+		triangle_score[t] = vertex_score[elements[3 * t]] + vertex_score[elements[3 * t + 1]] + vertex_score[elements[3 * t + 2]];
+		if (triangle_score[t] > triangle_score[best])
+			best = (int)t;
+	}
 
-	// glBindVertexArray(0);
-	// glBindBuffer(GL_ARRAY_BUFFER, 0);
+	std::vector<unsigned int> output(elements.size());
+	std::vector<unsigned int> cache, new_cache;
+	size_t next_unemitted = 0;
+	for (size_t out = 0; out < triangle_count; out++) {
+		// Nothing in the cache has triangles left, continue anywhere
+		if (best < 0) {
+			while (emitted[next_unemitted])
+				next_unemitted++;
+			best = (int)next_unemitted;
+		}
+		const unsigned int* triangle = &elements[3 * best];
+		emitted[best] = true;
+		new_cache.assign(triangle, triangle + 3);
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = triangle[k];
+			output[3 * out + k] = v;
+
+			// Move the triangle past the live ones of its vertices
+			unsigned int* begin = &adjacency[offset[v]];
+			unsigned int* last = begin + --remaining[v];
+			std::swap(*std::find(begin, last + 1, (unsigned int)best), *last);
+		}
 
-	// Delete local copy of geometry
-	if (!keepLocalGeometry)
-		vertices.clear();
+		// Used vertices go to the front, the rest keeps its order
+		for (unsigned int v : cache)
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				new_cache.push_back(v);
+		for (size_t i = 0; i < new_cache.size(); i++)
+			cache_position[new_cache[i]] = i < (size_t)VERTEX_CACHE_SIZE ? (int)i : -1;
+
+		// Rescore what was touched, picking the next triangle among them
+		best = -1;
+		float best_score = -1.0f;
+		for (unsigned int v : new_cache)
+			vertex_score[v] = score(v);
+		for (unsigned int v : new_cache) {
+			for (unsigned int j = offset[v]; j < offset[v] + remaining[v]; j++) {
+				unsigned int t = adjacency[j];
+				triangle_score[t] = vertex_score[elements[3 * t]] + vertex_score[elements[3 * t + 1]] + vertex_score[elements[3 * t + 2]];
+				if (triangle_score[t] > best_score) {
+					best_score = triangle_score[t];
+					best = (int)t;
+				}
+			}
+		}
+		if (new_cache.size() > (size_t)VERTEX_CACHE_SIZE)
+			new_cache.resize(VERTEX_CACHE_SIZE);
+		cache.swap(new_cache);
+	}
+	elements.swap(output);
+}
+
+// Average cache miss ratio, vertex shader runs per triangle on a FIFO
+// cache of cache_size vertices. 0.5 is the best a regular grid can do,
+// 3 means nothing is reused
+static float cacheMissRatio(const std::vector<unsigned int>& elements, size_t vertex_count, size_t cache_size) {
+	if (elements.empty())
+		return 0.0f;
+	// Time stamp of every vertex entering the cache
+	std::vector<size_t> entered(vertex_count, 0);
+	size_t misses = 0;
+	for (unsigned int element : elements) {
+		if (entered[element] == 0 || misses - entered[element] >= cache_size) {
+			misses++;
+			entered[element] = misses;
+		}
+	}
+	return (float)misses / (elements.size() / 3);
 }
 
 // Release resources
@@ -199,31 +531,155 @@ void Mesh::release() {
 	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
 
 	vertices.clear();
+	indices.clear();
 	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
 	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
-	vcount = 0;
+	if (ibuf) { glDeleteBuffers(1, &ibuf); ibuf = 0; }
+	icount = 0;
+	levels.clear();
 }
 
-int indexOfNumberLetter(std::string& str, int offset) {
-	for (int i = offset; i < int(str.length()); ++i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
+// Next '\n' in [p, end), or end
+static const char* findNewline(const char* p, const char* end) {
+#ifdef __SSE2__
+	// Compare 16 bytes at a time
+	const __m128i newline = _mm_set1_epi8('\n');
+	for (; end - p >= 16; p += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+		if (mask) {
+#ifdef _MSC_VER
+			unsigned long first;
+			_BitScanForward(&first, mask);
+			return p + first;
+#else
+			return p + __builtin_ctz(mask);
+#endif
+		}
 	}
-	return (int)str.length();
+#endif
+	const char* found = (const char*)memchr(p, '\n', end - p);
+	return found ? found : end;
 }
-int lastIndexOfNumberLetter(std::string& str) {
-	for (int i = int(str.length()) - 1; i >= 0; --i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return 0;
+
+static inline const char* skipBlanks(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
 }
-std::vector<std::string> split(const std::string &s, char delim) {
-	std::vector<std::string> elems;
 
-	std::stringstream ss(s);
-    std::string item;
-    while (getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
+// Parse the OBJ records in [begin, end): v lines, f lines with v,
+// v/vt, v//vn or v/vt/vn corners, n-gons are split into fans, and s
+// lines. Other records are skipped. Throws ObjParseError on malformed lines.
+// With relative set, negative indices may reach before begin: they are
+// stored relative to the first vertex of the range and their places in
+// obj.elements are recorded, for the caller to add the vertex offset
+static void parseObj(const char* begin, const char* end, ObjData& obj, std::vector<size_t>* relative) {
+	// Count records first so the arrays are allocated once
+	size_t vertex_lines = 0, face_lines = 0;
+	for (const char* line = begin; line < end; line = findNewline(line, end) + 1) {
+		const char* p = skipBlanks(line, end);
+		if (end - p >= 2 && (p[1] == ' ' || p[1] == '\t')) {
+			vertex_lines += p[0] == 'v';
+			face_lines += p[0] == 'f';
+		}
+	}
+	obj.positions.reserve(obj.positions.size() + vertex_lines);
+	obj.elements.reserve(obj.elements.size() + face_lines * 3);
+	obj.groups.reserve(obj.groups.size() + face_lines);
+
+	size_t line_num = 0;
+	auto fail = [&](const char* what) {
+		throw ObjParseError(line_num, what);
+	};
 
-    return elems;
+	for (const char* line = begin; line < end; ) {
+		const char* line_end = findNewline(line, end);
+		line_num++;
+		const char* p = skipBlanks(line, line_end);
+
+		if (line_end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			// Read position data
+			p += 2;
+			glm::vec3 vert;
+			for (int i = 0; i < 3; i++) {
+				p = skipBlanks(p, line_end);
+				if (p < line_end && *p == '+')
+					p++;
+				auto result = std::from_chars(p, line_end, vert[i]);
+				if (result.ec != std::errc())
+					fail("bad vertex position");
+				p = result.ptr;
+			}
+			obj.positions.push_back(vert);
+
+			// Update bounding box
+			obj.minBB = glm::min(obj.minBB, vert);
+			obj.maxBB = glm::max(obj.maxBB, vert);
+
+		} else if (line_end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			// Read face data, position index of every corner
+			p += 2;
+			unsigned int first = 0, prev = 0;
+			bool first_relative = false, prev_relative = false;
+			int corners = 0;
+			while ((p = skipBlanks(p, line_end)) < line_end) {
+				long index;
+				auto result = std::from_chars(p, line_end, index);
+				if (result.ec != std::errc() || index == 0)
+					fail("bad face index");
+				// Negative indices count back from the last vertex
+				long resolved = index > 0 ? index - 1 : (long)obj.positions.size() + index;
+				bool current_relative = index < 0 && relative;
+				if (resolved < 0 && !current_relative)
+					fail("face index out of range");
+
+				// Skip texture and normal indices
+				p = result.ptr;
+				while (p < line_end && *p != ' ' && *p != '\t' && *p != '\r')
+					p++;
+
+				// Triangle fan for ngons
+				unsigned int current = (unsigned int)resolved;
+				if (corners >= 2) {
+					if (relative) {
+						size_t at = obj.elements.size();
+						if (first_relative)
+							relative->push_back(at);
+						if (prev_relative)
+							relative->push_back(at + 1);
+						if (current_relative)
+							relative->push_back(at + 2);
+					}
+					obj.elements.push_back(first);
+					obj.elements.push_back(prev);
+					obj.elements.push_back(current);
+					obj.groups.push_back(obj.group);
+				} else if (corners == 0) {
+					first = current;
+					first_relative = current_relative;
+				}
+				prev = current;
+				prev_relative = current_relative;
+				corners++;
+			}
+
+		} else if (line_end - p >= 2 && p[0] == 's' && (p[1] == ' ' || p[1] == '\t')) {
+			// Smoothing group, "off" and 0 turn smoothing off
+			p = skipBlanks(p + 2, line_end);
+			unsigned int group = 0;
+			if (line_end - p < 3 || memcmp(p, "off", 3) != 0) {
+				auto result = std::from_chars(p, line_end, group);
+				if (result.ec != std::errc())
+					fail("bad smoothing group");
+			}
+			if (!obj.groupSet)
+				obj.inheritedGroups = obj.groups.size();
+			obj.group = group;
+			obj.groupSet = true;
+		}
+		line = line_end + 1;
+	}
+	if (!obj.groupSet)
+		obj.inheritedGroups = obj.groups.size();
 }
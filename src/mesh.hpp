@@ -6,7 +6,6 @@
 #include <utility>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
-#include "terrain.hpp"
 
 class Mesh {
 public:
@@ -24,6 +23,16 @@ public:
 
 	void load(std::string filename, bool keepLocalGeometry = false);
 	void draw();
+	// Draw instances times, per instance attributes are added to the
+	// vertex array of getVAO() by the caller. Levels above 0 are the
+	// decimated ones, each with about half the triangles of the last
+	void drawInstanced(GLsizei instances, int level = 0);
+	GLuint getVAO() const { return vao; }
+
+	// Level 0 and the decimated levels built at load time
+	static const int LOD_LEVELS = 4;
+	int getLevelCount() const { return (int)levels.size(); }
+	GLsizei getTriangleCount(int level) const { return levels.at(level).count / 3; }
 
 	// Mesh vertex format
 	struct Vertex {
@@ -32,9 +41,9 @@ public:
 		glm::vec3 smooth_norm;	// Smoothed normal
 		Vertex();
 	};
-	// Local geometry data
+	// Local geometry data, welded vertices and their triangles
 	std::vector<Vertex> vertices;
-	Terrain terrain;
+	std::vector<unsigned int> indices;
 
 protected:
 	void release();		// Release OpenGL resources
@@ -46,7 +55,16 @@ protected:
 	// OpenGL resources
 	GLuint vao;		// Vertex array object
 	GLuint vbuf;	// Vertex buffer
-	GLsizei vcount;	// Number of vertices
+	GLuint ibuf;	// Index buffer
+	GLenum itype;	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	GLsizei icount;	// Number of indices
+
+	// Index range of every level in the index buffer
+	struct Level {
+		size_t offset;	// In bytes
+		GLsizei count;	// Number of indices
+	};
+	std::vector<Level> levels;
 
 private:
 };
@@ -0,0 +1,152 @@
+#include "meshcache.hpp"
+#include "mappedfile.hpp"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace MeshCache {
+
+static const char CACHE_MAGIC[4] = {'T', 'R', 'M', 'C'};
+
+// File header, followed by the positions, normals and elements, then
+// the triangle count of every level of detail and their elements
+struct Header {
+	char magic[4];			// "TRMC"
+	uint32_t version;		// VERSION
+	uint64_t sourceSize;	// Size of the OBJ file
+	int64_t sourceTime;		// Modification time of the OBJ file
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	float minBB[3];
+	float maxBB[3];
+	uint32_t lodCount;
+	uint32_t padding;
+};
+static_assert(sizeof(Header) == 64, "Mesh cache header layout");
+
+// Size and modification time identifying the current OBJ file
+static bool sourceStamp(const std::string& objFile, uint64_t& size, int64_t& time) {
+	std::error_code ec;
+	size = fs::file_size(objFile, ec);
+	if (ec)
+		return false;
+	time = fs::last_write_time(objFile, ec).time_since_epoch().count();
+	return !ec;
+}
+
+std::string pathOf(const std::string& objFile) {
+	return objFile + ".cache";
+}
+
+bool load(const std::string& objFile, Geometry& geometry) {
+	uint64_t size;
+	int64_t time;
+	MappedFile file;
+	if (!sourceStamp(objFile, size, time) || !file.open(pathOf(objFile)))
+		return false;
+
+	// Reject files of another version or source, or of the wrong size
+	Header header;
+	if (file.size() < sizeof(Header))
+		return false;
+	memcpy(&header, file.data(), sizeof(Header));
+	size_t vertexBytes = (size_t)header.vertexCount * 2 * sizeof(glm::vec3);
+	size_t triangleBytes = (size_t)header.triangleCount * 3 * sizeof(unsigned int);
+	size_t lodBytes = (size_t)header.lodCount * sizeof(uint32_t);
+	if (memcmp(header.magic, CACHE_MAGIC, 4) != 0 || header.version != VERSION ||
+			header.sourceSize != size || header.sourceTime != time ||
+			file.size() < sizeof(Header) + vertexBytes + triangleBytes + lodBytes)
+		return false;
+
+	// Level sizes follow the fixed part
+	std::vector<uint32_t> lodTriangles(header.lodCount);
+	memcpy(lodTriangles.data(), file.data() + sizeof(Header) + vertexBytes + triangleBytes, lodBytes);
+	size_t total = sizeof(Header) + vertexBytes + triangleBytes + lodBytes;
+	for (uint32_t count : lodTriangles)
+		total += (size_t)count * 3 * sizeof(unsigned int);
+	if (file.size() != total)
+		return false;
+
+	const char* p = file.data() + sizeof(Header);
+	auto read = [&p](auto& array, size_t count) {
+		array.resize(count);
+		memcpy(array.data(), p, count * sizeof(array[0]));
+		p += count * sizeof(array[0]);
+	};
+	read(geometry.positions, header.vertexCount);
+	read(geometry.normals, header.vertexCount);
+	read(geometry.elements, (size_t)header.triangleCount * 3);
+	p += lodBytes;
+	geometry.lods.resize(header.lodCount);
+	for (uint32_t i = 0; i < header.lodCount; i++)
+		read(geometry.lods[i], (size_t)lodTriangles[i] * 3);
+
+	// Indices out of the vertices would make the GPU read past the buffers
+	auto inRange = [&header](const std::vector<unsigned int>& elements) {
+		for (unsigned int index : elements)
+			if (index >= header.vertexCount)
+				return false;
+		return true;
+	};
+	if (!inRange(geometry.elements))
+		return false;
+	for (const auto& lod : geometry.lods)
+		if (!inRange(lod))
+			return false;
+	geometry.minBB = glm::vec3(header.minBB[0], header.minBB[1], header.minBB[2]);
+	geometry.maxBB = glm::vec3(header.maxBB[0], header.maxBB[1], header.maxBB[2]);
+	return true;
+}
+
+void store(const std::string& objFile, const Geometry& geometry) {
+	Header header;
+	memcpy(header.magic, CACHE_MAGIC, 4);
+	header.version = VERSION;
+	if (!sourceStamp(objFile, header.sourceSize, header.sourceTime))
+		return;
+	header.vertexCount = geometry.positions.size();
+	header.triangleCount = geometry.elements.size() / 3;
+	for (int i = 0; i < 3; i++) {
+		header.minBB[i] = geometry.minBB[i];
+		header.maxBB[i] = geometry.maxBB[i];
+	}
+	header.lodCount = geometry.lods.size();
+	header.padding = 0;
+	std::vector<uint32_t> lodTriangles;
+	for (const auto& lod : geometry.lods)
+		lodTriangles.push_back(lod.size() / 3);
+
+	// Write aside and rename, readers never see a partial file
+	std::string path = pathOf(objFile);
+	std::string temp = path + ".tmp";
+	std::error_code ec;
+	{
+		std::ofstream out(temp, std::ios::binary);
+		out.write((const char*)&header, sizeof(header));
+		auto write = [&out](const auto& array) {
+			out.write((const char*)array.data(), array.size() * sizeof(array[0]));
+		};
+		write(geometry.positions);
+		write(geometry.normals);
+		write(geometry.elements);
+		write(lodTriangles);
+		for (const auto& lod : geometry.lods)
+			write(lod);
+		if (!out) {
+			printf("Cannot write mesh cache file %s\n", temp.c_str());
+			out.close();
+			fs::remove(temp, ec);
+			return;
+		}
+	}
+	fs::rename(temp, path, ec);
+	if (ec) {
+		printf("Cannot move mesh cache file to %s: %s\n", path.c_str(), ec.message().c_str());
+		fs::remove(temp, ec);
+	}
+}
+
+}
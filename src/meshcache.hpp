@@ -0,0 +1,40 @@
+#ifndef MESHCACHE_HPP
+#define MESHCACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Binary sidecar of a parsed OBJ file
+//
+// Holds everything Mesh::load derives from the text: the welded
+// vertices with their normals, the triangle indices in vertex cache
+// order, the decimated levels of detail and the bounding box. It sits next to the OBJ as
+// <name>.obj.cache and records the size and modification time of the
+// OBJ it was built from, so editing or replacing the model makes it
+// stale and it is rebuilt on the next load.
+namespace MeshCache {
+	// Bump whenever parsing, welding or the normals change
+	static const uint32_t VERSION = 3;
+
+	// Vertices are shared by the triangles of one smoothing group,
+	// triangles outside any group have their own with the face normal
+	struct Geometry {
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec3> normals;			// One per vertex
+		std::vector<unsigned int> elements;		// Three per triangle
+		std::vector<std::vector<unsigned int>> lods;	// Coarser levels, same vertices
+		glm::vec3 minBB;
+		glm::vec3 maxBB;
+	};
+
+	std::string pathOf(const std::string& objFile);
+
+	// Read the sidecar of objFile, false if missing, stale or damaged
+	bool load(const std::string& objFile, Geometry& geometry);
+	// Write the sidecar of objFile, failures are only logged
+	void store(const std::string& objFile, const Geometry& geometry);
+}
+
+#endif
@@ -0,0 +1,322 @@
+#include "meshexport.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <glm/glm.hpp>
+
+// Vertex as written, floats in host byte order, which is little endian
+// on every platform the app builds for
+struct ExportVertex {
+	glm::vec3 pos;
+	glm::vec3 norm;		// Smooth normal
+	glm::vec2 uv;
+};
+static_assert(sizeof(ExportVertex) == 32, "Export vertex layout");
+
+// Generates the vertices of a surface one grid row after the other
+//
+// A point's normal averages the face normals of the triangles around
+// it, weighted as in Terrain::buildCells(), so only the cells of the
+// rows below and above are needed: three rows of heights at a time.
+class VertexRows {
+public:
+	VertexRows(const MeshExporter::Layer& layer, uint32_t rows, uint32_t cols) :
+		layer(layer), rows(rows), cols(cols),
+		lower(cols), current(cols), upper(cols),
+		below(cols), above(cols), vertices(cols) {
+		layer.readRow(0, current.data());
+		if (rows > 1) {
+			layer.readRow(1, upper.data());
+			cellNormals(current, upper, 0, above);
+		}
+	}
+
+	// Vertices of the next row
+	const ExportVertex* next() {
+		for (uint32_t col = 0; col < cols; col++) {
+			glm::vec3 norm(0.0f);
+			// Cells whose c4 and c3 corner this is
+			if (row + 1 < rows) {
+				if (col + 1 < cols)
+					norm += above[col].top + above[col].bot;
+				if (col > 0)
+					norm += above[col - 1].bot;
+			}
+			// Cells whose c1 and c2 corner this is
+			if (row > 0) {
+				if (col + 1 < cols)
+					norm += below[col].top;
+				if (col > 0)
+					norm += below[col - 1].top + below[col - 1].bot;
+			}
+
+			ExportVertex& v = vertices[col];
+			v.pos = position(row, col, current[col]);
+			v.norm = glm::length(norm) > 0 ? glm::normalize(norm) : glm::vec3(0, 1, 0);
+			v.uv = glm::vec2((float)row / rows, (float)col / cols);
+		}
+
+		// Slide the window one row up
+		row++;
+		std::swap(lower, current);
+		std::swap(current, upper);
+		std::swap(below, above);
+		if (row + 1 < rows) {
+			layer.readRow(row + 1, upper.data());
+			cellNormals(current, upper, row, above);
+		}
+		return vertices.data();
+	}
+
+protected:
+	struct CellNormals {
+		glm::vec3 top;		// c4, c1, c2
+		glm::vec3 bot;		// c2, c3, c4
+	};
+
+	// Same placement as Terrain::buildCells(), height as y
+	glm::vec3 position(uint32_t r, uint32_t c, float h) const {
+		return glm::vec3(2 * ((double)r / rows) - 1, h, -(2 * ((double)c / cols) - 1));
+	}
+
+	// Face normals of the cells between row r (heights lo) and r + 1 (hi)
+	void cellNormals(const std::vector<float>& lo, const std::vector<float>& hi, uint32_t r,
+			std::vector<CellNormals>& out) const {
+		for (uint32_t col = 0; col + 1 < cols; col++) {
+			glm::vec3 c1 = position(r + 1, col, hi[col]);
+			glm::vec3 c2 = position(r + 1, col + 1, hi[col + 1]);
+			glm::vec3 c3 = position(r, col + 1, lo[col + 1]);
+			glm::vec3 c4 = position(r, col, lo[col]);
+			out[col].top = -glm::normalize(glm::cross(glm::normalize(c1 - c2), glm::normalize(c4 - c2)));
+			out[col].bot = -glm::normalize(glm::cross(glm::normalize(c3 - c4), glm::normalize(c2 - c4)));
+		}
+	}
+
+	const MeshExporter::Layer& layer;
+	uint32_t rows, cols;
+	uint32_t row = 0;
+	std::vector<float> lower, current, upper;	// Heights of rows row - 1 to row + 1
+	std::vector<CellNormals> below, above;		// Cells under and over row
+	std::vector<ExportVertex> vertices;
+};
+
+// Triangles of the cells between rows r and r + 1, same winding as drawn
+static void cellIndices(uint32_t r, uint32_t cols, uint32_t base, std::vector<uint32_t>& out) {
+	out.clear();
+	for (uint32_t col = 0; col + 1 < cols; col++) {
+		uint32_t c4 = base + r * cols + col;
+		uint32_t c3 = c4 + 1;
+		uint32_t c1 = c4 + cols;
+		uint32_t c2 = c1 + 1;
+		out.insert(out.end(), {c4, c1, c2, c2, c3, c4});
+	}
+}
+
+MeshExporter::Format MeshExporter::formatOf(const std::string& filename) {
+	std::string ext = filename.substr(std::min(filename.rfind('.'), filename.size()));
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return tolower(c); });
+	if (ext == ".ply")
+		return FORMAT_PLY;
+	if (ext == ".glb")
+		return FORMAT_GLB;
+	if (ext == ".gltf")
+		return FORMAT_GLTF;
+	throw std::invalid_argument("Unknown mesh format: " + filename);
+}
+
+void MeshExporter::write(const std::string& filename, Format format, const Source& source,
+		const std::atomic<bool>* stop) {
+	if (source.rows < 2 || source.cols < 2 || source.layers.empty())
+		throw std::runtime_error("Nothing to export");
+	if ((uint64_t)source.rows * source.cols * source.layers.size() > UINT32_MAX)
+		throw std::runtime_error("Too many vertices for 32-bit indices");
+
+	auto stopped = [&] { return stop && stop->load(std::memory_order_relaxed); };
+	uint32_t vertexCount = source.rows * source.cols;
+	uint64_t indexCount = (uint64_t)(source.rows - 1) * (source.cols - 1) * 6;
+	std::vector<uint32_t> indices;
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		throw std::runtime_error("Cannot write " + filename);
+
+	if (format == FORMAT_PLY) {
+		// All surfaces in one mesh, one after the other
+		out << "ply\nformat binary_little_endian 1.0\n";
+		for (const Layer& layer : source.layers)
+			out << "comment surface " << layer.name << "\n";
+		out << "element vertex " << (uint64_t)vertexCount * source.layers.size() << "\n"
+			<< "property float x\nproperty float y\nproperty float z\n"
+			<< "property float nx\nproperty float ny\nproperty float nz\n"
+			<< "property float s\nproperty float t\n"
+			<< "element face " << indexCount / 3 * source.layers.size() << "\n"
+			<< "property list uchar uint vertex_indices\nend_header\n";
+
+		for (const Layer& layer : source.layers) {
+			VertexRows vertices(layer, source.rows, source.cols);
+			for (uint32_t row = 0; row < source.rows && !stopped(); row++)
+				out.write((const char*)vertices.next(), source.cols * sizeof(ExportVertex));
+		}
+
+		// Faces are a count byte and three indices, unaligned
+		std::vector<char> faces;
+		for (size_t layer_idx = 0; layer_idx < source.layers.size(); layer_idx++) {
+			for (uint32_t row = 0; row + 1 < source.rows && !stopped(); row++) {
+				cellIndices(row, source.cols, layer_idx * vertexCount, indices);
+				faces.resize(indices.size() / 3 * 13);
+				char* face = faces.data();
+				for (size_t i = 0; i < indices.size(); i += 3, face += 13) {
+					face[0] = 3;
+					memcpy(face + 1, &indices[i], 12);
+				}
+				out.write(faces.data(), faces.size());
+			}
+		}
+	} else {
+		// The JSON needs the bounds of the positions up front
+		std::vector<std::pair<float, float>> heightRange;
+		std::vector<float> heights(source.cols);
+		for (const Layer& layer : source.layers) {
+			float lo = INFINITY, hi = -INFINITY;
+			for (uint32_t row = 0; row < source.rows && !stopped(); row++) {
+				layer.readRow(row, heights.data());
+				for (float h : heights) {
+					lo = std::min(lo, h);
+					hi = std::max(hi, h);
+				}
+			}
+			heightRange.push_back(std::pair(lo, hi));
+		}
+
+		// Per surface: interleaved vertices, then indices
+		uint64_t vertexBytes = (uint64_t)vertexCount * sizeof(ExportVertex);
+		uint64_t indexBytes = indexCount * sizeof(uint32_t);
+		uint64_t binBytes = (vertexBytes + indexBytes) * source.layers.size();
+		if (binBytes > UINT32_MAX && format == FORMAT_GLB)
+			throw std::runtime_error("Mesh too large for a .glb, use .gltf");
+
+		std::string binName = filename.substr(0, filename.rfind('.')) + ".bin";
+		std::string binUri = binName.substr(binName.find_last_of("/\\") + 1);
+		float xMax = 2 * ((double)(source.rows - 1) / source.rows) - 1;
+		float zMin = -(2 * ((double)(source.cols - 1) / source.cols) - 1);
+
+		std::ostringstream json;
+		json.precision(9);
+		json << "{\"asset\":{\"version\":\"2.0\",\"generator\":\"Terrain-Modeling\"},\"scene\":0,\"scenes\":[{\"nodes\":[";
+		for (size_t i = 0; i < source.layers.size(); i++)
+			json << (i ? "," : "") << i;
+		json << "]}],\"nodes\":[";
+		for (size_t i = 0; i < source.layers.size(); i++)
+			json << (i ? "," : "") << "{\"name\":\"" << source.layers[i].name << "\",\"mesh\":" << i << "}";
+		json << "],\"meshes\":[";
+		for (size_t i = 0; i < source.layers.size(); i++)
+			json << (i ? "," : "") << "{\"name\":\"" << source.layers[i].name << "\",\"primitives\":[{\"attributes\":{"
+				<< "\"POSITION\":" << i * 4 << ",\"NORMAL\":" << i * 4 + 1 << ",\"TEXCOORD_0\":" << i * 4 + 2
+				<< "},\"indices\":" << i * 4 + 3 << ",\"material\":" << i << "}]}";
+		json << "],\"materials\":[";
+		for (size_t i = 0; i < source.layers.size(); i++) {
+			const float* color = source.layers[i].color;
+			json << (i ? "," : "") << "{\"name\":\"" << source.layers[i].name << "\",\"pbrMetallicRoughness\":{"
+				<< "\"baseColorFactor\":[" << color[0] << "," << color[1] << "," << color[2] << ",1],"
+				<< "\"metallicFactor\":0,\"roughnessFactor\":1}}";
+		}
+		json << "],\"buffers\":[{";
+		if (format == FORMAT_GLTF)
+			json << "\"uri\":\"" << binUri << "\",";
+		json << "\"byteLength\":" << binBytes << "}],\"bufferViews\":[";
+		for (size_t i = 0; i < source.layers.size(); i++) {
+			uint64_t offset = i * (vertexBytes + indexBytes);
+			json << (i ? "," : "")
+				<< "{\"buffer\":0,\"byteOffset\":" << offset << ",\"byteLength\":" << vertexBytes
+				<< ",\"byteStride\":" << sizeof(ExportVertex) << ",\"target\":34962},"
+				<< "{\"buffer\":0,\"byteOffset\":" << offset + vertexBytes << ",\"byteLength\":" << indexBytes
+				<< ",\"target\":34963}";
+		}
+		json << "],\"accessors\":[";
+		for (size_t i = 0; i < source.layers.size(); i++) {
+			json << (i ? "," : "")
+				<< "{\"bufferView\":" << i * 2 << ",\"byteOffset\":0,\"componentType\":5126,\"count\":" << vertexCount
+				<< ",\"type\":\"VEC3\",\"min\":[-1," << heightRange[i].first << "," << zMin << "],"
+				<< "\"max\":[" << xMax << "," << heightRange[i].second << ",1]},"
+				<< "{\"bufferView\":" << i * 2 << ",\"byteOffset\":12,\"componentType\":5126,\"count\":" << vertexCount
+				<< ",\"type\":\"VEC3\"},"
+				<< "{\"bufferView\":" << i * 2 << ",\"byteOffset\":24,\"componentType\":5126,\"count\":" << vertexCount
+				<< ",\"type\":\"VEC2\"},"
+				<< "{\"bufferView\":" << i * 2 + 1 << ",\"byteOffset\":0,\"componentType\":5125,\"count\":" << indexCount
+				<< ",\"type\":\"SCALAR\"}";
+		}
+		json << "]}";
+
+		std::string jsonText = json.str();
+		std::ofstream binFile;
+		std::ofstream* bin = &out;
+		if (format == FORMAT_GLB) {
+			// Header, JSON chunk padded with spaces, then the BIN chunk
+			jsonText.resize((jsonText.size() + 3) / 4 * 4, ' ');
+			uint32_t header[5] = {0x46546c67, 2, (uint32_t)(12 + 8 + jsonText.size() + 8 + binBytes),
+				(uint32_t)jsonText.size(), 0x4e4f534a};
+			out.write((const char*)header, sizeof(header));
+			out.write(jsonText.data(), jsonText.size());
+			uint32_t binHeader[2] = {(uint32_t)binBytes, 0x004e4942};
+			out.write((const char*)binHeader, sizeof(binHeader));
+		} else {
+			out << jsonText;
+			binFile.open(binName, std::ios::binary);
+			if (!binFile)
+				throw std::runtime_error("Cannot write " + binName);
+			bin = &binFile;
+		}
+
+		for (size_t layer_idx = 0; layer_idx < source.layers.size(); layer_idx++) {
+			VertexRows vertices(source.layers[layer_idx], source.rows, source.cols);
+			for (uint32_t row = 0; row < source.rows && !stopped(); row++)
+				bin->write((const char*)vertices.next(), source.cols * sizeof(ExportVertex));
+			for (uint32_t row = 0; row + 1 < source.rows && !stopped(); row++) {
+				cellIndices(row, source.cols, 0, indices);
+				bin->write((const char*)indices.data(), indices.size() * sizeof(uint32_t));
+			}
+		}
+		if (!*bin)
+			throw std::runtime_error("Cannot write " + binName);
+	}
+
+	if (!out)
+		throw std::runtime_error("Cannot write " + filename);
+}
+
+void MeshExporter::start(const std::string& filename, Format format, Source source) {
+	wait();
+	stop = false;
+	running = true;
+	worker = std::thread([this, filename, format, source] {
+		auto begin = std::chrono::steady_clock::now();
+		try {
+			write(filename, format, source, &stop);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			if (stop)
+				printf("Export of %s cancelled\n", filename.c_str());
+			else
+				printf("Exported %s, %zu surfaces of %ux%u in %.1f ms\n", filename.c_str(),
+					source.layers.size(), source.rows, source.cols, elapsed.count());
+		} catch (const std::exception& e) {
+			printf("Export of %s failed: %s\n", filename.c_str(), e.what());
+		}
+		running = false;
+	});
+}
+
+void MeshExporter::wait() {
+	if (worker.joinable())
+		worker.join();
+}
+
+void MeshExporter::cancel() {
+	stop = true;
+	wait();
+}
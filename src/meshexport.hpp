@@ -0,0 +1,67 @@
+#ifndef MESHEXPORT_HPP
+#define MESHEXPORT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes terrain surfaces as indexed meshes
+//
+// Every grid point becomes one vertex with position, smooth normal and
+// texture coordinate, every cell two triangles, the same geometry as
+// drawn. Vertices are generated row by row from the heights with a
+// window of three rows for the normals and written out right away, so
+// the expanded six vertices per cell never exist in memory. Exports run
+// on a thread of their own, see start().
+class MeshExporter {
+public:
+	enum Format {
+		FORMAT_PLY = 0,		// Binary little endian PLY, all surfaces in one mesh
+		FORMAT_GLB = 1,		// Binary glTF 2.0, a mesh per surface
+		FORMAT_GLTF = 2,	// glTF 2.0 with the buffer in a .bin beside it
+	};
+
+	// Heights of one surface, rows rows of cols values
+	struct Layer {
+		std::string name;
+		float color[3] = {1.0f, 1.0f, 1.0f};	// Base color in glTF, 0..1
+		std::function<void(uint32_t row, float* heights)> readRow;
+	};
+	struct Source {
+		uint32_t rows = 0;
+		uint32_t cols = 0;
+		std::vector<Layer> layers;
+	};
+
+	MeshExporter() {}
+	~MeshExporter() { cancel(); }
+	// Disallow copy & assignment
+	MeshExporter(const MeshExporter& other) = delete;
+	MeshExporter& operator=(const MeshExporter& other) = delete;
+
+	// Format from the extension: .ply, .glb and .gltf
+	// Throws std::invalid_argument on anything else
+	static Format formatOf(const std::string& filename);
+
+	// Export on the calling thread, throws std::runtime_error on failure.
+	// Setting stop makes it return early, leaving a partial file
+	static void write(const std::string& filename, Format format, const Source& source,
+		const std::atomic<bool>* stop = nullptr);
+
+	// Export in the background, waiting for the previous one first.
+	// source must stay valid until it finishes, failures are logged
+	void start(const std::string& filename, Format format, Source source);
+	void wait();
+	void cancel();		// Stop the running export and wait for it
+	bool isRunning() const { return running; }
+
+protected:
+	std::thread worker;
+	std::atomic<bool> running{false};
+	std::atomic<bool> stop{false};
+};
+
+#endif
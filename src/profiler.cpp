@@ -0,0 +1,159 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+static uint64_t steadyNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Profiler::Profiler() : epoch(steadyNs()) {}
+
+Profiler& Profiler::instance() {
+	static Profiler profiler;
+	return profiler;
+}
+
+uint64_t Profiler::now() const {
+	// Never 0, which marks a scope started while disabled
+	return steadyNs() - epoch + 1;
+}
+
+Profiler::ThreadBuffer& Profiler::threadBuffer() {
+	// Gives the buffer back when the thread exits, before the profiler
+	// itself is destroyed
+	struct Owner {
+		ThreadBuffer* buffer = nullptr;
+		~Owner() {
+			if (buffer)
+				Profiler::instance().retire(buffer);
+		}
+	};
+	static thread_local Owner owner;
+	if (!owner.buffer) {
+		std::lock_guard<std::mutex> guard(registryLock);
+		if (!retired.empty()) {
+			// Events of the previous thread stay until overwritten
+			owner.buffer = retired.back();
+			retired.pop_back();
+		} else {
+			buffers.push_back(std::make_shared<ThreadBuffer>());
+			owner.buffer = buffers.back().get();
+			owner.buffer->tid = (uint32_t)buffers.size();
+		}
+	}
+	return *owner.buffer;
+}
+
+void Profiler::retire(ThreadBuffer* buffer) {
+	std::lock_guard<std::mutex> guard(registryLock);
+	retired.push_back(buffer);
+}
+
+void Profiler::record(const char* name, uint64_t start, uint64_t end) {
+	ThreadBuffer& buffer = threadBuffer();
+	uint64_t idx = buffer.head.load(std::memory_order_relaxed);
+	Event& event = buffer.events[idx % EVENTS_PER_THREAD];
+	event.name.store(name, std::memory_order_relaxed);
+	event.start.store(start, std::memory_order_relaxed);
+	event.end.store(end, std::memory_order_relaxed);
+	buffer.head.store(idx + 1, std::memory_order_release);
+}
+
+const char* Profiler::intern(const std::string& name) {
+	std::lock_guard<std::mutex> guard(registryLock);
+	return names.insert(name).first->c_str();
+}
+
+void Profiler::clear() {
+	std::lock_guard<std::mutex> guard(registryLock);
+	for (auto& buffer : buffers)
+		buffer->floor.store(buffer->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+// Write s as a JSON string
+static void writeJsonString(std::ofstream& out, const char* s) {
+	out << '"';
+	for (; *s; s++) {
+		char c = *s;
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if ((unsigned char)c < 0x20)
+			out << ' ';
+		else
+			out << c;
+	}
+	out << '"';
+}
+
+std::vector<Profiler::Record> Profiler::collect(uint64_t* lost) {
+	std::lock_guard<std::mutex> guard(registryLock);
+	std::vector<Record> records;
+	if (lost)
+		*lost = 0;
+
+	for (auto& buffer : buffers) {
+		// Copy the live part of the ring, then drop whatever the owner
+		// may have overwritten in the meantime
+		uint64_t floor = buffer->floor.load(std::memory_order_relaxed);
+		uint64_t head = buffer->head.load(std::memory_order_acquire);
+		uint64_t begin = std::max(floor, head > EVENTS_PER_THREAD ? head - EVENTS_PER_THREAD : 0);
+		size_t first = records.size();
+		for (uint64_t i = begin; i < head; i++) {
+			Event& event = buffer->events[i % EVENTS_PER_THREAD];
+			records.push_back(Record{event.name.load(std::memory_order_relaxed), buffer->tid,
+				event.start.load(std::memory_order_relaxed), event.end.load(std::memory_order_relaxed)});
+		}
+
+		uint64_t after = buffer->head.load(std::memory_order_acquire);
+		uint64_t valid = std::max(begin, after >= EVENTS_PER_THREAD ? after - EVENTS_PER_THREAD + 1 : 0);
+		valid = std::min(valid, head);
+		records.erase(records.begin() + first, records.begin() + first + (valid - begin));
+		if (lost)
+			*lost += valid - floor;
+	}
+	return records;
+}
+
+bool Profiler::dump(const std::string& filename) {
+	std::ofstream out(filename);
+	if (!out)
+		return false;
+
+	// Microseconds with nanosecond resolution
+	out.setf(std::ios::fixed);
+	out.precision(3);
+
+	uint64_t lost;
+	std::vector<Record> records = collect(&lost);
+	uint32_t threads;
+	{
+		std::lock_guard<std::mutex> guard(registryLock);
+		threads = (uint32_t)buffers.size();
+	}
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	for (uint32_t tid = 1; tid <= threads; tid++) {
+		out << (tid == 1 ? "" : ",\n");
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+			<< ",\"args\":{\"name\":\"Thread " << tid << "\"}}";
+	}
+	for (size_t i = 0; i < records.size(); i++) {
+		const Record& record = records[i];
+		// Chrome wants microseconds
+		out << (i == 0 && threads == 0 ? "" : ",\n") << "{\"name\":";
+		writeJsonString(out, record.name ? record.name : "?");
+		out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << record.tid
+			<< ",\"ts\":" << record.start / 1000.0
+			<< ",\"dur\":" << (record.end - record.start) / 1000.0 << "}";
+	}
+	out << "\n]}\n";
+
+	printf("Wrote %zu profiler events to %s", records.size(), filename.c_str());
+	if (lost)
+		printf(", %llu older events were overwritten", (unsigned long long)lost);
+	printf("\n");
+	return (bool)out;
+}
@@ -0,0 +1,127 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Scoped stage profiler
+//
+// Every thread records its events into a ring buffer of its own, so the
+// hot path is two clock reads and three relaxed stores with no locking.
+// Only the newest EVENTS_PER_THREAD events of a thread are kept. The
+// ring of an exited thread goes to the next new thread, which keeps
+// recording into it under the same thread number, so short lived
+// threads cost no memory or trace rows of their own. The
+// events can be dumped at any time as Chrome trace-event JSON, to be
+// opened in chrome://tracing or https://ui.perfetto.dev
+//
+//     void Terrain::generate() {
+//         PROFILE_SCOPE("Terrain::generate");
+//         ...
+//
+// Event names are not copied: they must be string literals or come from
+// intern()
+class Profiler {
+public:
+	static const uint32_t EVENTS_PER_THREAD = 1 << 17;
+
+	// Finished event as returned by collect()
+	struct Record {
+		const char* name;
+		uint32_t tid;		// Profiler thread number, from 1
+		uint64_t start;		// Nanoseconds since the profiler was created
+		uint64_t end;
+	};
+
+	static Profiler& instance();
+
+	// Nanoseconds since the profiler was created
+	uint64_t now() const;
+
+	// Record a finished event on the calling thread
+	void record(const char* name, uint64_t start, uint64_t end);
+
+	// Stable copy of a dynamic event name, e.g. a layer function
+	const char* intern(const std::string& name);
+
+	void setEnabled(bool e) {enabled.store(e, std::memory_order_relaxed);};
+	bool isEnabled() const {return enabled.load(std::memory_order_relaxed);};
+
+	// Drop every recorded event
+	void clear();
+
+	// Every recorded event still held by the rings. lost is set to the
+	// number of events dropped because a ring wrapped around
+	std::vector<Record> collect(uint64_t* lost = nullptr);
+
+	// Write the recorded events as Chrome trace JSON, returns false if
+	// the file cannot be written
+	bool dump(const std::string& filename);
+
+	// Disallow copy, move, & assignment
+	Profiler(const Profiler& other) = delete;
+	Profiler& operator=(const Profiler& other) = delete;
+	Profiler(Profiler&& other) = delete;
+	Profiler& operator=(Profiler&& other) = delete;
+
+	// Times the enclosing scope
+	class Scope {
+	public:
+		Scope(const char* name) : name(name) {
+			Profiler& p = Profiler::instance();
+			start = p.isEnabled() ? p.now() : 0;
+		};
+		~Scope() {
+			Profiler& p = Profiler::instance();
+			if (start && p.isEnabled())
+				p.record(name, start, p.now());
+		};
+	protected:
+		const char* name;
+		uint64_t start;
+	};
+
+protected:
+	Profiler();
+
+	// Event slot, written by the owning thread only. Fields are atomic
+	// so that a dump racing with the writer reads torn events at worst,
+	// which are detected and skipped
+	struct Event {
+		std::atomic<const char*> name{nullptr};
+		std::atomic<uint64_t> start{0};
+		std::atomic<uint64_t> end{0};
+	};
+
+	struct ThreadBuffer {
+		uint32_t tid;
+		std::atomic<uint64_t> head{0};	// Number of events ever recorded
+		std::atomic<uint64_t> floor{0};	// Events before it were cleared
+		std::unique_ptr<Event[]> events{new Event[EVENTS_PER_THREAD]};
+	};
+
+	// Buffer of the calling thread, registered or recycled on first use
+	ThreadBuffer& threadBuffer();
+	// Hand the buffer of an exiting thread to the next new one
+	void retire(ThreadBuffer* buffer);
+
+	uint64_t epoch;
+	std::atomic<bool> enabled{true};
+
+	// Buffers outlive their threads so a dump still shows them
+	std::mutex registryLock;
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	std::vector<ThreadBuffer*> retired;	// Of exited threads, free to reuse
+	std::unordered_set<std::string> names;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) Profiler::Scope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+#endif
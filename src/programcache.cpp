@@ -0,0 +1,163 @@
+#include "programcache.hpp"
+#include "heightcache.hpp"
+#include "mappedfile.hpp"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace ProgramCache {
+
+static const char CACHE_MAGIC[4] = {'T', 'R', 'P', 'C'};
+
+// File header, followed by length bytes of the binary
+struct Header {
+	char magic[4];		// "TRPC"
+	uint32_t version;	// VERSION
+	uint64_t key;		// Fingerprint of the driver and sources
+	uint32_t format;	// Binary format of the driver
+	uint32_t length;
+};
+static_assert(sizeof(Header) == 24, "Program cache header layout");
+
+// 64-bit FNV-1a
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+// Lengths keep {"ab", "c"} apart from {"a", "bc"}
+static uint64_t hashString(const std::string& s, uint64_t hash) {
+	uint64_t size = s.size();
+	hash = fnv1a(&size, sizeof(size), hash);
+	return fnv1a(s.data(), s.size(), hash);
+}
+
+std::string defaultDir() {
+	return HeightCache::defaultDir() + "/programs";
+}
+
+bool available() {
+	static int supported = -1;
+	if (supported >= 0)
+		return supported;
+
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	bool entryPoints = major > 4 || (major == 4 && minor >= 1);
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count && !entryPoints; i++) {
+		const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+		entryPoints = ext && strcmp(ext, "GL_ARB_get_program_binary") == 0;
+	}
+
+	// Some drivers have the functions but no format to save in
+	GLint formats = 0;
+	if (entryPoints)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	supported = formats > 0;
+	return supported;
+}
+
+uint64_t fingerprint(const std::vector<std::string>& sources) {
+	uint64_t hash = 1469598103934665603ull;
+	uint32_t version = VERSION;
+	hash = fnv1a(&version, sizeof(version), hash);
+	GLenum names[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+	for (GLenum name : names) {
+		const char* value = (const char*)glGetString(name);
+		hash = hashString(value ? value : "", hash);
+	}
+	for (const std::string& source : sources)
+		hash = hashString(source, hash);
+	return hash;
+}
+
+std::string pathOf(const std::string& name) {
+	char file[32];
+	snprintf(file, sizeof(file), "%016llx.program",
+		(unsigned long long)hashString(name, 1469598103934665603ull));
+	return defaultDir() + "/" + file;
+}
+
+GLuint load(const std::string& name, uint64_t key) {
+	MappedFile file;
+	if (!available() || !file.open(pathOf(name)))
+		return 0;
+
+	// Reject files of another version, driver or source
+	Header header;
+	if (file.size() < sizeof(Header))
+		return 0;
+	memcpy(&header, file.data(), sizeof(Header));
+	if (memcmp(header.magic, CACHE_MAGIC, 4) != 0 || header.version != VERSION ||
+			header.key != key || file.size() != sizeof(Header) + header.length)
+		return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, file.data() + sizeof(Header), (GLsizei)header.length);
+	GLint status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void prepare(GLuint program) {
+	if (available())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void store(const std::string& name, uint64_t key, GLuint program) {
+	if (!available())
+		return;
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	GLsizei written = 0;
+	glGetProgramBinary(program, length, &written, &format, binary.data());
+	if (written <= 0)
+		return;
+
+	Header header;
+	memcpy(header.magic, CACHE_MAGIC, 4);
+	header.version = VERSION;
+	header.key = key;
+	header.format = format;
+	header.length = (uint32_t)written;
+
+	// Write aside and rename, readers never see a partial file
+	std::string path = pathOf(name);
+	std::string temp = path + ".tmp";
+	std::error_code ec;
+	fs::create_directories(defaultDir(), ec);
+	{
+		std::ofstream out(temp, std::ios::binary);
+		out.write((const char*)&header, sizeof(header));
+		out.write(binary.data(), written);
+		if (!out) {
+			printf("Cannot write program cache file %s\n", temp.c_str());
+			out.close();
+			fs::remove(temp, ec);
+			return;
+		}
+	}
+	fs::rename(temp, path, ec);
+	if (ec) {
+		printf("Cannot move program cache file to %s: %s\n", path.c_str(), ec.message().c_str());
+		fs::remove(temp, ec);
+	}
+}
+
+}
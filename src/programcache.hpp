@@ -0,0 +1,43 @@
+#ifndef PROGRAMCACHE_HPP
+#define PROGRAMCACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "gl_core_3_3.h"
+
+// On-disk cache of linked GPU programs
+//
+// Drivers that support GL_ARB_get_program_binary hand out a linked
+// program as an opaque binary, which loads much faster than compiling
+// and linking the sources again. A program is stored under the files
+// and #defines it was built from, one file each, with a fingerprint of
+// its sources and of the driver: editing a shader or updating the
+// driver makes the file stale and it is replaced on the next link.
+// Binaries the driver rejects are treated as misses too.
+namespace ProgramCache {
+	// Bump whenever the file layout changes
+	static const uint32_t VERSION = 1;
+
+	// Per user folder, next to the cached layers
+	std::string defaultDir();
+
+	// Whether the driver can hand out and take back program binaries,
+	// needs a current context
+	bool available();
+
+	// Fingerprint of the driver and of the sources of one program
+	uint64_t fingerprint(const std::vector<std::string>& sources);
+
+	// File holding the program built from name, e.g. its files and defines
+	std::string pathOf(const std::string& name);
+
+	// Program stored for name if its fingerprint is key, 0 otherwise
+	GLuint load(const std::string& name, uint64_t key);
+	// Ask the driver to keep the binary of program, before linking it
+	void prepare(GLuint program);
+	// Store the binary of a linked program, failures are only logged
+	void store(const std::string& name, uint64_t key, GLuint program);
+}
+
+#endif
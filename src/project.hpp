@@ -0,0 +1,59 @@
+#ifndef PROJECT_HPP
+#define PROJECT_HPP
+
+#include <cstdint>
+
+// Binary terrain project (*.tproj), written by Terrain::saveProject()
+//
+// The file is meant to be memory mapped: a header and a section table
+// are followed by page aligned sections whose bytes are exactly what
+// OpenGL takes, so they go from the mapping to glTexImage3D without
+// being parsed or copied. All values are little endian.
+//
+//   Header
+//   Section[sectionCount]
+//   sections, each at a multiple of ALIGNMENT
+namespace Project {
+	static const char MAGIC[8] = {'T', 'R', 'N', 'P', 'R', 'O', 'J', 0};
+	static const uint32_t VERSION = 1;
+	static const uint64_t ALIGNMENT = 4096;
+
+	enum SectionType : uint32_t {
+		SECTION_CONFIG = 1,		// Config text as read by Terrain::load()
+		SECTION_HEIGHTS = 2,	// Height maps of all layers, in texture array order
+		SECTION_QUANTIZATION = 3,	// Scale and bias floats per layer, for FORMAT_R16 heights
+		SECTION_VERTICES = 4,	// Vertex buffer of one drawn layer, no longer read
+		SECTION_NORMALS = 5,	// Normal maps of all layers, in texture array order
+	};
+
+	enum SectionFormat : uint32_t {
+		FORMAT_TEXT = 0,
+		FORMAT_R32F = 1,		// float per grid point
+		FORMAT_R16 = 2,			// 16-bit unorm per grid point
+		FORMAT_FLOAT_PAIRS = 3,
+		FORMAT_VERTEX_44 = 4,	// Float pos, face and smooth normal, texcoord, no longer read
+		FORMAT_VERTEX_12 = 5,	// Grid point, float height, octahedral normal, no longer read
+		FORMAT_OCT16 = 6,		// Terrain::PackedNormal per grid point
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t sectionCount;
+		uint64_t fileSize;		// Guards against truncated files
+	};
+
+	struct Section {
+		uint32_t type;			// SectionType
+		uint32_t format;		// SectionFormat
+		uint32_t layer;			// Layer of per layer sections
+		uint32_t reserved;
+		uint64_t offset;		// From the start of the file
+		uint64_t size;			// In bytes
+	};
+
+	static_assert(sizeof(Header) == 24, "Project header layout");
+	static_assert(sizeof(Section) == 32, "Project section layout");
+}
+
+#endif
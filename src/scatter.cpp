@@ -0,0 +1,574 @@
+#define NOMINMAX
+#include "scatter.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "light.hpp"
+#include "profiler.hpp"
+#include "scheduler.hpp"
+#include "util.hpp"
+
+const float Scatter::LOD_PIXELS[Mesh::LOD_LEVELS] = {96.0f, 48.0f, 24.0f, 12.0f};
+
+// Random numbers that only depend on the seed, not on which thread
+// handles a tile
+static uint64_t mixBits(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+struct Random {
+	uint64_t state;
+	Random(uint64_t seed) : state(mixBits(seed)) {}
+	uint64_t next() { return mixBits(state++); }
+	float uniform() { return (next() >> 40) * (1.0f / (1 << 24)); }	// [0, 1)
+};
+
+// Create shaders and associated state
+void Scatter::initGL() {
+	shader = loadProgram(":/shaders/scatter_v.glsl", ":/shaders/scatter_f.glsl");
+
+	// Get uniform locations
+	modelMatLoc = glGetUniformLocation(shader, "modelMat");
+	viewProjMatLoc = glGetUniformLocation(shader, "viewProjMat");
+	speciesMatLoc = glGetUniformLocation(shader, "speciesMat");
+	shadingModeLoc = glGetUniformLocation(shader, "shadingMode");
+	camPosLoc = glGetUniformLocation(shader, "camPos");
+	objColorLoc = glGetUniformLocation(shader, "objColor");
+	ambStrLoc = glGetUniformLocation(shader, "ambStr");
+	diffStrLoc = glGetUniformLocation(shader, "diffStr");
+	specStrLoc = glGetUniformLocation(shader, "specStr");
+	specExpLoc = glGetUniformLocation(shader, "specExp");
+
+	// Share the lights of the terrain
+	GLuint lightBlockIndex = glGetUniformBlockIndex(shader, "LightBlock");
+	glUniformBlockBinding(shader, lightBlockIndex, Light::BIND_PT);
+
+	// Billboards, baked once per species and drawn like the meshes
+	bakeShader = loadProgram(":/shaders/impostor_bake_v.glsl", ":/shaders/impostor_bake_f.glsl");
+	bakeMatLoc = glGetUniformLocation(bakeShader, "bakeMat");
+	bakeSpeciesMatLoc = glGetUniformLocation(bakeShader, "speciesMat");
+	bakePartLoc = glGetUniformLocation(bakeShader, "part");
+
+	impostorShader = loadProgram(":/shaders/impostor_v.glsl", ":/shaders/impostor_f.glsl");
+	impostorModelMatLoc = glGetUniformLocation(impostorShader, "modelMat");
+	impostorViewProjMatLoc = glGetUniformLocation(impostorShader, "viewProjMat");
+	impostorCameraLoc = glGetUniformLocation(impostorShader, "camera");
+	impostorSizeLoc = glGetUniformLocation(impostorShader, "impostorSize");
+	impostorShadingModeLoc = glGetUniformLocation(impostorShader, "shadingMode");
+	impostorCamPosLoc = glGetUniformLocation(impostorShader, "camPos");
+	impostorColorsLoc = glGetUniformLocation(impostorShader, "partColors");
+	impostorMaterialsLoc = glGetUniformLocation(impostorShader, "partMaterials");
+	impostorNormalAtlasLoc = glGetUniformLocation(impostorShader, "normalAtlas");
+	impostorPartAtlasLoc = glGetUniformLocation(impostorShader, "partAtlas");
+	lightBlockIndex = glGetUniformBlockIndex(impostorShader, "LightBlock");
+	glUniformBlockBinding(impostorShader, lightBlockIndex, Light::BIND_PT);
+
+	// Corners of a billboard, counter-clockwise seen from the camera
+	const GLfloat corners[] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
+	glGenBuffers(1, &quadBuf);
+	glBindBuffer(GL_ARRAY_BUFFER, quadBuf);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Scatter::addSpecies(const Species& s) {
+	SpeciesState state;
+	state.species = s;
+
+	// Bounds of all parts together, they share one model space
+	glm::vec3 minBB(std::numeric_limits<float>::max());
+	glm::vec3 maxBB(std::numeric_limits<float>::lowest());
+	for (const Part& part : s.parts) {
+		state.meshes.emplace_back(new Mesh(part.filename));
+		auto bb = state.meshes.back()->boundingBox();
+		minBB = glm::min(minBB, bb.first);
+		maxBB = glm::max(maxBB, bb.second);
+	}
+	float height = maxBB.y - minBB.y;
+	glm::vec3 base((minBB.x + maxBB.x) / 2.0f, minBB.y, (minBB.z + maxBB.z) / 2.0f);
+	state.speciesMat = glm::scale(glm::mat4(1.0f), glm::vec3(height > 0.0f ? 1.0f / height : 1.0f));
+	state.speciesMat = glm::translate(state.speciesMat, -base);
+	bakeImpostor(state, minBB, maxBB);
+
+	// Every mesh and the billboard read the transforms from the same
+	// instance buffer
+	glGenBuffers(1, &state.ibuf);
+	glGenVertexArrays(1, &state.impostorVao);
+	glBindVertexArray(state.impostorVao);
+	glBindBuffer(GL_ARRAY_BUFFER, quadBuf);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	std::vector<GLuint> vaos = {state.impostorVao};
+	for (auto& mesh : state.meshes)
+		vaos.push_back(mesh->getVAO());
+	glBindBuffer(GL_ARRAY_BUFFER, state.ibuf);
+	for (GLuint vao : vaos) {
+		glBindVertexArray(vao);
+		glEnableVertexAttribArray(4);
+		glVertexAttribDivisor(4, 1);
+		glEnableVertexAttribArray(5);
+		glVertexAttribDivisor(5, 1);
+		bindInstances(0);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	species.push_back(std::move(state));
+}
+
+void Scatter::clearSpecies() {
+	release();
+}
+
+void Scatter::bindInstances(GLsizei first) {
+	size_t offset = (size_t)first * sizeof(Instance);
+	glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)(offset + offsetof(Instance, pos)));
+	glVertexAttribPointer(5, 2, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)(offset + offsetof(Instance, rotation)));
+}
+
+// Render the species from every side into the atlases, orthographic and
+// centered on the middle of its unit height
+void Scatter::bakeImpostor(SpeciesState& state, const glm::vec3& minBB, const glm::vec3& maxBB) {
+	float height = maxBB.y - minBB.y;
+	float unit = height > 0.0f ? 1.0f / height : 1.0f;
+	glm::vec2 halfExtent = glm::vec2(maxBB.x - minBB.x, maxBB.z - minBB.z) * (0.5f * unit);
+	float size = std::max(glm::length(halfExtent), 0.5f);
+	state.impostorSize = size;
+
+	GLsizei atlasWidth = IMPOSTOR_TILE * IMPOSTOR_VIEWS;
+	glGenTextures(1, &state.normalAtlas);
+	glBindTexture(GL_TEXTURE_2D, state.normalAtlas);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, atlasWidth, IMPOSTOR_TILE, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	// Part indices do not blend
+	glGenTextures(1, &state.partAtlas);
+	glBindTexture(GL_TEXTURE_2D, state.partAtlas);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlasWidth, IMPOSTOR_TILE, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// The widget draws into a framebuffer of its own, put it back after
+	GLint previousFbo, viewport[4];
+	GLfloat clearColor[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFbo);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+
+	GLuint fbo, depth;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenRenderbuffers(1, &depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, atlasWidth, IMPOSTOR_TILE);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, state.normalAtlas, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, state.partAtlas, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	const GLenum attachments[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+	glDrawBuffers(2, attachments);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE) {
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glUseProgram(bakeShader);
+		glUniformMatrix4fv(bakeSpeciesMatLoc, 1, GL_FALSE, glm::value_ptr(state.speciesMat));
+
+		// View k looks from angle k around the up axis, as the billboard
+		// shader picks it
+		glm::vec3 center(0.0f, 0.5f, 0.0f);
+		glm::mat4 proj = glm::ortho(-size, size, -size, size, 0.0f, 4.0f * size);
+		for (int k = 0; k < IMPOSTOR_VIEWS; k++) {
+			float angle = k * glm::two_pi<float>() / IMPOSTOR_VIEWS;
+			glm::vec3 from(std::sin(angle), 0.0f, std::cos(angle));
+			glm::mat4 view = glm::lookAt(center + 2.0f * size * from, center, glm::vec3(0.0f, 1.0f, 0.0f));
+			glm::mat4 bakeMat = proj * view;
+			glUniformMatrix4fv(bakeMatLoc, 1, GL_FALSE, glm::value_ptr(bakeMat));
+			glViewport(k * IMPOSTOR_TILE, 0, IMPOSTOR_TILE, IMPOSTOR_TILE);
+			for (size_t i = 0; i < state.meshes.size(); i++) {
+				glUniform1i(bakePartLoc, std::min((int)i, IMPOSTOR_PARTS - 1));
+				state.meshes[i]->draw();
+			}
+		}
+		glUseProgram(0);
+	} else {
+		printf("Cannot bake the billboard of %s\n", state.species.name.c_str());
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFbo);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+	glDeleteRenderbuffers(1, &depth);
+	glDeleteFramebuffers(1, &fbo);
+
+	glBindTexture(GL_TEXTURE_2D, state.normalAtlas);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Scatter::place(Terrain& terrain, uint64_t seed) {
+	PROFILE_SCOPE("Scatter::place");
+	auto start = std::chrono::steady_clock::now();
+
+	Field field;
+	readField(terrain, field);
+
+	for (size_t i = 0; i < species.size(); i++) {
+		SpeciesState& state = species[i];
+		std::vector<Instance> instances;
+		sample(field, state.species, mixBits(seed) ^ i, instances);
+
+		// Uploaded by draw, sorted for the camera
+		state.count = (GLsizei)instances.size();
+		state.instances = std::move(instances);
+		state.sorted = false;
+		printf("Scattered %zu instances of %s\n", state.instances.size(), state.species.name.c_str());
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	printf("Placed %zu instances in %.2f ms\n", getInstanceCount(), elapsed.count());
+}
+
+void Scatter::clearInstances() {
+	for (SpeciesState& state : species) {
+		state.count = 0;
+		state.instances.clear();
+		state.sorted = false;
+	}
+}
+
+size_t Scatter::getInstanceCount() const {
+	size_t count = 0;
+	for (const SpeciesState& state : species)
+		count += state.count;
+	return count;
+}
+
+void Scatter::draw(const glm::mat4& modelMat, const glm::mat4& viewProjMat, const glm::vec3& camPos,
+		int shadingMode, float pixelScale) {
+	PROFILE_SCOPE("Scatter::draw");
+	if (getInstanceCount() == 0)
+		return;
+
+	// Buckets change only when the camera does
+	glm::vec3 camera = glm::vec3(glm::inverse(modelMat) * glm::vec4(camPos, 1.0f));
+	if (camera != lastCamera || pixelScale != lastPixelScale) {
+		lastCamera = camera;
+		lastPixelScale = pixelScale;
+		for (SpeciesState& state : species)
+			state.sorted = false;
+	}
+	for (SpeciesState& state : species) {
+		if (state.sorted || state.count == 0)
+			continue;
+		sortByDetail(state.instances, camera, pixelScale, sortedInstances, state.buckets);
+		glBindBuffer(GL_ARRAY_BUFFER, state.ibuf);
+		glBufferData(GL_ARRAY_BUFFER, sortedInstances.size() * sizeof(Instance), sortedInstances.data(), GL_STREAM_DRAW);
+		state.sorted = true;
+	}
+
+	glUseProgram(shader);
+	glUniformMatrix4fv(modelMatLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
+	glUniformMatrix4fv(viewProjMatLoc, 1, GL_FALSE, glm::value_ptr(viewProjMat));
+	glUniform3fv(camPosLoc, 1, glm::value_ptr(camPos));
+	glUniform1i(shadingModeLoc, shadingMode);
+
+	// One draw call per mesh and level in use
+	for (SpeciesState& state : species) {
+		if (state.count == 0)
+			continue;
+		glUniformMatrix4fv(speciesMatLoc, 1, GL_FALSE, glm::value_ptr(state.speciesMat));
+		glBindBuffer(GL_ARRAY_BUFFER, state.ibuf);
+		for (size_t i = 0; i < state.meshes.size(); i++) {
+			Mesh& mesh = *state.meshes[i];
+			const Terrain::PhongConfig& material = state.species.parts[i].material;
+			glUniform3fv(objColorLoc, 1, glm::value_ptr(material.color / 255.0f));
+			glUniform1f(ambStrLoc, material.ambient);
+			glUniform1f(diffStrLoc, material.diffuse);
+			glUniform1f(specStrLoc, material.specular);
+			glUniform1f(specExpLoc, material.exponent);
+			GLsizei first = 0;
+			for (int level = 0; level < Mesh::LOD_LEVELS; first += state.buckets[level++]) {
+				if (state.buckets[level] == 0)
+					continue;
+				glBindVertexArray(mesh.getVAO());
+				bindInstances(first);
+				mesh.drawInstanced(state.buckets[level], std::min(level, mesh.getLevelCount() - 1));
+			}
+		}
+	}
+
+	// One draw call per species for the billboards
+	glUseProgram(impostorShader);
+	glUniformMatrix4fv(impostorModelMatLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
+	glUniformMatrix4fv(impostorViewProjMatLoc, 1, GL_FALSE, glm::value_ptr(viewProjMat));
+	glUniform3fv(impostorCameraLoc, 1, glm::value_ptr(camera));
+	glUniform3fv(impostorCamPosLoc, 1, glm::value_ptr(camPos));
+	glUniform1i(impostorShadingModeLoc, shadingMode);
+	glUniform1i(impostorNormalAtlasLoc, 0);
+	glUniform1i(impostorPartAtlasLoc, 1);
+	for (SpeciesState& state : species) {
+		GLsizei billboards = state.buckets[Mesh::LOD_LEVELS];
+		if (state.count == 0 || billboards == 0 || state.meshes.empty())
+			continue;
+
+		// Ambient, diffuse, specular and exponent of every part
+		glm::vec3 colors[IMPOSTOR_PARTS];
+		glm::vec4 materials[IMPOSTOR_PARTS];
+		for (int i = 0; i < IMPOSTOR_PARTS; i++) {
+			const Terrain::PhongConfig& material =
+				state.species.parts[std::min((size_t)i, state.species.parts.size() - 1)].material;
+			colors[i] = material.color / 255.0f;
+			materials[i] = glm::vec4(material.ambient, material.diffuse, material.specular, material.exponent);
+		}
+		glUniform3fv(impostorColorsLoc, IMPOSTOR_PARTS, glm::value_ptr(colors[0]));
+		glUniform4fv(impostorMaterialsLoc, IMPOSTOR_PARTS, glm::value_ptr(materials[0]));
+		glUniform1f(impostorSizeLoc, state.impostorSize);
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, state.partAtlas);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, state.normalAtlas);
+		glBindVertexArray(state.impostorVao);
+		glBindBuffer(GL_ARRAY_BUFFER, state.ibuf);
+		bindInstances(state.count - billboards);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, billboards);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Scatter::sortByDetail(const std::vector<Instance>& instances, const glm::vec3& camera,
+		float pixelScale, std::vector<Instance>& sorted, GLsizei counts[DETAIL_BUCKETS]) {
+	PROFILE_SCOPE("Scatter::sortByDetail");
+	std::fill(counts, counts + DETAIL_BUCKETS, 0);
+	sorted.resize(instances.size());
+	if (instances.empty())
+		return;
+
+	// Bucket of every instance from its height on screen, counted per chunk
+	size_t chunks = (instances.size() + SORT_CHUNK - 1) / SORT_CHUNK;
+	std::vector<uint8_t> bucketOf(instances.size());
+	std::vector<std::array<size_t, DETAIL_BUCKETS>> chunkCounts(chunks);
+	TaskScheduler& scheduler = TaskScheduler::instance();
+	scheduler.parallelFor(0, chunks, 1, [&](unsigned, size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++) {
+			std::array<size_t, DETAIL_BUCKETS>& count = chunkCounts[chunk];
+			count.fill(0);
+			size_t last = std::min((chunk + 1) * SORT_CHUNK, instances.size());
+			for (size_t i = chunk * SORT_CHUNK; i < last; i++) {
+				const Instance& instance = instances[i];
+				glm::vec3 center = instance.pos + glm::vec3(0.0f, 0.5f * instance.scale, 0.0f);
+				float distance = glm::length(center - camera);
+				float pixels = distance > 0.0f ? instance.scale * pixelScale / distance : LOD_PIXELS[0];
+				int bucket = 0;
+				while (bucket < Mesh::LOD_LEVELS && pixels < LOD_PIXELS[bucket])
+					bucket++;
+				bucketOf[i] = (uint8_t)bucket;
+				count[bucket]++;
+			}
+		}
+	});
+
+	// Buckets one after the other, chunks in order within each
+	std::vector<std::array<size_t, DETAIL_BUCKETS>> chunkStarts(chunks);
+	size_t offset = 0;
+	for (int bucket = 0; bucket < DETAIL_BUCKETS; bucket++) {
+		for (size_t chunk = 0; chunk < chunks; chunk++) {
+			chunkStarts[chunk][bucket] = offset;
+			offset += chunkCounts[chunk][bucket];
+		}
+		counts[bucket] = (GLsizei)(offset - chunkStarts[0][bucket]);
+	}
+	scheduler.parallelFor(0, chunks, 1, [&](unsigned, size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++) {
+			std::array<size_t, DETAIL_BUCKETS> next = chunkStarts[chunk];
+			size_t last = std::min((chunk + 1) * SORT_CHUNK, instances.size());
+			for (size_t i = chunk * SORT_CHUNK; i < last; i++)
+				sorted[next[bucketOf[i]]++] = instances[i];
+		}
+	});
+}
+
+// Release resources
+void Scatter::release() {
+	for (SpeciesState& state : species) {
+		if (state.ibuf) glDeleteBuffers(1, &state.ibuf);
+		if (state.impostorVao) glDeleteVertexArrays(1, &state.impostorVao);
+		if (state.normalAtlas) glDeleteTextures(1, &state.normalAtlas);
+		if (state.partAtlas) glDeleteTextures(1, &state.partAtlas);
+	}
+	species.clear();
+}
+
+void Scatter::readField(Terrain& terrain, Field& field) {
+	PROFILE_SCOPE("Scatter::readField");
+	field.rows = field.cols = 0;
+	uint32_t rows = terrain.getWidth();
+	uint32_t cols = terrain.getLength();
+	size_t points = (size_t)rows * cols;
+	field.ground.resize(points);
+
+	// Nothing to stand on until the terrain is evaluated at its size
+	try {
+		terrain.readHeightRow(0, 0, field.ground.data());
+	} catch (const std::out_of_range&) {
+		return;
+	}
+	field.top.resize(points);
+	field.paint.resize(points);
+
+	// Painted as in the fragment shader
+	TaskScheduler::instance().parallelFor(0, rows, 16, [&](unsigned, size_t row_begin, size_t row_end) {
+		for (size_t row = row_begin; row < row_end; row++) {
+			terrain.readHeightRow(0, row, &field.ground[row * cols]);
+			terrain.readHeightRow(-1, row, &field.top[row * cols]);
+			terrain.readMaterialRow(row, &field.paint[row * cols]);
+		}
+	});
+	field.rows = rows;
+	field.cols = cols;
+}
+
+// Whether an instance may stand at grid position (row, col), with the
+// ground height there
+static bool accepts(const Scatter::Field& field, const Scatter::Species& species, float tanSlope,
+		float row, float col, float& height) {
+	uint32_t r0 = std::min((uint32_t)row, field.rows - 2);
+	uint32_t c0 = std::min((uint32_t)col, field.cols - 2);
+	float fr = row - r0, fc = col - c0;
+	const float* g = &field.ground[(size_t)r0 * field.cols + c0];
+	float h00 = g[0], h01 = g[1], h10 = g[field.cols], h11 = g[field.cols + 1];
+
+	height = (h00 * (1 - fc) + h01 * fc) * (1 - fr) + (h10 * (1 - fc) + h11 * fc) * fr;
+	if (height < species.minHeight || height > species.maxHeight)
+		return false;
+
+	// Points are 2 / rows apart along x and 2 / cols along z
+	float dx = ((h10 - h00) * (1 - fc) + (h11 - h01) * fc) * field.rows / 2.0f;
+	float dz = ((h01 - h00) * (1 - fr) + (h11 - h10) * fr) * field.cols / 2.0f;
+	if (dx * dx + dz * dz > tanSlope * tanSlope)
+		return false;
+
+	size_t nearest = (size_t)std::lround(row) * field.cols + std::lround(col);
+	if (species.aboveSurfaces && field.top[nearest] > field.ground[nearest])
+		return false;
+	return species.layer < 0 || field.paint[nearest] == species.layer;
+}
+
+void Scatter::sample(const Field& field, const Species& species, uint64_t seed, std::vector<Instance>& instances) {
+	PROFILE_SCOPE("Scatter::sample");
+	instances.clear();
+	if (field.rows < 2 || field.cols < 2 || !(species.spacing > 0.0f))
+		return;
+
+	// Samples are kept in grid units from the first point, a row is
+	// 2 / rows and a column 2 / cols apart
+	float extentX = 2.0f * (field.rows - 1) / field.rows;
+	float extentZ = 2.0f * (field.cols - 1) / field.cols;
+	float toRow = field.rows / 2.0f, toCol = field.cols / 2.0f;
+	float tanSlope = std::tan(glm::radians(std::clamp(species.maxSlope, 0.0f, 89.9f)));
+
+	// Background grid with at most one sample per cell, a sample only
+	// conflicts with the ones up to two cells away
+	float cell = species.spacing / std::sqrt(2.0f);
+	uint32_t gridX = std::max(1u, (uint32_t)std::ceil(extentX / cell));
+	uint32_t gridZ = std::max(1u, (uint32_t)std::ceil(extentZ / cell));
+	if ((size_t)gridX * gridZ > (1u << 27)) {
+		printf("Spacing %g of %s is too small to scatter\n", species.spacing, species.name.c_str());
+		return;
+	}
+	std::vector<glm::vec2> points((size_t)gridX * gridZ, glm::vec2(NAN));
+	std::vector<float> heights((size_t)gridX * gridZ);
+	float spacing2 = species.spacing * species.spacing;
+
+	auto sampleTile = [&](uint32_t tileX, uint32_t tileZ) {
+		uint32_t x0 = tileX * TILE_CELLS, x1 = std::min(x0 + TILE_CELLS, gridX);
+		uint32_t z0 = tileZ * TILE_CELLS, z1 = std::min(z0 + TILE_CELLS, gridZ);
+		Random random(seed ^ mixBits(((uint64_t)tileX << 32) | tileZ));
+
+		// Cells in random order, so no direction is favoured
+		std::vector<uint32_t> cells;
+		for (uint32_t z = z0; z < z1; z++)
+			for (uint32_t x = x0; x < x1; x++)
+				cells.push_back(z * gridX + x);
+		for (size_t i = cells.size(); i > 1; i--)
+			std::swap(cells[i - 1], cells[random.next() % i]);
+
+		for (uint32_t index : cells) {
+			uint32_t cx = index % gridX, cz = index / gridX;
+			for (int attempt = 0; attempt < CELL_ATTEMPTS; attempt++) {
+				glm::vec2 p((cx + random.uniform()) * cell, (cz + random.uniform()) * cell);
+				if (p.x > extentX || p.y > extentZ)
+					continue;
+
+				float height;
+				if (!accepts(field, species, tanSlope, p.x * toRow, p.y * toCol, height))
+					continue;
+
+				// Empty cells hold NaN, which is never closer
+				bool free = true;
+				for (uint32_t z = cz > 2 ? cz - 2 : 0; free && z <= std::min(cz + 2, gridZ - 1); z++) {
+					for (uint32_t x = cx > 2 ? cx - 2 : 0; x <= std::min(cx + 2, gridX - 1); x++) {
+						glm::vec2 d = points[(size_t)z * gridX + x] - p;
+						if (glm::dot(d, d) < spacing2) {
+							free = false;
+							break;
+						}
+					}
+				}
+				if (free) {
+					points[index] = p;
+					heights[index] = height;
+					break;
+				}
+			}
+		}
+	};
+
+	// Tiles of a phase are a tile apart, wider than the two cells a
+	// sample looks at, so they are sampled in parallel without locking
+	uint32_t tilesX = (gridX + TILE_CELLS - 1) / TILE_CELLS;
+	uint32_t tilesZ = (gridZ + TILE_CELLS - 1) / TILE_CELLS;
+	TaskScheduler& scheduler = TaskScheduler::instance();
+	for (uint32_t phase = 0; phase < 4; phase++) {
+		uint32_t phaseX = phase & 1, phaseZ = phase >> 1;
+		uint32_t countX = (tilesX + 1 - phaseX) / 2, countZ = (tilesZ + 1 - phaseZ) / 2;
+		scheduler.parallelFor(0, (size_t)countX * countZ, 1, [&](unsigned, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				sampleTile(phaseX + 2 * (uint32_t)(i % countX), phaseZ + 2 * (uint32_t)(i / countX));
+		});
+	}
+
+	// Instances in grid order, the same for any number of threads
+	for (size_t i = 0; i < points.size(); i++) {
+		glm::vec2 p = points[i];
+		if (std::isnan(p.x))
+			continue;
+		Random random(seed ^ mixBits(i));
+		float yaw = random.uniform() * glm::two_pi<float>();
+		Instance instance;
+		instance.pos = glm::vec3(p.x - 1.0f, heights[i], 1.0f - p.y);
+		instance.scale = species.size * (1.0f + species.sizeJitter * (2.0f * random.uniform() - 1.0f));
+		instance.rotation = glm::vec2(std::cos(yaw), std::sin(yaw));
+		instances.push_back(instance);
+	}
+}
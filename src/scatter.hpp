@@ -0,0 +1,186 @@
+#ifndef SCATTER_HPP
+#define SCATTER_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+#include "mesh.hpp"
+#include "terrain.hpp"
+
+// Instances of OBJ models scattered over the terrain
+//
+// A species is a set of meshes drawn together, e.g. the trunk and the
+// leaves of a tree, with rules for where it grows: ground height, slope
+// and the layer painting the ground. place() samples the terrain with
+// Poisson-disk spacing in parallel and keeps the points passing the
+// rules. Every mesh is then drawn once for all instances of its species
+// with glDrawElementsInstanced, the transforms coming from a per
+// instance vertex buffer, so there is one draw call per mesh however
+// many instances there are.
+//
+// Instances far away use the decimated levels of their meshes, and the
+// farthest a billboard baked from eight sides when the species is
+// added. Whenever the camera moves the instances are sorted by the
+// height they take on screen into one bucket per level and one for the
+// billboards, and every bucket is drawn from its range of the buffer.
+class Scatter {
+public:
+	Scatter() {}
+	~Scatter() { release(); }
+	// Disallow copy, move, & assignment
+	Scatter(const Scatter& other) = delete;
+	Scatter& operator=(const Scatter& other) = delete;
+	Scatter(Scatter&& other) = delete;
+	Scatter& operator=(Scatter&& other) = delete;
+
+	// A mesh of a species, material color is in 0..255 like the layers
+	struct Part {
+		std::string filename;
+		Terrain::PhongConfig material;
+	};
+
+	// Distances and heights are in terrain units, the grid spans [-1, 1]
+	struct Species {
+		std::string name;
+		std::vector<Part> parts;
+		float spacing = 0.03f;		// Least distance between instances
+		float size = 0.04f;			// Height of an instance
+		float sizeJitter = 0.25f;	// Random change of the size, relative
+		float minHeight = -1e30f;	// Ground heights it grows on
+		float maxHeight = 1e30f;
+		float maxSlope = 35.0f;		// Steepest ground, in degrees
+		int layer = -1;				// Layer painting the ground, -1 for any
+		bool aboveSurfaces = true;	// Not below another drawn surface, e.g. water
+	};
+
+	// Per instance transform: world = pos + scale * yaw rotation * model
+	struct Instance {
+		glm::vec3 pos;			// Ground point
+		float scale;
+		glm::vec2 rotation;		// Cosine and sine of the yaw
+	};
+
+	// What the rules look at, one value per grid point
+	struct Field {
+		uint32_t rows = 0;
+		uint32_t cols = 0;
+		std::vector<float> ground;		// Height of layer 0
+		std::vector<float> top;			// Highest drawn surface
+		std::vector<uint8_t> paint;		// Layer the terrain is painted with
+	};
+
+	void initGL();
+
+	// Loads the meshes of the species, needs the GL context
+	void addSpecies(const Species& species);
+	void clearSpecies();
+	size_t getSpeciesCount() const { return species.size(); }
+	Species& getSpecies(int index) { return species.at(index).species; }
+
+	// Place every species on the terrain and upload the instances
+	void place(Terrain& terrain, uint64_t seed);
+	void clearInstances();
+	size_t getInstanceCount() const;
+
+	// pixelScale is the viewport height in pixels over 2 tan(fovy / 2),
+	// the on screen size of a unit at distance 1
+	void draw(const glm::mat4& modelMat, const glm::mat4& viewProjMat, const glm::vec3& camPos,
+		int shadingMode, float pixelScale);
+
+	// One bucket per mesh level, then the billboards
+	static const int DETAIL_BUCKETS = Mesh::LOD_LEVELS + 1;
+
+	// Placement without OpenGL
+	static void readField(Terrain& terrain, Field& field);
+	static void sample(const Field& field, const Species& species, uint64_t seed,
+		std::vector<Instance>& instances);
+	// Instances ordered by bucket for a camera at camera, in terrain
+	// space, keeping their order within a bucket
+	static void sortByDetail(const std::vector<Instance>& instances, const glm::vec3& camera,
+		float pixelScale, std::vector<Instance>& sorted, GLsizei counts[DETAIL_BUCKETS]);
+
+protected:
+	// Cells of the Poisson-disk background grid per tile side. Tiles are
+	// sampled in four phases so no two tiles of a phase are neighbours
+	static const uint32_t TILE_CELLS = 8;
+	static const int CELL_ATTEMPTS = 4;
+
+	// Least on screen height in pixels of every mesh level, instances
+	// smaller than the last are billboards
+	static const float LOD_PIXELS[Mesh::LOD_LEVELS];
+	// Billboard views around the up axis, and their size in the atlas
+	static const int IMPOSTOR_VIEWS = 8;
+	static const int IMPOSTOR_TILE = 128;
+	// Parts with their own material on billboards, later ones use the last
+	static const int IMPOSTOR_PARTS = 4;
+	// Instances per piece of parallel sorting
+	static const size_t SORT_CHUNK = 4096;
+
+	struct SpeciesState {
+		Species species;
+		std::vector<std::unique_ptr<Mesh>> meshes;	// One per part
+		glm::mat4 speciesMat;	// Model space to unit height, base at the origin
+		GLuint ibuf = 0;		// Instance buffer, sorted by bucket
+		GLsizei count = 0;		// Number of instances
+		std::vector<Instance> instances;	// As placed
+		GLsizei buckets[DETAIL_BUCKETS] = {};	// Instances per bucket
+		bool sorted = false;	// Buffer is sorted for the last camera
+
+		// Billboard of the species, normals and coverage in one atlas
+		// and the part drawn at every texel in another
+		GLuint normalAtlas = 0;
+		GLuint partAtlas = 0;
+		GLuint impostorVao = 0;
+		float impostorSize = 0.5f;	// Half the side of a billboard, unit height
+	};
+	std::vector<SpeciesState> species;
+
+	void release();
+	void bakeImpostor(SpeciesState& state, const glm::vec3& minBB, const glm::vec3& maxBB);
+	// Point the instance attributes of the bound vertex array at the
+	// instances from first on
+	static void bindInstances(GLsizei first);
+
+	// Camera the buffers were last sorted for
+	glm::vec3 lastCamera = glm::vec3(NAN);
+	float lastPixelScale = 0.0f;
+	std::vector<Instance> sortedInstances;
+
+	GLuint quadBuf = 0;		// Billboard corners, a triangle strip
+
+	// Billboard baking and drawing
+	GLuint bakeShader = 0;
+	GLuint bakeMatLoc = 0;
+	GLuint bakeSpeciesMatLoc = 0;
+	GLuint bakePartLoc = 0;
+	GLuint impostorShader = 0;
+	GLuint impostorModelMatLoc = 0;
+	GLuint impostorViewProjMatLoc = 0;
+	GLuint impostorCameraLoc = 0;
+	GLuint impostorSizeLoc = 0;
+	GLuint impostorShadingModeLoc = 0;
+	GLuint impostorCamPosLoc = 0;
+	GLuint impostorColorsLoc = 0;
+	GLuint impostorMaterialsLoc = 0;
+	GLuint impostorNormalAtlasLoc = 0;
+	GLuint impostorPartAtlasLoc = 0;
+
+	// Shader state
+	GLuint shader = 0;
+	GLuint modelMatLoc = 0;
+	GLuint viewProjMatLoc = 0;
+	GLuint speciesMatLoc = 0;
+	GLuint shadingModeLoc = 0;
+	GLuint camPosLoc = 0;
+	GLuint objColorLoc = 0;
+	GLuint ambStrLoc = 0;
+	GLuint diffStrLoc = 0;
+	GLuint specStrLoc = 0;
+	GLuint specExpLoc = 0;
+};
+
+#endif
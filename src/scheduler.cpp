@@ -0,0 +1,188 @@
+#include "scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+
+// Worker index of the current thread while it runs a loop body
+static thread_local int currentWorker = -1;
+
+static uint64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double TaskScheduler::Stats::utilization() const {
+	if (wallNs == 0 || workers.empty())
+		return 0.0;
+	uint64_t busy = 0;
+	for (auto& w : workers)
+		busy += w.busyNs;
+	return (double)busy / ((double)wallNs * workers.size());
+}
+
+uint64_t TaskScheduler::Stats::totalSteals() const {
+	uint64_t steals = 0;
+	for (auto& w : workers)
+		steals += w.steals;
+	return steals;
+}
+
+// Constructor - start the worker threads, the caller of parallelFor
+// acts as worker 0
+TaskScheduler::TaskScheduler(unsigned threads) {
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < threads; i++)
+		queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+	for (unsigned i = 1; i < threads; i++)
+		this->threads.push_back(std::thread(&TaskScheduler::workerLoop, this, i));
+}
+
+// Destructor - wake every worker up and wait for them to leave
+TaskScheduler::~TaskScheduler() {
+	{
+		std::lock_guard<std::mutex> guard(wakeLock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+TaskScheduler& TaskScheduler::instance() {
+	static TaskScheduler scheduler;
+	return scheduler;
+}
+
+void TaskScheduler::parallelFor(size_t begin, size_t end, size_t grain, const RangeBody& body) {
+	if (begin >= end)
+		return;
+	grain = std::max<size_t>(grain, 1);
+
+	// Nested loop from inside a body, the other workers are already busy
+	if (currentWorker >= 0) {
+		for (size_t b = begin; b < end; b += grain)
+			body(currentWorker, b, std::min(b + grain, end));
+		return;
+	}
+
+	std::lock_guard<std::mutex> job(jobLock);
+	uint64_t start = nowNs();
+
+	// Publish the job, the whole range starts in the caller's deque
+	this->body = &body;
+	this->grain = grain;
+	{
+		std::lock_guard<std::mutex> guard(queues[0]->lock);
+		queues[0]->ranges.push_back(Range{begin, end});
+	}
+	pending.store(end - begin, std::memory_order_release);
+	{
+		std::lock_guard<std::mutex> guard(wakeLock);
+		generation++;
+	}
+	wake.notify_all();
+
+	runJob(0);
+
+	this->body = nullptr;
+	wallNs += nowNs() - start;
+}
+
+TaskScheduler::Stats TaskScheduler::getStats() {
+	std::lock_guard<std::mutex> job(jobLock);
+	Stats stats;
+	stats.wallNs = wallNs;
+	for (auto& q : queues)
+		stats.workers.push_back(q->stats);
+	return stats;
+}
+
+void TaskScheduler::resetStats() {
+	std::lock_guard<std::mutex> job(jobLock);
+	wallNs = 0;
+	for (auto& q : queues)
+		q->stats = WorkerStats();
+}
+
+// Sleep until a job is posted, help with it, repeat
+void TaskScheduler::workerLoop(unsigned worker) {
+	uint64_t seen = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(wakeLock);
+			wake.wait(guard, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+		runJob(worker);
+	}
+}
+
+void TaskScheduler::runJob(unsigned worker) {
+	currentWorker = worker;
+	while (pending.load(std::memory_order_acquire) > 0) {
+		Range range;
+		if (popLocal(worker, range) || steal(worker, range))
+			process(worker, range);
+		else
+			std::this_thread::yield();
+	}
+	currentWorker = -1;
+}
+
+// Newest range of our own deque, the smallest and warmest one
+bool TaskScheduler::popLocal(unsigned worker, Range& range) {
+	WorkQueue& q = *queues[worker];
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.ranges.empty())
+		return false;
+	range = q.ranges.back();
+	q.ranges.pop_back();
+	return true;
+}
+
+// Oldest range of another worker's deque, the largest one
+bool TaskScheduler::steal(unsigned worker, Range& range) {
+	unsigned count = (unsigned)queues.size();
+	for (unsigned i = 1; i < count; i++) {
+		WorkQueue& victim = *queues[(worker + i) % count];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (victim.ranges.empty())
+			continue;
+		range = victim.ranges.front();
+		victim.ranges.pop_front();
+		queues[worker]->stats.steals++;
+		return true;
+	}
+	return false;
+}
+
+// Run a range grain by grain, handing its upper half to the deque
+// whenever the deque has been drained by thieves
+void TaskScheduler::process(unsigned worker, Range range) {
+	WorkQueue& q = *queues[worker];
+	while (range.begin < range.end) {
+		size_t len = range.end - range.begin;
+		if (len > grain && queues.size() > 1) {
+			std::lock_guard<std::mutex> guard(q.lock);
+			if (q.ranges.empty()) {
+				// Split on a grain boundary so pieces stay aligned
+				size_t half = (len / 2 + grain - 1) / grain * grain;
+				q.ranges.push_back(Range{range.begin + half, range.end});
+				range.end = range.begin + half;
+				q.stats.splits++;
+			}
+		}
+
+		size_t stop = std::min(range.begin + grain, range.end);
+		uint64_t start = nowNs();
+		(*body)(worker, range.begin, stop);
+		q.stats.busyNs += nowNs() - start;
+		q.stats.ranges++;
+
+		pending.fetch_sub(stop - range.begin, std::memory_order_acq_rel);
+		range.begin = stop;
+	}
+}
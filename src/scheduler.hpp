@@ -0,0 +1,105 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing scheduler shared by terrain evaluation, normal
+// computation and mesh building
+//
+// Every worker owns a deque of index ranges. A worker pops from the back
+// of its own deque and, when it runs dry, steals from the front of
+// somebody else's, where the largest pieces are. Ranges are split
+// lazily: a worker only halves its range when its own deque is empty,
+// i.e. when the previous half has been stolen by an idle worker, so
+// cheap jobs are not chopped up for nothing while expensive or uneven
+// ones end up spread over all cores.
+class TaskScheduler {
+public:
+	// Body of a parallel loop, called with the worker index in
+	// [0, getWorkerCount()) and a sub range [begin, end)
+	typedef std::function<void(unsigned worker, size_t begin, size_t end)> RangeBody;
+
+	// Per worker utilization counters, accumulated until resetStats()
+	struct WorkerStats {
+		uint64_t busyNs = 0;	// Time spent running loop bodies
+		uint64_t ranges = 0;	// Number of body invocations
+		uint64_t splits = 0;	// Ranges halved to feed idle workers
+		uint64_t steals = 0;	// Ranges taken from other workers
+	};
+	struct Stats {
+		uint64_t wallNs = 0;	// Time spent inside parallelFor
+		std::vector<WorkerStats> workers;
+		// Fraction of the available worker time spent in bodies
+		double utilization() const;
+		uint64_t totalSteals() const;
+	};
+
+	// 0 threads picks one worker per hardware thread
+	explicit TaskScheduler(unsigned threads = 0);
+	~TaskScheduler();
+	// Disallow copy, move, & assignment
+	TaskScheduler(const TaskScheduler& other) = delete;
+	TaskScheduler& operator=(const TaskScheduler& other) = delete;
+	TaskScheduler(TaskScheduler&& other) = delete;
+	TaskScheduler& operator=(TaskScheduler&& other) = delete;
+
+	// Scheduler used by the terrain pipeline
+	static TaskScheduler& instance();
+
+	// Number of workers, including the thread calling parallelFor
+	unsigned getWorkerCount() const { return (unsigned)queues.size(); }
+
+	// Run body over [begin, end) and return once every index is done.
+	// Pieces handed to body are at most grain long. Calls made from
+	// inside a body run inline on the calling worker
+	void parallelFor(size_t begin, size_t end, size_t grain, const RangeBody& body);
+
+	Stats getStats();
+	void resetStats();
+
+protected:
+	struct Range {
+		size_t begin;
+		size_t end;
+	};
+
+	// Deque of ranges owned by one worker
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<Range> ranges;
+		WorkerStats stats;
+	};
+
+	void workerLoop(unsigned worker);
+	// Work on the current job until every range of it is done
+	void runJob(unsigned worker);
+	bool popLocal(unsigned worker, Range& range);
+	bool steal(unsigned worker, Range& range);
+	void process(unsigned worker, Range range);
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> threads;
+
+	// Current job, one parallelFor runs at a time
+	std::mutex jobLock;
+	const RangeBody* body = nullptr;
+	size_t grain = 1;
+	std::atomic<size_t> pending{0};		// Indices not yet processed
+	uint64_t wallNs = 0;
+
+	// Wakes sleeping workers when a job is posted
+	std::mutex wakeLock;
+	std::condition_variable wake;
+	uint64_t generation = 0;			// Bumped for every job
+	bool stopping = false;
+};
+
+#endif
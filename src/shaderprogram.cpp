@@ -0,0 +1,198 @@
+#include "shaderprogram.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "util.hpp"
+
+// How values of a uniform type are laid out and uploaded
+void ShaderProgram::describe(GLenum type, int& components, Kind& kind) {
+	switch (type) {
+	case GL_FLOAT:				components = 1; kind = FLOAT; break;
+	case GL_FLOAT_VEC2:			components = 2; kind = FLOAT; break;
+	case GL_FLOAT_VEC3:			components = 3; kind = FLOAT; break;
+	case GL_FLOAT_VEC4:			components = 4; kind = FLOAT; break;
+	case GL_FLOAT_MAT3:			components = 9; kind = MATRIX; break;
+	case GL_FLOAT_MAT4:			components = 16; kind = MATRIX; break;
+	case GL_INT_VEC2:
+	case GL_BOOL_VEC2:			components = 2; kind = INT; break;
+	case GL_INT_VEC3:
+	case GL_BOOL_VEC3:			components = 3; kind = INT; break;
+	case GL_INT_VEC4:
+	case GL_BOOL_VEC4:			components = 4; kind = INT; break;
+	case GL_UNSIGNED_INT:		components = 1; kind = UINT; break;
+	case GL_UNSIGNED_INT_VEC2:	components = 2; kind = UINT; break;
+	case GL_UNSIGNED_INT_VEC3:	components = 3; kind = UINT; break;
+	case GL_UNSIGNED_INT_VEC4:	components = 4; kind = UINT; break;
+	// Ints, bools and every sampler
+	default:					components = 1; kind = INT; break;
+	}
+}
+
+void ShaderProgram::load(const std::string& vertexFile, const std::string& fragmentFile, const std::string& defines) {
+	GLuint linked = loadProgram(vertexFile, fragmentFile, defines);
+	release();
+	program = linked;
+	reflect();
+}
+
+void ShaderProgram::release() {
+	if (current == this)
+		unbind();
+	if (program)
+		glDeleteProgram(program);
+	program = 0;
+	uniforms.clear();
+	uniformIndices.clear();
+	blocks.clear();
+	uniformCalls = skippedCalls = 0;
+}
+
+void ShaderProgram::reflect() {
+	GLint count = 0, maxLength = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::vector<GLchar> name(std::max(maxLength, 1));
+	for (GLint i = 0; i < count; i++) {
+		Uniform u;
+		glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), nullptr, &u.size, &u.type, name.data());
+		// Members of uniform blocks have no location
+		u.location = glGetUniformLocation(program, name.data());
+		if (u.location < 0)
+			continue;
+		u.name = name.data();
+		if (u.name.size() > 3 && u.name.compare(u.name.size() - 3, 3, "[0]") == 0)
+			u.name.resize(u.name.size() - 3);
+		describe(u.type, u.components, u.kind);
+
+		// Values the program was linked with, arrays start out as zeros
+		u.value.assign((size_t)u.components * u.size, 0);
+		if (u.size == 1 && (u.kind == FLOAT || u.kind == MATRIX))
+			glGetUniformfv(program, u.location, (GLfloat*)u.value.data());
+		else if (u.size == 1 && u.kind == UINT)
+			glGetUniformuiv(program, u.location, (GLuint*)u.value.data());
+		else if (u.size == 1)
+			glGetUniformiv(program, u.location, (GLint*)u.value.data());
+
+		uniformIndices[u.name] = (int)uniforms.size();
+		uniforms.push_back(std::move(u));
+	}
+
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+	name.resize(std::max(maxLength, 1));
+	for (GLint i = 0; i < count; i++) {
+		Block block;
+		block.index = (GLuint)i;
+		glGetActiveUniformBlockName(program, block.index, (GLsizei)name.size(), nullptr, name.data());
+		glGetActiveUniformBlockiv(program, block.index, GL_UNIFORM_BLOCK_BINDING, &block.binding);
+		blocks[name.data()] = block;
+	}
+}
+
+void ShaderProgram::use() {
+	if (current != this) {
+		glUseProgram(program);
+		current = this;
+	}
+	for (Uniform& u : uniforms)
+		if (u.dirty)
+			upload(u);
+}
+
+void ShaderProgram::unbind() {
+	glUseProgram(0);
+	current = nullptr;
+}
+
+int ShaderProgram::uniform(const std::string& name) const {
+	auto found = uniformIndices.find(name);
+	return found == uniformIndices.end() ? -1 : found->second;
+}
+
+int ShaderProgram::bindBlock(const std::string& name, GLuint bindingPoint) {
+	auto found = blocks.find(name);
+	if (found == blocks.end())
+		return -1;
+	Block& block = found->second;
+	if (block.binding != (GLint)bindingPoint) {
+		glUniformBlockBinding(program, block.index, bindingPoint);
+		block.binding = (GLint)bindingPoint;
+	}
+	return (int)block.index;
+}
+
+void ShaderProgram::setValues(int index, Kind kind, int components, GLsizei count, const void* values) {
+	if (index < 0 || index >= (int)uniforms.size())
+		return;
+	Uniform& u = uniforms[index];
+	bool matches = components == u.components &&
+		(kind == u.kind || (kind == FLOAT && u.kind == MATRIX) || (kind == INT && u.kind == UINT));
+	if (!matches)
+		throw std::runtime_error("Wrong type of values for uniform " + u.name);
+	// Like glUniform*v, elements past the end of an array are ignored
+	count = std::min(count, u.size);
+
+	size_t bytes = (size_t)components * count * sizeof(uint32_t);
+	if (std::memcmp(u.value.data(), values, bytes) == 0) {
+		skippedCalls++;
+		return;
+	}
+	std::memcpy(u.value.data(), values, bytes);
+	u.dirty = std::max(u.dirty, count);
+	if (current == this)
+		upload(u);
+}
+
+void ShaderProgram::upload(Uniform& u) {
+	const GLfloat* f = (const GLfloat*)u.value.data();
+	const GLint* i = (const GLint*)u.value.data();
+	const GLuint* ui = (const GLuint*)u.value.data();
+	GLsizei n = u.dirty;
+	switch (u.kind) {
+	case FLOAT:
+		if (u.components == 1) glUniform1fv(u.location, n, f);
+		else if (u.components == 2) glUniform2fv(u.location, n, f);
+		else if (u.components == 3) glUniform3fv(u.location, n, f);
+		else glUniform4fv(u.location, n, f);
+		break;
+	case INT:
+		if (u.components == 1) glUniform1iv(u.location, n, i);
+		else if (u.components == 2) glUniform2iv(u.location, n, i);
+		else if (u.components == 3) glUniform3iv(u.location, n, i);
+		else glUniform4iv(u.location, n, i);
+		break;
+	case UINT:
+		if (u.components == 1) glUniform1uiv(u.location, n, ui);
+		else if (u.components == 2) glUniform2uiv(u.location, n, ui);
+		else if (u.components == 3) glUniform3uiv(u.location, n, ui);
+		else glUniform4uiv(u.location, n, ui);
+		break;
+	case MATRIX:
+		if (u.components == 9) glUniformMatrix3fv(u.location, n, GL_FALSE, f);
+		else glUniformMatrix4fv(u.location, n, GL_FALSE, f);
+		break;
+	}
+	u.dirty = 0;
+	uniformCalls++;
+}
+
+float ShaderProgram::getFloat(int index) const {
+	if (index < 0 || index >= (int)uniforms.size())
+		return 0.0f;
+	float value;
+	std::memcpy(&value, uniforms[index].value.data(), sizeof(value));
+	return value;
+}
+
+int ShaderProgram::getInt(int index) const {
+	if (index < 0 || index >= (int)uniforms.size())
+		return 0;
+	return (int)uniforms[index].value[0];
+}
+
+glm::vec3 ShaderProgram::getVec3(int index) const {
+	glm::vec3 value(0.0f);
+	if (index >= 0 && index < (int)uniforms.size() && uniforms[index].value.size() >= 3)
+		std::memcpy(&value[0], uniforms[index].value.data(), sizeof(value));
+	return value;
+}
@@ -0,0 +1,107 @@
+#ifndef SHADERPROGRAM_HPP
+#define SHADERPROGRAM_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+
+// A linked GPU program with its uniforms mirrored on the CPU
+//
+// Every active uniform and uniform block is looked up once after
+// linking. Uniforms are then addressed by index, or by name where it
+// does not matter, and their values are kept here: setting a uniform
+// to the value it already has issues no GL call, setting it while the
+// program is not in use only records it until the next use(), and
+// reading it back never asks the driver. Uniforms the compiler dropped
+// have index -1 and ignore everything, like location -1 does.
+//
+// The program in use is tracked here, so programs bound with
+// glUseProgram directly must be followed by unbind() before a
+// ShaderProgram is trusted to be current again.
+class ShaderProgram {
+public:
+	ShaderProgram() {}
+	~ShaderProgram() { release(); }
+	// Disallow copy, move, & assignment
+	ShaderProgram(const ShaderProgram& other) = delete;
+	ShaderProgram& operator=(const ShaderProgram& other) = delete;
+	ShaderProgram(ShaderProgram&& other) = delete;
+	ShaderProgram& operator=(ShaderProgram&& other) = delete;
+
+	// Compile, link and reflect, throws std::runtime_error with the
+	// compile or link log. defines are inserted after #version of both
+	// stages, e.g. to build one variant of a shader. Programs linked by
+	// an earlier run are loaded from the program cache instead
+	void load(const std::string& vertexFile, const std::string& fragmentFile, const std::string& defines = "");
+	GLuint getId() const { return program; }
+
+	// Bind the program and upload the uniforms set since it was last in use
+	void use();
+	static void unbind();
+	bool isCurrent() const { return current == this; }
+
+	// Index of a uniform, arrays by their name without [0], or -1
+	int uniform(const std::string& name) const;
+	// Point a uniform block at a binding point, -1 if there is no block
+	int bindBlock(const std::string& name, GLuint bindingPoint);
+
+	// Values are checked against the type of the uniform, samplers and
+	// bools take ints. Arrays take count elements from the first, those
+	// past the end of the array are ignored
+	void set(int index, float value) { setValues(index, FLOAT, 1, 1, &value); }
+	void set(int index, int value) { setValues(index, INT, 1, 1, &value); }
+	void set(int index, const glm::vec2& value) { setValues(index, FLOAT, 2, 1, &value[0]); }
+	void set(int index, const glm::vec3& value) { setValues(index, FLOAT, 3, 1, &value[0]); }
+	void set(int index, const glm::vec4& value) { setValues(index, FLOAT, 4, 1, &value[0]); }
+	void set(int index, const glm::ivec2& value) { setValues(index, INT, 2, 1, &value[0]); }
+	void set(int index, const glm::mat4& value) { setValues(index, FLOAT, 16, 1, &value[0][0]); }
+	void set(int index, const int* values, GLsizei count) { setValues(index, INT, 1, count, values); }
+	template<typename T>
+	void set(const std::string& name, const T& value) { set(uniform(name), value); }
+
+	// Last value set, or the one the program was linked with
+	float getFloat(int index) const;
+	int getInt(int index) const;
+	glm::vec3 getVec3(int index) const;
+
+	// GL calls issued and skipped by set() since the program was loaded
+	size_t getUniformCalls() const { return uniformCalls; }
+	size_t getSkippedCalls() const { return skippedCalls; }
+
+protected:
+	enum Kind { FLOAT, INT, UINT, MATRIX };
+
+	struct Uniform {
+		std::string name;
+		GLint location;
+		GLenum type;
+		Kind kind;
+		int components;		// Per element, 16 for a mat4
+		GLsizei size;		// Elements, more than 1 for arrays
+		std::vector<uint32_t> value;	// Raw 32-bit components
+		GLsizei dirty = 0;	// Leading elements not uploaded yet
+	};
+	std::vector<Uniform> uniforms;
+	std::unordered_map<std::string, int> uniformIndices;
+
+	struct Block {
+		GLuint index;
+		GLint binding;
+	};
+	std::unordered_map<std::string, Block> blocks;
+
+	GLuint program = 0;
+	size_t uniformCalls = 0;
+	size_t skippedCalls = 0;
+	static inline const ShaderProgram* current = nullptr;
+
+	void release();
+	void reflect();
+	static void describe(GLenum type, int& components, Kind& kind);
+	void setValues(int index, Kind kind, int components, GLsizei count, const void* values);
+	void upload(Uniform& u);
+};
+
+#endif
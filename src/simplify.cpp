@@ -0,0 +1,218 @@
+#include "simplify.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <queue>
+
+namespace Simplify {
+
+// Symmetric 4x4 matrix summing the squared distances to planes
+struct Quadric {
+	double a2 = 0, ab = 0, ac = 0, ad = 0;
+	double b2 = 0, bc = 0, bd = 0;
+	double c2 = 0, cd = 0;
+	double d2 = 0;
+
+	// Plane n.p + d = 0 with unit n
+	void addPlane(glm::dvec3 n, double d, double weight) {
+		a2 += weight * n.x * n.x; ab += weight * n.x * n.y; ac += weight * n.x * n.z; ad += weight * n.x * d;
+		b2 += weight * n.y * n.y; bc += weight * n.y * n.z; bd += weight * n.y * d;
+		c2 += weight * n.z * n.z; cd += weight * n.z * d;
+		d2 += weight * d * d;
+	}
+	Quadric& operator+=(const Quadric& q) {
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+		return *this;
+	}
+	double error(glm::dvec3 p) const {
+		return a2 * p.x * p.x + 2 * ab * p.x * p.y + 2 * ac * p.x * p.z + 2 * ad * p.x +
+			b2 * p.y * p.y + 2 * bc * p.y * p.z + 2 * bd * p.y +
+			c2 * p.z * p.z + 2 * cd * p.z + d2;
+	}
+};
+
+// Moving from onto to, stamps tell stale entries apart
+struct Collapse {
+	double cost;
+	uint32_t from, to;
+	uint32_t fromStamp, toStamp;
+	bool operator<(const Collapse& other) const { return cost > other.cost; }
+};
+
+// Border planes weigh this much more than the surface
+static const double BORDER_WEIGHT = 10.0;
+// Collapses turning a triangle further than this (cosine) are refused
+static const double FLIP_COSINE = 0.2;
+
+std::vector<unsigned int> decimate(const std::vector<glm::vec3>& positions,
+		const std::vector<unsigned int>& elements, const std::vector<bool>& locked, size_t target) {
+	size_t vertex_count = positions.size();
+	size_t triangle_count = elements.size() / 3;
+	std::vector<unsigned int> triangles = elements;
+	if (triangle_count <= target)
+		return triangles;
+
+	auto position = [&](uint32_t v) { return glm::dvec3(positions[v]); };
+	auto normalOf = [&](uint32_t a, uint32_t b, uint32_t c) {
+		return glm::cross(position(b) - position(a), position(c) - position(a));
+	};
+
+	// Triangles around every vertex, dead ones are skipped when read
+	std::vector<std::vector<uint32_t>> adjacent(vertex_count);
+	for (size_t t = 0; t < triangle_count; t++)
+		for (int k = 0; k < 3; k++)
+			adjacent[triangles[3 * t + k]].push_back((uint32_t)t);
+
+	// Face planes weighted by area
+	std::vector<Quadric> quadrics(vertex_count);
+	for (size_t t = 0; t < triangle_count; t++) {
+		const unsigned int* tri = &triangles[3 * t];
+		glm::dvec3 n = normalOf(tri[0], tri[1], tri[2]);
+		double area = glm::length(n);
+		if (area > 0) {
+			n /= area;
+			for (int k = 0; k < 3; k++)
+				quadrics[tri[k]].addPlane(n, -glm::dot(n, position(tri[0])), area * 0.5);
+		}
+	}
+
+	// Edges sorted by their ends, one entry per triangle side. Sides
+	// found once are on the border and get planes standing on them
+	struct Side {
+		uint64_t key;
+		uint32_t a, b;
+		uint32_t triangle;
+		bool operator<(const Side& other) const { return key < other.key; }
+	};
+	std::vector<Side> sides(3 * triangle_count);
+	for (size_t t = 0; t < triangle_count; t++) {
+		for (int k = 0; k < 3; k++) {
+			uint32_t a = triangles[3 * t + k], b = triangles[3 * t + (k + 1) % 3];
+			uint64_t key = a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+			sides[3 * t + k] = {key, a, b, (uint32_t)t};
+		}
+	}
+	std::sort(sides.begin(), sides.end());
+	std::vector<uint64_t> edges;
+	for (size_t i = 0; i < sides.size(); ) {
+		size_t j = i + 1;
+		while (j < sides.size() && sides[j].key == sides[i].key)
+			j++;
+		edges.push_back(sides[i].key);
+		if (j - i == 1) {
+			const Side& side = sides[i];
+			const unsigned int* tri = &triangles[3 * side.triangle];
+			glm::dvec3 edge = position(side.b) - position(side.a);
+			glm::dvec3 n = glm::cross(edge, normalOf(tri[0], tri[1], tri[2]));
+			double length = glm::length(n);
+			if (length > 0) {
+				n /= length;
+				double weight = BORDER_WEIGHT * glm::dot(edge, edge);
+				quadrics[side.a].addPlane(n, -glm::dot(n, position(side.a)), weight);
+				quadrics[side.b].addPlane(n, -glm::dot(n, position(side.a)), weight);
+			}
+		}
+		i = j;
+	}
+	sides.clear();
+	sides.shrink_to_fit();
+
+	std::vector<uint32_t> stamp(vertex_count, 0);
+	std::vector<bool> removed(vertex_count, false);
+	std::vector<bool> dead(triangle_count, false);
+	std::priority_queue<Collapse> queue;
+
+	// Push the cheaper direction of an edge
+	auto pushEdge = [&](uint32_t a, uint32_t b) {
+		Quadric q = quadrics[a];
+		q += quadrics[b];
+		double inf = std::numeric_limits<double>::infinity();
+		double to_b = locked[a] ? inf : q.error(position(b));
+		double to_a = locked[b] ? inf : q.error(position(a));
+		if (to_b == inf && to_a == inf)
+			return;
+		if (to_b <= to_a)
+			queue.push({to_b, a, b, stamp[a], stamp[b]});
+		else
+			queue.push({to_a, b, a, stamp[b], stamp[a]});
+	};
+	for (uint64_t edge : edges)
+		pushEdge((uint32_t)(edge >> 32), (uint32_t)edge);
+	edges.clear();
+
+	size_t live = triangle_count;
+	std::vector<uint32_t> neighbours;
+	while (live > target && !queue.empty()) {
+		Collapse c = queue.top();
+		queue.pop();
+		uint32_t u = c.from, v = c.to;
+		if (removed[u] || removed[v] || stamp[u] != c.fromStamp || stamp[v] != c.toStamp)
+			continue;
+
+		// Refuse collapses folding a triangle over
+		bool flips = false;
+		for (uint32_t t : adjacent[u]) {
+			if (dead[t])
+				continue;
+			unsigned int* tri = &triangles[3 * t];
+			if (tri[0] == v || tri[1] == v || tri[2] == v)
+				continue;
+			glm::dvec3 before = normalOf(tri[0], tri[1], tri[2]);
+			glm::dvec3 after = normalOf(tri[0] == u ? v : tri[0], tri[1] == u ? v : tri[1], tri[2] == u ? v : tri[2]);
+			double lengths = glm::length(before) * glm::length(after);
+			if (lengths == 0 || glm::dot(before, after) < FLIP_COSINE * lengths) {
+				flips = true;
+				break;
+			}
+		}
+		if (flips)
+			continue;
+
+		// Triangles on the edge vanish, the others move over to v
+		for (uint32_t t : adjacent[u]) {
+			if (dead[t])
+				continue;
+			unsigned int* tri = &triangles[3 * t];
+			if (tri[0] == v || tri[1] == v || tri[2] == v) {
+				dead[t] = true;
+				live--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+				if (tri[k] == u)
+					tri[k] = v;
+			adjacent[v].push_back(t);
+		}
+		adjacent[u].clear();
+		adjacent[u].shrink_to_fit();
+		removed[u] = true;
+		quadrics[v] += quadrics[u];
+		stamp[u]++;
+		stamp[v]++;
+
+		// Edges around v have new costs
+		auto& around = adjacent[v];
+		around.erase(std::remove_if(around.begin(), around.end(), [&](uint32_t t) { return dead[t]; }), around.end());
+		neighbours.clear();
+		for (uint32_t t : around)
+			for (int k = 0; k < 3; k++)
+				if (triangles[3 * t + k] != v)
+					neighbours.push_back(triangles[3 * t + k]);
+		std::sort(neighbours.begin(), neighbours.end());
+		neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+		for (uint32_t n : neighbours)
+			pushEdge(v, n);
+	}
+
+	std::vector<unsigned int> result;
+	result.reserve(live * 3);
+	for (size_t t = 0; t < triangle_count; t++)
+		if (!dead[t])
+			result.insert(result.end(), &triangles[3 * t], &triangles[3 * t + 3]);
+	return result;
+}
+
+}
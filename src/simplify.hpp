@@ -0,0 +1,22 @@
+#ifndef SIMPLIFY_HPP
+#define SIMPLIFY_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Quadric error mesh simplification
+//
+// Edges are collapsed cheapest first, the cost being the squared
+// distance to the planes of the triangles around both ends (Garland and
+// Heckbert). A collapse moves one end onto the other, so the result
+// indexes a subset of the same vertices and can share their buffer.
+// Open borders are held by planes standing on the border edges.
+namespace Simplify {
+	// Triangles of elements reduced to about target triangles, fewer
+	// only when the mesh runs out of collapses. Locked vertices never
+	// move, e.g. those sharing their position with another vertex
+	std::vector<unsigned int> decimate(const std::vector<glm::vec3>& positions,
+		const std::vector<unsigned int>& elements, const std::vector<bool>& locked, size_t target);
+}
+
+#endif
@@ -1,9 +1,22 @@
 #include "terrain.hpp"
+#include "project.hpp"
+#include "mappedfile.hpp"
 #include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <glm/gtx/string_cast.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <tuple>
 
 Terrain::Terrain() {
 
@@ -25,10 +38,27 @@ void Terrain::initGL() {
 	// Set the binding point index of the buffer
 	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
+    // Vertices come from gl_VertexID, but core profiles still want a
+    // vertex array bound to draw
+    if (!vao)
+        glGenVertexArrays(1, &vao);
+}
+
+void Terrain::setShader(ShaderProgram* s) {
+    if (s == shader)
+        return;
+    shader = s;
+
     // Bind config block to the UBO
-    glUseProgram(shader);
-    GLuint uniformConfigBlocIndx = glGetUniformBlockIndex(shader, "PhongConfigBlock");
-    glUniformBlockBinding(shader, uniformConfigBlocIndx, BIND_PT);
+    shader->bindBlock("PhongConfigBlock", BIND_PT);
+
+    // Texture units never change, set once per program and uploaded
+    // with its next use
+    shader->set("heightMap", 0);
+    shader->set("normalMap", 1);
+    shader->set("materialMap", 2);
+    gridSizeLoc = shader->uniform("gridSize");
+    drawnLayersLoc = shader->uniform("drawnLayers");
 }
 
 void Terrain::load(std::string& config_file_path) {
@@ -36,8 +66,101 @@ void Terrain::load(std::string& config_file_path) {
     load(config);
 }
 
-void Terrain::load(std::ifstream& config_file) {
-    // TODO Performan parsing
+void Terrain::load(std::istream& config_file) {
+    PROFILE_SCOPE("Terrain::load");
+    // Same format as App::loadConfigFile() and App::saveConfigFile()
+    if (!config_file)
+        throw std::runtime_error("Cannot open terrain config");
+
+    clearAllLayers();
+
+    // Current surface
+    bool in_surface = false;
+    std::vector<std::string> funcs;
+    PhongConfig config;
+
+    std::string line;
+    int line_num = 0;
+    while (std::getline(config_file, line)) {
+        line_num++;
+
+        // Trim whitespace
+        size_t first = line.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+            continue;
+        line = line.substr(first, line.find_last_not_of(" \t\r\n") - first + 1);
+
+        if (line.compare(0, 2, "//") == 0) {
+            // Ignore comments
+            continue;
+        } else if (line[0] == '#') {
+            // Command line
+            if (line == "#surface_begin") {
+                in_surface = true;
+                funcs.clear();
+                config = PhongConfig();
+                config.enable = 1;
+                config.drawSurface = 1;
+                config.coverBottom = 0;
+            } else if (line == "#surface_end") {
+                // Make sure we don't pass empty funcs vector
+                if (in_surface && !funcs.empty())
+                    pushLayer(std::pair(funcs, config));
+                in_surface = false;
+            }
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            continue;
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+        // Comma separated numbers of a value
+        auto numbers = [&](size_t count) {
+            std::vector<double> result;
+            std::stringstream values(value);
+            std::string item;
+            while (std::getline(values, item, ','))
+                result.push_back(std::stod(item));
+            if (result.size() < count)
+                throw std::invalid_argument(key);
+            return result;
+        };
+
+        try {
+            if (key == "seed") {
+                seed = std::stoll(value);
+            } else if (key == "name") {
+                name = value;
+            } else if (key == "width") {
+                width = std::stoul(value);
+            } else if (key == "length") {
+                length = std::stoul(value);
+            } else if (!in_surface) {
+                continue;
+            } else if (key == "phong") {
+                std::vector<double> phong = numbers(4);
+                config.ambient  = phong[0];
+                config.diffuse  = phong[1];
+                config.specular = phong[2];
+                config.exponent = phong[3];
+            } else if (key == "rgb") {
+                std::vector<double> rgb = numbers(3);
+                config.color = glm::vec3(rgb[0], rgb[1], rgb[2]);
+            } else if (key == "enable_surface") {
+                config.enable = std::stoi(value) != 0;
+            } else if (key == "draw_surface") {
+                config.drawSurface = std::stoi(value) != 0;
+            } else if (key == "func") {
+                funcs.push_back(value);
+            }
+        } catch (std::logic_error&) {
+            throw std::runtime_error("Bad value for " + key + " on line " + std::to_string(line_num) + " of terrain config");
+        }
+    }
 }
 
 void Terrain::dump(std::string& out_name) {
@@ -45,13 +168,383 @@ void Terrain::dump(std::string& out_name) {
     dump(out);
 }
 
-void Terrain::dump(std::ofstream& out_file) {
-    // TODO Dump the configuration
+void Terrain::dump(std::ostream& out_file) {
+    // Same format as App::saveConfigFile()
+    out_file << "seed=" << seed << "\n";
+    out_file << "name=" << name << "\n";
+    out_file << "width=" << width << "\n";
+    out_file << "length=" << length << "\n";
+
+    for (auto& layer : layers_functions) {
+        const PhongConfig& config = layer.second;
+        out_file << "\n#surface_begin\n";
+        out_file << "// Phong Config: ambient,diffuse,specular, exponet\n";
+        out_file << "Phong=" << config.ambient << "," << config.diffuse << ","
+            << config.specular << "," << config.exponent << "\n";
+        out_file << "RGB=" << config.color.r << "," << config.color.g << "," << config.color.b << "\n";
+        out_file << "enable_surface=" << (config.enable ? 1 : 0) << "\n";
+        out_file << "draw_surface=" << (config.drawSurface ? 1 : 0) << "\n";
+        for (const std::string& func : layer.first)
+            out_file << "func=" << func << "\n";
+        out_file << "#surface_end\n\n";
+    }
+}
+
+void Terrain::saveProject(const std::string& filename, bool include_normals) {
+    PROFILE_SCOPE("Terrain::saveProject");
+    if (raw_layers.empty())
+        throw std::runtime_error("Nothing evaluated to save");
+
+    // Config text
+    std::ostringstream config;
+    dump(config);
+    std::string config_text = config.str();
+
+    // Height maps, either format is stored as it is held
+    size_t points = (size_t)width * length;
+    bool quantized = isQuantized();
+    std::vector<GLfloat> scale_bias;
+    for (auto& layer : quantized_layers) {
+        scale_bias.push_back(layer.scale);
+        scale_bias.push_back(layer.bias);
+    }
+
+    std::vector<std::vector<PackedNormal>> normals;
+    if (include_normals)
+        buildMesh(normals);
+
+    // Lay out the sections
+    std::vector<Project::Section> sections;
+    std::vector<const void*> contents;
+    auto addSection = [&](uint32_t type, uint32_t format, uint32_t layer, const void* data, uint64_t size) {
+        sections.push_back(Project::Section{type, format, layer, 0, 0, size});
+        contents.push_back(data);
+    };
+    addSection(Project::SECTION_CONFIG, Project::FORMAT_TEXT, 0, config_text.data(), config_text.size());
+    addSection(Project::SECTION_HEIGHTS, quantized ? Project::FORMAT_R16 : Project::FORMAT_R32F, 0, nullptr,
+        points * raw_layers.size() * (quantized ? sizeof(uint16_t) : sizeof(GLfloat)));
+    if (quantized)
+        addSection(Project::SECTION_QUANTIZATION, Project::FORMAT_FLOAT_PAIRS, 0, scale_bias.data(),
+            scale_bias.size() * sizeof(GLfloat));
+    if (include_normals)
+        addSection(Project::SECTION_NORMALS, Project::FORMAT_OCT16, 0, nullptr,
+            points * raw_layers.size() * sizeof(PackedNormal));
+
+    auto align = [](uint64_t offset) {
+        return (offset + Project::ALIGNMENT - 1) / Project::ALIGNMENT * Project::ALIGNMENT;
+    };
+    uint64_t offset = align(sizeof(Project::Header) + sections.size() * sizeof(Project::Section));
+    for (auto& section : sections) {
+        section.offset = offset;
+        offset = align(offset + section.size);
+    }
+
+    Project::Header header;
+    memcpy(header.magic, Project::MAGIC, sizeof(header.magic));
+    header.version = Project::VERSION;
+    header.sectionCount = sections.size();
+    header.fileSize = offset;
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Cannot write project " + filename);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)sections.data(), sections.size() * sizeof(Project::Section));
+
+    std::vector<char> padding(Project::ALIGNMENT, 0);
+    auto padTo = [&](uint64_t position) {
+        uint64_t at = out.tellp();
+        out.write(padding.data(), position - at);
+    };
+    for (size_t i = 0; i < sections.size(); i++) {
+        padTo(sections[i].offset);
+        if (sections[i].type == Project::SECTION_HEIGHTS) {
+            // Layer after layer, as the texture array takes them
+            for (size_t layer_idx = 0; layer_idx < raw_layers.size(); layer_idx++) {
+                if (quantized)
+                    out.write((const char*)quantized_layers[layer_idx].values.data(), points * sizeof(uint16_t));
+                else
+                    out.write((const char*)raw_layers[layer_idx].first.data(), points * sizeof(GLfloat));
+            }
+        } else if (sections[i].type == Project::SECTION_NORMALS) {
+            // Layers not drawn have no normals and are written as zeros
+            std::vector<PackedNormal> none;
+            for (size_t layer_idx = 0; layer_idx < raw_layers.size(); layer_idx++) {
+                if (normals[layer_idx].empty())
+                    none.resize(points, PackedNormal{{0, 0}});
+                const auto& layer = normals[layer_idx].empty() ? none : normals[layer_idx];
+                out.write((const char*)layer.data(), points * sizeof(PackedNormal));
+            }
+        } else {
+            out.write((const char*)contents[i], sections[i].size);
+        }
+    }
+    padTo(header.fileSize);
+
+    if (!out)
+        throw std::runtime_error("Cannot write project " + filename);
+    printf("Saved project %s, %.1f MB\n", filename.c_str(), header.fileSize / 1048576.0);
+}
+
+void Terrain::openProject(const std::string& filename) {
+    PROFILE_SCOPE("Terrain::openProject");
+    auto start = std::chrono::steady_clock::now();
+
+    MappedFile file;
+    if (!file.open(filename))
+        throw std::runtime_error("Cannot open project " + filename);
+
+    // Validate the header and every section before touching anything
+    Project::Header header;
+    if (file.size() < sizeof(header))
+        throw std::runtime_error("Not a terrain project: " + filename);
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, Project::MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error("Not a terrain project: " + filename);
+    if (header.version != Project::VERSION)
+        throw std::runtime_error("Unsupported project version " + std::to_string(header.version) + ": " + filename);
+    if (header.fileSize != file.size() ||
+            sizeof(header) + (uint64_t)header.sectionCount * sizeof(Project::Section) > file.size())
+        throw std::runtime_error("Truncated project: " + filename);
+
+    std::vector<Project::Section> sections(header.sectionCount);
+    memcpy(sections.data(), file.data() + sizeof(header), sections.size() * sizeof(Project::Section));
+    const Project::Section* config_section = nullptr;
+    const Project::Section* heights_section = nullptr;
+    const Project::Section* quantization_section = nullptr;
+    const Project::Section* normals_section = nullptr;
+    for (auto& section : sections) {
+        if (section.offset % Project::ALIGNMENT != 0 || section.offset > file.size() ||
+                section.size > file.size() - section.offset)
+            throw std::runtime_error("Corrupt project section table: " + filename);
+        if (section.type == Project::SECTION_CONFIG)
+            config_section = &section;
+        else if (section.type == Project::SECTION_HEIGHTS)
+            heights_section = &section;
+        else if (section.type == Project::SECTION_QUANTIZATION)
+            quantization_section = &section;
+        else if (section.type == Project::SECTION_NORMALS)
+            normals_section = &section;
+    }
+    if (!config_section || !heights_section)
+        throw std::runtime_error("Project without config or heights: " + filename);
+
+    // Config, the only part that is parsed, into a terrain of its own
+    // until the heights are known to match it
+    std::istringstream config(std::string(file.data() + config_section->offset, config_section->size));
+    Terrain parsed;
+    parsed.seed = seed;
+    parsed.name = name;
+    parsed.setSize(width, length);
+    parsed.load(config);
+
+    bool quantized = heights_section->format == Project::FORMAT_R16;
+    size_t points = (size_t)parsed.width * parsed.length;
+    size_t layer_bytes = points * (quantized ? sizeof(uint16_t) : sizeof(GLfloat));
+    size_t layer_count = parsed.layers_functions.size();
+    if ((!quantized && heights_section->format != Project::FORMAT_R32F) ||
+            heights_section->size != layer_bytes * layer_count ||
+            (quantized && (!quantization_section ||
+                quantization_section->size != layer_count * 2 * sizeof(GLfloat))))
+        throw std::runtime_error("Project heights do not match its config: " + filename);
+
+    // Everything checks out, replace the current terrain
+    seed = parsed.seed;
+    name = parsed.name;
+    width = parsed.width;
+    length = parsed.length;
+    layers_functions = std::move(parsed.layers_functions);
+
+    // CPU copy of the heights, the GPU gets them from the mapping
+    const char* heights = file.data() + heights_section->offset;
+    raw_layers.clear();
+    quantized_layers.clear();
+    layer_keys.clear();
+    layer_cached.clear();
+    for (size_t layer_idx = 0; layer_idx < layers_functions.size(); layer_idx++) {
+        const char* layer = heights + layer_idx * layer_bytes;
+        if (quantized) {
+            raw_layers.push_back(std::pair(std::vector<GLfloat>(), layers_functions[layer_idx].second));
+            QuantizedLayer q;
+            const GLfloat* scale_bias = (const GLfloat*)(file.data() + quantization_section->offset);
+            q.scale = scale_bias[2 * layer_idx];
+            q.bias = scale_bias[2 * layer_idx + 1];
+            q.values.assign((const uint16_t*)layer, (const uint16_t*)layer + points);
+            quantized_layers.push_back(std::move(q));
+        } else {
+            raw_layers.push_back(std::pair(std::vector<GLfloat>((const GLfloat*)layer, (const GLfloat*)layer + points),
+                layers_functions[layer_idx].second));
+        }
+    }
+
+    // Normal maps straight from the mapping where the project has them,
+    // older projects with vertex buffers get them computed
+    const void* normal_data = nullptr;
+    if (normals_section && normals_section->format == Project::FORMAT_OCT16 &&
+            normals_section->size == points * raw_layers.size() * sizeof(PackedNormal))
+        normal_data = file.data() + normals_section->offset;
+
+    allocateGL(heights, normal_data);
+    if (!normal_data) {
+        std::vector<std::vector<PackedNormal>> normals;
+        buildMesh(normals);
+        uploadNormalRows(normals, 0, width);
+    }
+    std::vector<uint8_t> materials;
+    buildMaterials(materials);
+    uploadMaterialRows(materials, 0, width);
+    uploadPhongConfigs();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("Opened project %s in %.2f ms\n", filename.c_str(), elapsed.count());
 }
 
 void Terrain::evaluate() {
+    PROFILE_SCOPE("Terrain::evaluate");
     // Iterate through layer functions and generate terrain and other layers
-    
+    std::vector<std::vector<std::vector<TerrainFuncParser>>> worker_parsers;
+    prepareEvaluation(worker_parsers);
+
+    // Split the grid into tiles, a tile is finished for every layer
+    // before moving on so its coordinates and heights stay in cache
+    uint32_t tile = evalTileSize();
+    uint32_t tile_rows = (width + tile - 1) / tile;
+    uint32_t tile_cols = (length + tile - 1) / tile;
+    uint32_t tile_count = tile_rows * tile_cols;
+    bool all_cached = std::find(layer_cached.begin(), layer_cached.end(), false) == layer_cached.end();
+    if (tile_count == 0 || all_cached) {
+        if (quantize_heights)
+            quantizeLayers();
+        return;
+    }
+
+    // Tiles cost very different amounts depending on the functions of
+    // the config, so they are balanced by the work-stealing scheduler
+    runParallel(tile_count, 1, [&](unsigned worker, size_t begin, size_t end) {
+        for (size_t t = begin; t < end; t++) {
+            uint32_t row_begin = (t / tile_cols) * tile;
+            uint32_t col_begin = (t % tile_cols) * tile;
+            evaluateTile(worker_parsers[worker],
+                row_begin, std::min(row_begin + tile, width),
+                col_begin, std::min(col_begin + tile, length));
+        }
+    }, "Evaluate");
+
+    storeInCache();
+    if (quantize_heights)
+        quantizeLayers();
+}
+
+void Terrain::storeInCache() {
+    if (!cache)
+        return;
+    PROFILE_SCOPE("Cache store");
+    for (size_t layer_idx = 0; layer_idx < raw_layers.size(); layer_idx++)
+        if (!layer_cached[layer_idx] && !raw_layers[layer_idx].first.empty())
+            cache->store(layer_keys[layer_idx], width, length, raw_layers[layer_idx].first.data());
+}
+
+void Terrain::quantizeLayers() {
+    PROFILE_SCOPE("Quantize");
+    quantized_layers.assign(raw_layers.size(), QuantizedLayer());
+
+    runParallel(raw_layers.size(), 1, [&](unsigned, size_t begin, size_t end) {
+        for (size_t layer_idx = begin; layer_idx < end; layer_idx++) {
+            std::vector<GLfloat>& heights = raw_layers[layer_idx].first;
+            QuantizedLayer& layer = quantized_layers[layer_idx];
+            if (heights.empty())
+                continue;
+
+            // Scale and bias from the range of the layer
+            auto range = std::minmax_element(heights.begin(), heights.end());
+            layer.bias = *range.first;
+            layer.scale = *range.second - *range.first;
+            double to_unorm = layer.scale > 0 ? 65535.0 / layer.scale : 0.0;
+
+            layer.values.resize(heights.size());
+            for (size_t i = 0; i < heights.size(); i++) {
+                uint16_t value = (uint16_t)std::lround((heights[i] - layer.bias) * to_unorm);
+                layer.values[i] = value;
+                GLfloat restored = layer.bias + layer.scale * (value / 65535.0f);
+                layer.maxError = std::max(layer.maxError, std::fabs(restored - heights[i]));
+            }
+
+            // Free the floats
+            std::vector<GLfloat>().swap(heights);
+        }
+    }, "Quantize");
+
+    for (size_t layer_idx = 0; layer_idx < quantized_layers.size(); layer_idx++)
+        printf("Layer %zu quantized to 16 bits, range %g, max error %g\n", layer_idx,
+            quantized_layers[layer_idx].scale, quantized_layers[layer_idx].maxError);
+}
+
+void Terrain::dequantizeRows(int layer_idx, size_t row_begin, size_t row_end, GLfloat* out) {
+    const QuantizedLayer& layer = quantized_layers[layer_idx];
+    const uint16_t* values = layer.values.data() + row_begin * length;
+    size_t count = (row_end - row_begin) * length;
+    for (size_t i = 0; i < count; i++)
+        out[i] = layer.bias + layer.scale * (values[i] / 65535.0f);
+}
+
+std::vector<GLfloat> Terrain::getLayerHeights(int indx) {
+    if (!isQuantized())
+        return raw_layers.at(indx).first;
+
+    std::vector<GLfloat> heights((size_t)width * length);
+    dequantizeRows(indx, 0, width, heights.data());
+    return heights;
+}
+
+void Terrain::readHeightRow(int indx, uint32_t row, GLfloat* out) {
+    if (indx < 0) {
+        // Composite of the drawn surfaces, the terrain alone if none is
+        std::vector<int> drawn = drawnLayers();
+        if (drawn.empty())
+            drawn.push_back(0);
+        readHeightRow(drawn[0], row, out);
+        std::vector<GLfloat> heights(length);
+        for (size_t i = 1; i < drawn.size(); i++) {
+            readHeightRow(drawn[i], row, heights.data());
+            for (uint32_t col = 0; col < length; col++)
+                out[col] = std::max(out[col], heights[col]);
+        }
+        return;
+    }
+
+    // The size may have changed since the layers were evaluated
+    size_t points = (size_t)width * length;
+    size_t stored = isQuantized() ? quantized_layers.at(indx).values.size() : raw_layers.at(indx).first.size();
+    if (row >= width || stored != points)
+        throw std::out_of_range("Height row " + std::to_string(row) + " of layer " + std::to_string(indx) +
+            " not evaluated");
+
+    if (isQuantized())
+        dequantizeRows(indx, row, row + 1, out);
+    else
+        std::copy_n(raw_layers[indx].first.data() + (size_t)row * length, length, out);
+}
+
+void Terrain::readMaterialRow(uint32_t row, uint8_t* out) {
+    std::vector<GLfloat> ground(length);
+    std::vector<GLfloat> heights(length);
+    readHeightRow(0, row, ground.data());
+
+    // The highest numbered layer above the ground wins, the terrain
+    // itself is never one of them
+    std::fill(out, out + length, 0);
+    for (int layer_idx = (int)raw_layers.size() - 1; layer_idx > 0; layer_idx--) {
+        if (raw_layers[layer_idx].second.enable == 0)
+            continue;
+        readHeightRow(layer_idx, row, heights.data());
+        for (uint32_t col = 0; col < length; col++)
+            if (out[col] == 0 && ground[col] < heights[col])
+                out[col] = (uint8_t)layer_idx;
+    }
+}
+
+void Terrain::prepareEvaluation(std::vector<std::vector<std::vector<TerrainFuncParser>>>& worker_parsers) {
+    PROFILE_SCOPE("Parse functions");
     // Reconfigure function parser
     terrainParser.setSeed(seed);
     terrainParser.setSize(width, length);
@@ -59,213 +552,540 @@ void Terrain::evaluate() {
     
     // Discard all previous calculation
     raw_layers.clear();
-    
+    quantized_layers.clear();
+    layer_event_names.clear();
+    func_event_names.clear();
+    layer_keys.clear();
+    layer_cached.clear();
+    Profiler& profiler = Profiler::instance();
+
+    // Parse every function once up front, each one keeps its own
+    // parser so a tile can run through all of them back to back
+    std::vector<std::vector<TerrainFuncParser>> parsers;
     for (auto it = layers_functions.begin(); it < layers_functions.end(); it++) {
+        // Initialize 2D matrix holding terrain height
+        raw_layers.push_back(std::pair(std::vector<GLfloat>((size_t)width * length, 0.0f), it->second));
+        layer_event_names.push_back(profiler.intern("Layer " + std::to_string(layer_event_names.size())));
+        func_event_names.emplace_back();
+
+        // Layers found in the cache keep an empty parser list, which
+        // makes evaluateTile() leave them alone
+        uint64_t key = cache ? HeightCache::fingerprint(seed, width, length, it->first) : 0;
+        layer_keys.push_back(key);
+        if (cache) {
+            PROFILE_SCOPE("Cache lookup");
+            if (cache->load(key, width, length, raw_layers.back().first.data())) {
+                printf("Layer %zu loaded from cache\n", raw_layers.size() - 1);
+                layer_cached.push_back(true);
+                parsers.emplace_back();
+                continue;
+            }
+        }
+        layer_cached.push_back(false);
+
         printf("Evaluating a new layer\n");
-        std::pair<std::vector<std::string>, PhongConfig> layer_functions = *it;
-        PhongConfig color = layer_functions.second;
-        std::vector<std::string> functions = layer_functions.first;
+        std::vector<TerrainFuncParser> layer_parsers(it->first.size());
+        for (size_t func_idx = 0; func_idx < it->first.size(); func_idx++) {
+            const std::string& func_string = it->first[func_idx];
+            printf("Evaluating func: %s\n", func_string.c_str());
+            layer_parsers[func_idx].Parse(func_string, "x,y,N");
+            // terrainParser.Optimize();
+        }
+        parsers.push_back(layer_parsers);
 
-        // Initialize 2D matrix holding terrain height
-        float** matrix = new float*[width];
-        for (int i = 0; i < width; i++)
-            matrix[i] = new float[length];
+        // Profiler events of each function
+        for (const std::string& func_string : it->first)
+            func_event_names.back().push_back(profiler.intern(func_string));
+    }
 
-        for (int i = 0; i < width; i++)
-            for (int j = 0; j < length; j++)
-                matrix[i][j] = 0;
+    // Parsers keep their evaluation stack inside, so every worker
+    // needs a private deep copy
+    worker_parsers.assign(scheduler().getWorkerCount(), parsers);
+    for (auto& copy : worker_parsers)
+        for (auto& layer_parsers : copy)
+            for (auto& parser : layer_parsers)
+                parser.ForceDeepCopy();
+}
+
+uint32_t Terrain::evalTileSize() {
+    return tile_size > 0 ? tile_size : std::max(width, length);
+}
+
+void Terrain::setThreadCount(unsigned n) {
+    thread_count = n;
+    if (n > 1 && (!own_scheduler || own_scheduler->getWorkerCount() != n))
+        own_scheduler = std::make_unique<TaskScheduler>(n);
+    else if (n <= 1)
+        own_scheduler.reset();
+}
+
+TaskScheduler& Terrain::scheduler() {
+    return own_scheduler ? *own_scheduler : TaskScheduler::instance();
+}
+
+void Terrain::runParallel(size_t count, size_t grain, const TaskScheduler::RangeBody& body, const char* stage) {
+    // A single thread runs everything in place
+    if (thread_count == 1) {
+        body(0, 0, count);
+        return;
+    }
+
+    TaskScheduler& workers = scheduler();
+    workers.resetStats();
+    workers.parallelFor(0, count, grain, body);
+
+    if (!stage)
+        return;
+    TaskScheduler::Stats stats = workers.getStats();
+    printf("%s: %.2f ms on %zu workers, utilization %.0f%%, %llu steals\n",
+        stage, stats.wallNs / 1e6, stats.workers.size(),
+        stats.utilization() * 100, (unsigned long long)stats.totalSteals());
+}
+
+void Terrain::evaluateTile(std::vector<std::vector<TerrainFuncParser>>& parsers,
+        uint32_t row_begin, uint32_t row_end, uint32_t col_begin, uint32_t col_end) {
+    // Get xy coordinate by mapping x and y to [-1, 1], shared by all
+    // layers and functions of the tile
+    std::vector<double> xs(row_end - row_begin);
+    std::vector<double> ys(col_end - col_begin);
+    for (uint32_t row = row_begin; row < row_end; row++)
+        xs[row - row_begin] = 2 * ((double) row / (double) width) - 1;
+    for (uint32_t col = col_begin; col < col_end; col++)
+        ys[col - col_begin] = 2 * ((double) col / (double) length) - 1;
+
+    for (size_t layer_idx = 0; layer_idx < parsers.size(); layer_idx++) {
+        PROFILE_SCOPE(layer_event_names[layer_idx]);
+        GLfloat* matrix = raw_layers[layer_idx].first.data();
 
         // Fill in values for matrix
         double vars[3];
         vars[2] = 0;
-        for (auto func_it = functions.begin(); func_it < functions.end(); func_it++) {
+        for (size_t func_idx = 0; func_idx < parsers[layer_idx].size(); func_idx++) {
+            PROFILE_SCOPE(func_event_names[layer_idx][func_idx]);
+            TerrainFuncParser& parser = parsers[layer_idx][func_idx];
             // Evaluaten function and add to terrain height map
-            std::string func_string = *func_it;
-            printf("Evaluating func: %s\n", func_string.c_str());
-            terrainParser.Parse(func_string, "x,y,N");
-            // terrainParser.Optimize();
-            for (int row = 0; row < width; row++) {
-                for (int col = 0; col < length; col++) {
-                    // Get xy coordinate by mapping x and y to [-1, 1]
-                    double x = 2 * ((double) row / (double) width) - 1;
-                    double y = 2 * ((double) col / (double) length) - 1;
-                    
-                    // Put variables for functions here
-                    vars[0] = x;
-                    vars[1] = y;
+            for (uint32_t row = row_begin; row < row_end; row++) {
+                GLfloat* matrix_row = matrix + (size_t)row * length;
+                // Put variables for functions here
+                vars[0] = xs[row - row_begin];
+                for (uint32_t col = col_begin; col < col_end; col++) {
+                    vars[1] = ys[col - col_begin];
 
                     // Evaluate functions
-                    double res = terrainParser.Eval(vars);
-                    matrix[row][col] += res;
+                    double res = parser.Eval(vars);
+                    matrix_row[col] += res;
                 }
             }
             // Increase count of layer, N
             vars[2]++;
         }
-
-        // Finish generating one layer, push to vector
-        raw_layers.push_back(std::pair(matrix, color));
     }
 }
 
 void Terrain::generate() {
-    // TODO Release previous resource
-    // release();
+    PROFILE_SCOPE("Terrain::generate");
+    if (quantize_heights && !isQuantized())
+        quantizeLayers();
+
+    std::vector<std::vector<PackedNormal>> normals;
+    buildMesh(normals);
+    std::vector<uint8_t> materials;
+    buildMaterials(materials);
+
+    // Load into OpenGL
+    allocateGL();
+    uploadHeightRows(0, width);
+    uploadNormalRows(normals, 0, width);
+    uploadMaterialRows(materials, 0, width);
+    uploadPhongConfigs();
+}
+
+void Terrain::buildMesh(std::vector<std::vector<PackedNormal>>& normals) {
+    normals.assign(raw_layers.size(), std::vector<PackedNormal>());
+    std::vector<std::vector<glm::vec3>> accumulated_normals(raw_layers.size());
+    std::vector<int> drawn = drawnLayers();
+    for (int layer_idx : drawn) {
+        normals[layer_idx].resize((size_t)width * length);
+        accumulated_normals[layer_idx].assign((size_t)width * length, glm::vec3(0)); // For each vertex
+    }
 
-    // Compute triangles num to plot
-    int num_triangles = (length - 1) * (width - 1) * 2;
+    for (int layer_idx : drawn) {
+        // Cells of different rows only accumulate into the normals of
+        // their own upper row
+        runParallel(width - 1, MESH_ROW_GRAIN, [&](unsigned, size_t row_begin, size_t row_end) {
+            buildCells(layer_idx, accumulated_normals[layer_idx], row_begin, row_end);
+        }, "Mesh");
 
-    for (int layer_idx = 0; layer_idx < raw_layers.size(); layer_idx++) {
-        // If not enable or no need to draw, skip the layer
-        std::pair layer = raw_layers[layer_idx];
-        PhongConfig config = layer.second;
-        if (config.enable == 0 || config.drawSurface == 0)
-            continue;
+        // Assigning smooth normals
+        runParallel(width, MESH_ROW_GRAIN, [&](unsigned, size_t row_begin, size_t row_end) {
+            assignSmoothNormals(normals[layer_idx], accumulated_normals[layer_idx], row_begin, row_end);
+        }, "Smooth normals");
+    }
+}
 
-        std::vector<Vertex> vertices(num_triangles * 3);
-        std::vector<std::vector<glm::vec3>> accumulated_normals(width, std::vector<glm::vec3>(length, glm::vec3(0))); // For each vertex
-
-        float **heightmap = layer.first;
-
-        for (int row = 0; row < width - 1; row++) {
-            for (int col = 0; col < length - 1; col++) {
-                // Add two triangle in the sqaure formed by
-                // matrix[row][col], matrix[row + 1][col], matrix[row + 1][col + 1], matrix[row, col + 1]
-
-                // col   col + 1
-                // c1 --- c2  row + 1
-                //  |  /  |
-                // c4 --- c3  row
-
-                // Prepare indices for corner vertices
-                glm::vec<2, int> c1_indx(row + 1, col    );
-                glm::vec<2, int> c2_indx(row + 1, col + 1);
-                glm::vec<2, int> c3_indx(row    , col + 1);
-                glm::vec<2, int> c4_indx(row    , col    );
-                // Scale to [-1, 1]
-                glm::vec3 corner1(2 * ((double) c1_indx.x / width) - 1, 2 * ((double) c1_indx.y / length) - 1, heightmap[c1_indx.x][c1_indx.y]);
-                glm::vec3 corner2(2 * ((double) c2_indx.x / width) - 1, 2 * ((double) c2_indx.y / length) - 1, heightmap[c2_indx.x][c2_indx.y]);
-                glm::vec3 corner3(2 * ((double) c3_indx.x / width) - 1, 2 * ((double) c3_indx.y / length) - 1, heightmap[c3_indx.x][c3_indx.y]);
-                glm::vec3 corner4(2 * ((double) c4_indx.x / width) - 1, 2 * ((double) c4_indx.y / length) - 1, heightmap[c4_indx.x][c4_indx.y]);
-                // Correct axe with height as z to height as y, and y to -z
-                double tmp;
-                tmp = corner1.z;
-                corner1.z = -corner1.y;
-                corner1.y = tmp;
-
-                tmp = corner2.z;
-                corner2.z = -corner2.y;
-                corner2.y = tmp;
-
-                tmp = corner3.z;
-                corner3.z = -corner3.y;
-                corner3.y = tmp;
-
-                tmp = corner4.z;
-                corner4.z = -corner4.y;
-                corner4.y = tmp;
-
-                // Calculating top triangle face norm and smooth norm
-                // formed by c4, c1, c2
-                glm::vec3 top_v1 = glm::normalize(corner1 - corner2);
-                glm::vec3 top_v2 = glm::normalize(corner4 - corner2);
-                glm::vec3 face_norm_top  = -glm::normalize(glm::cross(top_v1, top_v2));
-
-                // Calculating botton triangle
-                // formed by c2, c3, c4
-                glm::vec3 bot_v1 = glm::normalize(corner3 - corner4);
-                glm::vec3 bot_v2 = glm::normalize(corner2 - corner4);
-                glm::vec3 face_norm_bot  = -glm::normalize(glm::cross(bot_v1, bot_v2));
-
-                // Push back triangle vertices and norms data into vector
-                vertices[(row * (length - 1) + col) * 6 + 0].pos = corner4;
-                vertices[(row * (length - 1) + col) * 6 + 1].pos = corner1;
-                vertices[(row * (length - 1) + col) * 6 + 2].pos = corner2;
-                vertices[(row * (length - 1) + col) * 6 + 3].pos = corner2;
-                vertices[(row * (length - 1) + col) * 6 + 4].pos = corner3;
-                vertices[(row * (length - 1) + col) * 6 + 5].pos = corner4;
-
-                vertices[(row * (length - 1) + col) * 6 + 0].face_norm = face_norm_top;
-                vertices[(row * (length - 1) + col) * 6 + 1].face_norm = face_norm_top;
-                vertices[(row * (length - 1) + col) * 6 + 2].face_norm = face_norm_top;
-                vertices[(row * (length - 1) + col) * 6 + 3].face_norm = face_norm_bot;
-                vertices[(row * (length - 1) + col) * 6 + 4].face_norm = face_norm_bot;
-                vertices[(row * (length - 1) + col) * 6 + 5].face_norm = face_norm_bot;
-
-                // corner1: one 90 degree for top normal
-                // corner2: two 45 degree for top and bot normal
-                // corner3: one 90 degree for bot normal
-                // corner4: two 45 degree for top and bot normal
-                accumulated_normals[c1_indx.x][c1_indx.y] += face_norm_top;
-                accumulated_normals[c1_indx.x][c1_indx.y] += face_norm_top + face_norm_bot;
-                accumulated_normals[c1_indx.x][c1_indx.y] += face_norm_top;
-                accumulated_normals[c1_indx.x][c1_indx.y] += face_norm_top + face_norm_bot;
-
-                // Adding texture coordinates
-                vertices[(row * (length - 1) + col) * 6 + 0].texture_coord = glm::vec2((float) c4_indx.x / width, (float) c4_indx.y / length);
-                vertices[(row * (length - 1) + col) * 6 + 1].texture_coord = glm::vec2((float) c1_indx.x / width, (float) c1_indx.y / length);
-                vertices[(row * (length - 1) + col) * 6 + 2].texture_coord = glm::vec2((float) c2_indx.x / width, (float) c2_indx.y / length);
-                vertices[(row * (length - 1) + col) * 6 + 3].texture_coord = glm::vec2((float) c2_indx.x / width, (float) c2_indx.y / length);
-                vertices[(row * (length - 1) + col) * 6 + 4].texture_coord = glm::vec2((float) c3_indx.x / width, (float) c3_indx.y / length);
-                vertices[(row * (length - 1) + col) * 6 + 5].texture_coord = glm::vec2((float) c4_indx.x / width, (float) c4_indx.y / length);
+void Terrain::buildMaterials(std::vector<uint8_t>& materials) {
+    materials.resize((size_t)width * length);
+    runParallel(width, MESH_ROW_GRAIN, [&](unsigned, size_t row_begin, size_t row_end) {
+        for (size_t row = row_begin; row < row_end; row++)
+            readMaterialRow(row, materials.data() + row * length);
+    }, "Materials");
+}
+
+void Terrain::build() {
+    // Same stages as evaluate() followed by generate(), run band by band
+    // of tile rows so every stage of a band starts as soon as its input
+    // exists:
+    //   step s: evaluate band s, build cells of band s - 2 (needs the
+    //   first row of band s - 1), assign smooth normals of band s - 3
+    //   (needs the cells of bands s - 3 and s - 4) and find the
+    //   materials of its grid rows
+    // Finished bands are uploaded on the calling thread, which owns the
+    // GL context, while the workers go on with the next step
+    PROFILE_SCOPE("Terrain::build");
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<std::vector<TerrainFuncParser>>> worker_parsers;
+    prepareEvaluation(worker_parsers);
+
+    uint32_t tile = evalTileSize();
+    uint32_t tile_cols = (length + tile - 1) / tile;
+    uint32_t eval_bands = (width + tile - 1) / tile;
+    uint32_t cell_rows = width > 0 ? width - 1 : 0;
+    uint32_t cell_bands = (cell_rows + tile - 1) / tile;
+
+    std::vector<std::vector<PackedNormal>> normals(raw_layers.size());
+    std::vector<std::vector<glm::vec3>> accumulated_normals(raw_layers.size());
+    std::vector<int> drawn = drawnLayers();
+    for (int layer_idx : drawn) {
+        normals[layer_idx].resize((size_t)width * length);
+        accumulated_normals[layer_idx].assign((size_t)width * length, glm::vec3(0));
+    }
+    std::vector<uint8_t> materials((size_t)width * length);
+    allocateGL();
+
+    // Grid rows whose normals are packed with a band of cell rows, the
+    // last band also takes the top row
+    auto pointRows = [&](uint32_t band) {
+        size_t row_begin = (size_t)band * tile;
+        size_t row_end = std::min<size_t>(row_begin + tile, cell_rows);
+        return std::make_pair(row_begin, row_end == cell_rows ? (size_t)width : row_end);
+    };
+
+    // Bands ready for upload, filled by the pipeline thread
+    struct Upload {
+        bool heights;   // Height rows of an evaluated band, or
+        uint32_t band;  // cell rows of a finished band
+    };
+    std::mutex upload_lock;
+    std::condition_variable upload_ready;
+    std::deque<Upload> uploads;
+    bool finished = false;
+
+    auto publish = [&](Upload upload) {
+        std::lock_guard<std::mutex> guard(upload_lock);
+        uploads.push_back(upload);
+        upload_ready.notify_one();
+    };
+
+    std::thread pipeline([&] {
+        // Work item of a step: an evaluation tile or a chunk of rows
+        enum ItemType { EVAL_TILE, CELLS, SMOOTH_NORMALS, MATERIALS };
+        struct Item {
+            ItemType type;
+            int layer;
+            size_t begin, end;
+        };
+
+        // Chunks of MESH_ROW_GRAIN rows of a band for every drawn layer
+        auto addRows = [&](std::vector<Item>& items, ItemType type, int64_t band) {
+            if (band < 0 || band >= cell_bands)
+                return;
+            size_t row_begin = band * tile;
+            size_t row_end = std::min<size_t>(row_begin + tile, cell_rows);
+            if (type != CELLS)
+                std::tie(row_begin, row_end) = pointRows(band);
+            // Materials are found once for all layers
+            std::vector<int> item_layers = type == MATERIALS ? std::vector<int>{-1} : drawn;
+            for (int layer_idx : item_layers)
+                for (size_t r = row_begin; r < row_end; r += MESH_ROW_GRAIN)
+                    items.push_back(Item{type, layer_idx, r, std::min<size_t>(r + MESH_ROW_GRAIN, row_end)});
+        };
+
+        for (int64_t step = 0; step < (int64_t)std::max(eval_bands, cell_bands + 3); step++) {
+            PROFILE_SCOPE("Pipeline step");
+            std::vector<Item> items;
+            if (step < eval_bands) {
+                size_t eval_band = (size_t)step;
+                for (size_t t = eval_band * tile_cols; t < (eval_band + 1) * tile_cols; t++)
+                    items.push_back(Item{EVAL_TILE, -1, t, t + 1});
             }
+            addRows(items, CELLS, step - 2);
+            addRows(items, SMOOTH_NORMALS, step - 3);
+            addRows(items, MATERIALS, step - 3);
+
+            runParallel(items.size(), 1, [&](unsigned worker, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    const Item& item = items[i];
+                    if (item.type == EVAL_TILE) {
+                        uint32_t row_begin = (item.begin / tile_cols) * tile;
+                        uint32_t col_begin = (item.begin % tile_cols) * tile;
+                        evaluateTile(worker_parsers[worker],
+                            row_begin, std::min(row_begin + tile, width),
+                            col_begin, std::min(col_begin + tile, length));
+                    } else if (item.type == CELLS) {
+                        buildCells(item.layer, accumulated_normals[item.layer], item.begin, item.end);
+                    } else if (item.type == SMOOTH_NORMALS) {
+                        assignSmoothNormals(normals[item.layer], accumulated_normals[item.layer], item.begin, item.end);
+                    } else {
+                        for (size_t row = item.begin; row < item.end; row++)
+                            readMaterialRow(row, materials.data() + row * length);
+                    }
+                }
+            }, nullptr);
+
+            // Quantized heights need the range of the whole layer
+            if (step < eval_bands && !quantize_heights)
+                publish(Upload{true, (uint32_t)step});
+            if (step - 3 >= 0 && step - 3 < cell_bands)
+                publish(Upload{false, (uint32_t)(step - 3)});
         }
 
-        // Normalize acculated normals
-        for (auto row_it = accumulated_normals.begin(); row_it < accumulated_normals.end(); row_it++) {
-            auto row = *row_it;
-            for (auto cell_it = row.begin(); cell_it != row.end(); cell_it++) {
-                *cell_it = glm::normalize(*cell_it);
-            }
+        std::lock_guard<std::mutex> guard(upload_lock);
+        finished = true;
+        upload_ready.notify_one();
+    });
+
+    // Upload bands as they come in
+    while (true) {
+        Upload upload;
+        {
+            std::unique_lock<std::mutex> guard(upload_lock);
+            upload_ready.wait(guard, [&] { return finished || !uploads.empty(); });
+            if (uploads.empty())
+                break;
+            upload = uploads.front();
+            uploads.pop_front();
         }
 
-        // Assigning smooth normals
-        for (int row = 0; row < width - 1; row++) {
-            for (int col = 0; col < length - 1; col++) {
-                // Same order as c4->c1->c2; c2->c3->c4; two triangles
-                vertices[(row * (length - 1) + col) * 6 + 0].smooth_norm = accumulated_normals[row][col];
-                vertices[(row * (length - 1) + col) * 6 + 1].smooth_norm = accumulated_normals[row + 1][col];
-                vertices[(row * (length - 1) + col) * 6 + 2].smooth_norm = accumulated_normals[row + 1][col + 1];
-                vertices[(row * (length - 1) + col) * 6 + 3].smooth_norm = accumulated_normals[row + 1][col + 1];
-                vertices[(row * (length - 1) + col) * 6 + 4].smooth_norm = accumulated_normals[row + 0][col + 1];
-                vertices[(row * (length - 1) + col) * 6 + 5].smooth_norm = accumulated_normals[row][col];
-            }
+        PROFILE_SCOPE(upload.heights ? "Upload heights" : "Upload normals and materials");
+        uint32_t row_begin = upload.band * tile;
+        if (upload.heights) {
+            uploadHeightRows(row_begin, std::min(row_begin + tile, width));
+        } else {
+            auto rows = pointRows(upload.band);
+            uploadNormalRows(normals, rows.first, rows.second);
+            uploadMaterialRows(materials, rows.first, rows.second);
         }
+    }
+    pipeline.join();
 
-        std::cout << glm::to_string(vertices[0].pos) << std::endl;
-        std::cout << glm::to_string(vertices[0].face_norm) << std::endl;
-        std::cout << glm::to_string(vertices[1].pos) << std::endl;
-        std::cout << glm::to_string(vertices[1].face_norm) << std::endl;std::cout << glm::to_string(vertices[2].pos) << std::endl;
-        std::cout << glm::to_string(vertices[2].face_norm) << std::endl;
+    storeInCache();
+    if (quantize_heights) {
+        quantizeLayers();
+        uploadHeightRows(0, width);
+    }
+    uploadPhongConfigs();
 
-        // Load into OpenGL
-        vcount = (GLsizei)vertices.size();
-        // Load vertices into OpenGL
-        glGenVertexArrays(1, &vaos[layer_idx]);
-        glBindVertexArray(vaos[layer_idx]);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("Build: %.2f ms for %zu layers in %u bands\n", elapsed.count(), raw_layers.size(), eval_bands);
+}
 
-        glGenBuffers(1, &vbufs[layer_idx]);
-        glBindBuffer(GL_ARRAY_BUFFER, vbufs[layer_idx]);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+std::vector<int> Terrain::drawnLayers() {
+    // If not enable or no need to draw, skip the layer
+    std::vector<int> drawn;
+    for (int layer_idx = 0; layer_idx < (int)raw_layers.size(); layer_idx++) {
+        const PhongConfig& config = raw_layers[layer_idx].second;
+        if (config.enable != 0 && config.drawSurface != 0)
+            drawn.push_back(layer_idx);
+    }
+    return drawn;
+}
 
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(2 * sizeof(glm::vec3)));
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(3 * sizeof(glm::vec3)));
+void Terrain::buildCells(int layer_idx, std::vector<glm::vec3>& accumulated_normals,
+        size_t row_begin, size_t row_end) {
+    PROFILE_SCOPE("Build cells");
+    const GLfloat* heightmap = raw_layers[layer_idx].first.data();
+
+    // Quantized layers are expanded again for the rows the cells touch
+    std::vector<GLfloat> expanded;
+    if (isQuantized()) {
+        expanded.resize((row_end + 1 - row_begin) * length);
+        dequantizeRows(layer_idx, row_begin, row_end + 1, expanded.data());
+        heightmap = expanded.data() - row_begin * length;
+    }
+
+    for (size_t row = row_begin; row < row_end; row++) {
+        for (int col = 0; col < length - 1; col++) {
+            // Add two triangle in the sqaure formed by
+            // matrix[row][col], matrix[row + 1][col], matrix[row + 1][col + 1], matrix[row, col + 1]
+
+            // col   col + 1
+            // c1 --- c2  row + 1
+            //  |  /  |
+            // c4 --- c3  row
+
+            // Prepare indices for corner vertices
+            glm::vec<2, int> c1_indx(row + 1, col    );
+            glm::vec<2, int> c2_indx(row + 1, col + 1);
+            glm::vec<2, int> c3_indx(row    , col + 1);
+            glm::vec<2, int> c4_indx(row    , col    );
+            // Scale to [-1, 1]
+            glm::vec3 corner1(2 * ((double) c1_indx.x / width) - 1, 2 * ((double) c1_indx.y / length) - 1, heightmap[c1_indx.x * length + c1_indx.y]);
+            glm::vec3 corner2(2 * ((double) c2_indx.x / width) - 1, 2 * ((double) c2_indx.y / length) - 1, heightmap[c2_indx.x * length + c2_indx.y]);
+            glm::vec3 corner3(2 * ((double) c3_indx.x / width) - 1, 2 * ((double) c3_indx.y / length) - 1, heightmap[c3_indx.x * length + c3_indx.y]);
+            glm::vec3 corner4(2 * ((double) c4_indx.x / width) - 1, 2 * ((double) c4_indx.y / length) - 1, heightmap[c4_indx.x * length + c4_indx.y]);
+            // Correct axe with height as z to height as y, and y to -z
+            double tmp;
+            tmp = corner1.z;
+            corner1.z = -corner1.y;
+            corner1.y = tmp;
+
+            tmp = corner2.z;
+            corner2.z = -corner2.y;
+            corner2.y = tmp;
+
+            tmp = corner3.z;
+            corner3.z = -corner3.y;
+            corner3.y = tmp;
+
+            tmp = corner4.z;
+            corner4.z = -corner4.y;
+            corner4.y = tmp;
+
+            // Calculating top triangle face norm and smooth norm
+            // formed by c4, c1, c2
+            glm::vec3 top_v1 = glm::normalize(corner1 - corner2);
+            glm::vec3 top_v2 = glm::normalize(corner4 - corner2);
+            glm::vec3 face_norm_top  = -glm::normalize(glm::cross(top_v1, top_v2));
+
+            // Calculating botton triangle
+            // formed by c2, c3, c4
+            glm::vec3 bot_v1 = glm::normalize(corner3 - corner4);
+            glm::vec3 bot_v2 = glm::normalize(corner2 - corner4);
+            glm::vec3 face_norm_bot  = -glm::normalize(glm::cross(bot_v1, bot_v2));
+
+            // corner1: one 90 degree for top normal
+            // corner2: two 45 degree for top and bot normal
+            // corner3: one 90 degree for bot normal
+            // corner4: two 45 degree for top and bot normal
+            accumulated_normals[c1_indx.x * length + c1_indx.y] += face_norm_top;
+            accumulated_normals[c1_indx.x * length + c1_indx.y] += face_norm_top + face_norm_bot;
+            accumulated_normals[c1_indx.x * length + c1_indx.y] += face_norm_top;
+            accumulated_normals[c1_indx.x * length + c1_indx.y] += face_norm_top + face_norm_bot;
+        }
+    }
+}
 
-        glBindVertexArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+// Unit vector folded onto the octahedron |x| + |y| + |z| = 1 and flattened
+// to the xz plane, the lower half mirrored into the corners
+static void encodeOctahedral(glm::vec3 n, int16_t out[2]) {
+    float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    glm::vec2 p = l1 > 0.0f ? glm::vec2(n.x, n.z) / l1 : glm::vec2(0.0f);
+    if (l1 > 0.0f && n.y < 0.0f) {
+        glm::vec2 sign(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+        p = (1.0f - glm::abs(glm::vec2(p.y, p.x))) * sign;
     }
+    out[0] = (int16_t)std::lround(glm::clamp(p.x, -1.0f, 1.0f) * 32767.0f);
+    out[1] = (int16_t)std::lround(glm::clamp(p.y, -1.0f, 1.0f) * 32767.0f);
+}
 
+void Terrain::assignSmoothNormals(std::vector<PackedNormal>& normals,
+        const std::vector<glm::vec3>& accumulated_normals, size_t row_begin, size_t row_end) {
+    PROFILE_SCOPE("Smooth normals");
+    for (size_t point = row_begin * length; point < row_end * length; point++)
+        encodeOctahedral(accumulated_normals[point], normals[point].oct);
+}
+
+void Terrain::allocateGL(const void* height_data, const void* normal_data) {
+    PROFILE_SCOPE("Allocate GL");
+    // Two triangles per cell, shared by every layer
+    vcount = width > 1 && length > 1 ? (GLsizei)((size_t)(length - 1) * (width - 1) * 6) : 0;
+
+    // Height map of every layer, one texture array slice per layer
+    if (!heightMap)
+        glGenTextures(1, &heightMap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightMap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    // Columns run along s and rows along t. 16-bit unorm heights are
+    // scaled back by the shader with the config of the layer
+    bool quantized = quantize_heights || isQuantized();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, quantized ? 2 : 4);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, quantized ? GL_R16 : GL_R32F, length, width, raw_layers.size(), 0,
+        GL_RED, quantized ? GL_UNSIGNED_SHORT : GL_FLOAT, height_data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // Normal map laid out the same, only read with texelFetch
+    if (!normalMap)
+        glGenTextures(1, &normalMap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, normalMap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG16_SNORM, length, width, raw_layers.size(), 0,
+        GL_RG, GL_SHORT, normal_data);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // Config index of every grid point, integer textures take no filtering
+    if (!materialMap)
+        glGenTextures(1, &materialMap);
+    glBindTexture(GL_TEXTURE_2D, materialMap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, length, width, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Terrain::uploadNormalRows(const std::vector<std::vector<PackedNormal>>& normals,
+        size_t row_begin, size_t row_end) {
+    if (row_begin >= row_end)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, normalMap);
+    for (size_t layer_idx = 0; layer_idx < normals.size(); layer_idx++) {
+        if (normals[layer_idx].empty())
+            continue;
+        const PackedNormal* rows = normals[layer_idx].data() + row_begin * length;
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, row_begin, layer_idx,
+            length, row_end - row_begin, 1, GL_RG, GL_SHORT, rows);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void Terrain::uploadHeightRows(size_t row_begin, size_t row_end) {
+    if (row_begin >= row_end)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightMap);
+    if (isQuantized()) {
+        // Rows of odd length are not 4 byte aligned
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        for (size_t layer_idx = 0; layer_idx < quantized_layers.size(); layer_idx++) {
+            const uint16_t* rows = quantized_layers[layer_idx].values.data() + row_begin * length;
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, row_begin, layer_idx,
+                length, row_end - row_begin, 1, GL_RED, GL_UNSIGNED_SHORT, rows);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    } else {
+        for (size_t layer_idx = 0; layer_idx < raw_layers.size(); layer_idx++) {
+            const GLfloat* rows = raw_layers[layer_idx].first.data() + row_begin * length;
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, row_begin, layer_idx,
+                length, row_end - row_begin, 1, GL_RED, GL_FLOAT, rows);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void Terrain::uploadPhongConfigs() {
+    PROFILE_SCOPE("Upload Phong configs");
     // Pass the PhongConfig
     glBindBuffer(GL_UNIFORM_BUFFER, phongConfigsUBO);
     for (int i = 0; i < raw_layers.size(); i++) {
         PhongConfig config = raw_layers[i].second;
         config.color /= 255.0f;
+        config.heightScale = isQuantized() ? quantized_layers[i].scale : 1.0f;
+        config.heightBias = isQuantized() ? quantized_layers[i].bias : 0.0f;
 
         glBufferSubData(GL_UNIFORM_BUFFER, i * sizeof(PhongConfig),
             sizeof(PhongConfig), &config);
@@ -277,63 +1097,45 @@ void Terrain::generate() {
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
+void Terrain::uploadMaterialRows(const std::vector<uint8_t>& materials, size_t row_begin, size_t row_end) {
+    if (row_begin >= row_end)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D, materialMap);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row_begin, length, row_end - row_begin,
+        GL_RED_INTEGER, GL_UNSIGNED_BYTE, materials.data() + row_begin * length);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 void Terrain::draw() {
+    PROFILE_SCOPE("Terrain::draw");
     // TODO: Also visualizing the surfaces?
+    std::vector<int> drawn = drawnLayers();
+    if (drawn.empty() || vcount == 0)
+        return;
 
-    // Serialization
-    int layer_count = raw_layers.size();
-    int layer_size  = width * length;
-    GLfloat* ptr = new GLfloat[width * length * layer_count];
-    for (int layer_indx = 0; layer_indx < layer_count; layer_indx++) {
-        GLfloat** raw_layer = raw_layers[layer_indx].first;
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < length; j++) {
-                ptr[layer_indx * layer_size + i * width + j] = raw_layer[i][j];
-            }
-        }
-    }
-
-    // Passing texture
-    glGenTextures(1, &heightMap);
-    printf("Loc for texture: %d\n", heightMap);
+    // Height, normal and material maps were uploaded by generate()
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, materialMap);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, normalMap);
+    glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D_ARRAY, heightMap);
-    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    // Float version
-    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, width, length, layer_count, 0, GL_RED, GL_FLOAT, ptr);
-
-    GLuint sampler_loc = glGetUniformLocation(shader, "heightMap");
-    glUniform1i(sampler_loc, 0);
-
-    // Draw the terrain
-    for (int i = 0; i < raw_layers.size(); i++) {
-        PhongConfig config = raw_layers[i].second;
-        if (config.drawSurface != 0) {
-            // Set the initial phong to use for the surface
-            GLuint initPhongConfigLoc = glGetUniformLocation(shader, "originalPhongIndx");
-            glUniform1i(initPhongConfigLoc, i);
-
-            glBindVertexArray(vaos[i]);
-            glDrawArrays(GL_TRIANGLES, 0, vcount);
-            glBindVertexArray(0);
-        }
-    }
+    shader->set(gridSizeLoc, glm::ivec2(width, length));
 
+    // Every instance is a layer, the shader looks up which
+    shader->set(drawnLayersLoc, drawn.data(), (GLsizei)drawn.size());
+    glBindVertexArray(vao);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, vcount, (GLsizei)drawn.size());
+    glBindVertexArray(0);
 }
 
 void Terrain::release() {
-    for (int i = 0; i < MAX_LAYERS; i++) {
-        if (vaos[i]) {
-            glDeleteVertexArrays(1, &vaos[i]); 
-            vaos[i] = 0; 
-        }
-        if (vbufs[i]) {
-            glDeleteBuffers(1, &vbufs[i]); 
-            vbufs[i] = 0; 
-        }
+    if (vao) {
+        glDeleteVertexArrays(1, &vao);
+        vao = 0;
     }
 	vcount = 0;
 
@@ -341,6 +1143,14 @@ void Terrain::release() {
         glDeleteTextures(1, &heightMap);
         heightMap = 0;
     }
+    if (normalMap) {
+        glDeleteTextures(1, &normalMap);
+        normalMap = 0;
+    }
+    if (materialMap) {
+        glDeleteTextures(1, &materialMap);
+        materialMap = 0;
+    }
 
     std::vector<PhongConfig> emptyLayerConfigs(MAX_LAYERS);
 	glBufferData(GL_UNIFORM_BUFFER, emptyLayerConfigs.size() * sizeof(PhongConfig), emptyLayerConfigs.data(), GL_STATIC_DRAW);
@@ -353,14 +1163,13 @@ void Terrain::printMatrix(int indx) {
         return;
     }
 
-    std::pair raw_layer = raw_layers[indx];
-    float **matrix = raw_layer.first;
-    PhongConfig color = raw_layer.second;
+    std::vector<GLfloat> heights = getLayerHeights(indx);
+    const GLfloat* matrix = heights.data();
 
     // std::cout << "Color of layer: " << glm::to_string(color) << std::endl;
     for (int i = 0; i < width; i++) {
         for (int j = 0; j < length; j++) {
-            printf("%.4f ", matrix[i][j]);
+            printf("%.4f ", matrix[i * length + j]);
         }
         printf("\n");
     }
@@ -382,14 +1191,11 @@ double Terrain::TerrainFuncParser::plane(const double* xyc1c2c3) {
      * */
     double x = xyc1c2c3[0];
     double y = xyc1c2c3[1];
-    double c1 = xyc1c2c3[2];
-    double c2 = xyc1c2c3[3];
-    double c3 = xyc1c2c3[4];
 
-    glm::vec3 corner1(-1, 1, c1);
-    glm::vec3 corner2( 1, 1, c2);
-    glm::vec3 corner3( 1,-1, c3);
-    glm::vec3 normal = glm::normalize(glm::cross(corner1 - corner2, corner3 - corner2));
+    // Normal only depends on the corner heights, reuse it across samples
+    const FacePlane& face = planeShape(xyc1c2c3 + 2).face;
+    const glm::vec3& normal = face.normal;
+    const glm::vec3& corner2 = face.point;
 
     // Plane expression for z given (x, y)
     double z = (-normal.x * (x - corner2.x) - normal.y * (y - corner2.y))/normal.z + corner2.z;
@@ -411,19 +1217,83 @@ double Terrain::TerrainFuncParser::pyramid(const double* xyc1c2c3c4xyz) {
 
     double x        = xyc1c2c3c4xyz[0];
     double y        = xyc1c2c3c4xyz[1];
-    double c1       = xyc1c2c3c4xyz[2];
-    double c2       = xyc1c2c3c4xyz[3];
-    double c3       = xyc1c2c3c4xyz[4];
-    double c4       = xyc1c2c3c4xyz[5];
-    double apex_x   = xyc1c2c3c4xyz[6];
-    double apex_y   = xyc1c2c3c4xyz[7];
-    double apex_z   = xyc1c2c3c4xyz[8];
-
-    glm::vec3 corner1(-1, 1, c1);
-    glm::vec3 corner2( 1, 1, c2);
-    glm::vec3 corner3( 1,-1, c3);
-    glm::vec3 corner4(-1,-1, c4);
-    glm::vec3 apex(apex_x, apex_y, apex_z);
+
+    // Faces and edges only depend on the corners and apex
+    const PyramidShape& shape = pyramidShape(xyc1c2c3c4xyz + 2);
+    glm::vec2 xy(x, y);
+
+    double z = 0;
+    for (int i = 0; i < 4; i++) {
+        // Check if the (x,y) lies in the triangle projection
+        // formed by p1 and p2 and apex onto the z = 0 plane
+        glm::vec2 point = xy - shape.p2[i];
+        float t1 = shape.v1[i].x * point.y - point.x * shape.v1[i].y;
+        float t2 = point.x * shape.v2[i].y - shape.v2[i].x * point.y;
+        point = xy - shape.p1[i];
+        float t3 = shape.v3[i].x * point.y - point.x * shape.v3[i].y;
+
+        // Same sign, point in triangle
+        bool below = t1 <= 0 && t2 <= 0 && t3 <= 0;
+        bool above = t1 >= 0 && t2 >= 0 && t3 >= 0;
+        if (below || above) {
+            // Compute z
+            const FacePlane& face = shape.faces[i];
+            z = (-face.normal.x * (x - face.point.x) - face.normal.y * (y - face.point.y))/face.normal.z + face.point.z;
+            break;
+        }
+    }
+    return z;
+}
+
+template<typename Shape, int N>
+const Shape* Terrain::TerrainFuncParser::ShapeCache<Shape, N>::find(const double* params) {
+    // Constant call sites hit the last used entry straight away
+    for (int k = 0; k < count; k++) {
+        int i = (last + k) % count;
+        if (std::equal(params, params + N, entries[i].params)) {
+            last = i;
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+template<typename Shape, int N>
+Shape& Terrain::TerrainFuncParser::ShapeCache<Shape, N>::insert(const double* params) {
+    int i = next;
+    next = (next + 1) % SHAPE_CACHE_SIZE;
+    if (count < SHAPE_CACHE_SIZE)
+        count++;
+    last = i;
+    std::copy(params, params + N, entries[i].params);
+    return entries[i];
+}
+
+const Terrain::TerrainFuncParser::PlaneShape& Terrain::TerrainFuncParser::planeShape(const double* c1c2c3) {
+    thread_local ShapeCache<PlaneShape, 3> cache;
+    if (const PlaneShape* hit = cache.find(c1c2c3))
+        return *hit;
+
+    PlaneShape& shape = cache.insert(c1c2c3);
+    glm::vec3 corner1(-1, 1, c1c2c3[0]);
+    glm::vec3 corner2( 1, 1, c1c2c3[1]);
+    glm::vec3 corner3( 1,-1, c1c2c3[2]);
+    shape.face.point  = corner2;
+    shape.face.normal = glm::normalize(glm::cross(corner1 - corner2, corner3 - corner2));
+    return shape;
+}
+
+const Terrain::TerrainFuncParser::PyramidShape& Terrain::TerrainFuncParser::pyramidShape(const double* c1c2c3c4xyz) {
+    thread_local ShapeCache<PyramidShape, 7> cache;
+    if (const PyramidShape* hit = cache.find(c1c2c3c4xyz))
+        return *hit;
+
+    PyramidShape& shape = cache.insert(c1c2c3c4xyz);
+    glm::vec3 corner1(-1, 1, c1c2c3c4xyz[0]);
+    glm::vec3 corner2( 1, 1, c1c2c3c4xyz[1]);
+    glm::vec3 corner3( 1,-1, c1c2c3c4xyz[2]);
+    glm::vec3 corner4(-1,-1, c1c2c3c4xyz[3]);
+    glm::vec3 apex(c1c2c3c4xyz[4], c1c2c3c4xyz[5], c1c2c3c4xyz[6]);
 
     // Get the potential points (x,y) might lies in
     glm::vec3 point_sequence[5];
@@ -433,32 +1303,22 @@ double Terrain::TerrainFuncParser::pyramid(const double* xyc1c2c3c4xyz) {
     point_sequence[3] = corner4;
     point_sequence[4] = corner1;
 
-    double z = 0;
     for (int i = 0; i < 4; i++) {
-        // Check if the (x,y) lies in the triangle projection
-        // formed by p1 and p2 and apex onto the z = 0 plane
         glm::vec3 p1 = point_sequence[i];
         glm::vec3 p2 = point_sequence[i + 1];
         glm::vec3 v1 = p1 - p2;
         glm::vec3 v2 = apex - p2;
         glm::vec3 v3 = apex - p1;
 
-        // Projected to zero-plane for v1 and v2
-        glm::vec3 point = glm::vec3(x, y, 0) - glm::vec3(p2.x, p2.y, 0);
-        glm::vec3 t1 = glm::cross(glm::vec3(v1.x, v1.y, 0), point);
-        glm::vec3 t2 = glm::cross(point, glm::vec3(v2.x, v2.y, 0));
-        point = glm::vec3(x, y, 0) - glm::vec3(p1.x, p1.y, 0);
-        glm::vec3 t3 = glm::cross(glm::vec3(v3.x, v3.y, 0), point);
-
-        // Same sign, point in triangle
-        if ((t1.z <= 0 && t2.z <= 0 && t3.z <= 0) || (t1.z >= 0 && t2.z >= 0 && t3.z >= 0)) {
-            // Compute z 
-            glm::vec3 normal = glm::normalize(glm::cross(v1, v2));
-            z = (-normal.x * (x - p2.x) - normal.y * (y - p2.y))/normal.z + p2.z;
-            break;
-        }
+        shape.p1[i] = glm::vec2(p1);
+        shape.p2[i] = glm::vec2(p2);
+        shape.v1[i] = glm::vec2(v1);
+        shape.v2[i] = glm::vec2(v2);
+        shape.v3[i] = glm::vec2(v3);
+        shape.faces[i].point  = p2;
+        shape.faces[i].normal = glm::normalize(glm::cross(v1, v2));
     }
-    return z;
+    return shape;
 }
 
 double Terrain::TerrainFuncParser::normal(const double* xysxsy) {
@@ -487,7 +1347,9 @@ Terrain::PhongConfig::PhongConfig() :
     diffuse(0),
     specular(0),
     exponent(0),
-    color(glm::vec3(0)) {}
+    color(glm::vec3(0)),
+    heightScale(1),
+    heightBias(0) {}
 
 Terrain::PhongConfig::PhongConfig(float amb, float diff, float spec, float exponent, glm::vec3 c, int en, int drawSurface, int coverBottom) : 
     ambient(amb),
@@ -497,4 +1359,6 @@ Terrain::PhongConfig::PhongConfig(float amb, float diff, float spec, float expon
     color(c),
     enable(en),
     drawSurface(drawSurface),
-    coverBottom(coverBottom) {}
\ No newline at end of file
+    coverBottom(coverBottom),
+    heightScale(1),
+    heightBias(0) {}
\ No newline at end of file
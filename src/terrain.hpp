@@ -2,12 +2,18 @@
 #define __TERRAIN_HPP__
 
 #include <string>
+#include <stdexcept>
 #include <vector>
 #include <utility>
+#include <memory>
 #include <glm/glm.hpp>
 #include <PerlinNoise.hpp>
 #include "gl_core_3_3.h"
 #include "fparser.hh"
+#include "scheduler.hpp"
+#include "profiler.hpp"
+#include "heightcache.hpp"
+#include "shaderprogram.hpp"
 
 // Class of procedural modeling terrain configuration
 // Get configuration from parameter passing or via importing config file
@@ -40,27 +46,58 @@ public:
         // multiple of vec4, or 12 bytes
         // see https://learnopengl.com/Advanced-OpenGL/Advanced-GLSL
         // On Uniform buffer objects section
-        GLint   pad1;
-        GLint   pad2;
+        // The padding carries how to turn the height map texel of the
+        // layer back into a height: height = texel * scale + bias
+        GLfloat heightScale;
+        GLfloat heightBias;
         PhongConfig(float amb, float diff, float spec, float exponent, glm::vec3 c, int enable=1, int drawSurface=1, int coverBottom=0);
         PhongConfig();
     };
 
-    // Load config file
+    // Load config file, replacing the layers, seed, name and size.
+    // Throws std::runtime_error on unreadable files or values
     void load(std::string& config_file_path);
-    void load(std::ifstream& config_file);
+    void load(std::istream& config_file);
 
     // Export config file
     void dump(std::string& out_name);
-    void dump(std::ofstream& out_file);
+    void dump(std::ostream& out_file);
+
+    // Binary project holding the config, the evaluated height maps and
+    // optionally the normal maps, see project.hpp. Opening maps the
+    // file and uploads straight from it, so it replaces evaluate() and
+    // generate() and must run on the thread owning the GL context.
+    // Both throw std::runtime_error on failure
+    void saveProject(const std::string& filename, bool include_normals = true);
+    void openProject(const std::string& filename);
 
     // Evaluate configuration and generate mesh data for draw
     void evaluate();
 
-    // Generate vertices and Load into opengl
+    // Evaluation works on square tiles of the grid: every layer of a
+    // tile is computed before moving on, and tiles are balanced over the
+    // worker threads of TaskScheduler. A tile size of 0 evaluates the
+    // whole grid as one tile, i.e. layer by layer
+    static const uint32_t EVAL_TILE_SIZE = 64;
+    // Rows of cells per piece when building the normals
+    static const uint32_t MESH_ROW_GRAIN = 16;
+    void setTileSize(uint32_t s) {tile_size = s;};
+    uint32_t getTileSize() {return tile_size;};
+    // 1 runs every stage on the calling thread, 0 uses all workers of
+    // TaskScheduler::instance() and any other count a scheduler of that
+    // many workers owned by the terrain
+    void setThreadCount(unsigned n);
+
+    // Generate normals and Load into opengl
     void generate();
 
-    // Draw the mesh
+    // evaluate() and generate() in one go, pipelined by bands of tile
+    // rows: normals and vertices of a band are built while later bands
+    // are still being evaluated, and finished bands are uploaded right
+    // away. Must be called on the thread owning the GL context
+    void build();
+
+    // Draw every drawn layer with one instanced call
     void draw();
 
     // Print the matrix
@@ -77,13 +114,19 @@ public:
     uint32_t getWidth() {return width;};
     uint32_t getLength() {return length;};
 
-    void setShader(GLuint s) {shader = s;};
+    // Program drawing the terrain, in use when draw() is called. Its
+    // blocks, samplers and uniforms are looked up when it changes
+    void setShader(ShaderProgram* s);
 
+    // Both throw std::runtime_error beyond MAX_LAYERS, the size of the
+    // config block of the shader
     void insertLayer(int pos, std::pair<std::vector<std::string>, PhongConfig> layer) {
+        checkLayerRoom();
         auto it = layers_functions.begin();
         layers_functions.insert(it + pos, layer);
     };
     void pushLayer(std::pair<std::vector<std::string>, PhongConfig> layer) {
+        checkLayerRoom();
         layers_functions.push_back(layer);
     };
     void eraseLayer(int pos) {
@@ -94,6 +137,43 @@ public:
         layers_functions.clear();
     }
 
+    // Evaluated heights of a layer, row-major with width rows of length
+    size_t getLayerCount() {return raw_layers.size();};
+    std::vector<GLfloat> getLayerHeights(int indx);
+    // One row of length heights without copying the layer. Index -1 is
+    // the composite terrain, the highest drawn surface at every point.
+    // Throws std::out_of_range for rows or layers not evaluated
+    void readHeightRow(int indx, uint32_t row, GLfloat* out);
+    const PhongConfig& getLayerConfig(int indx) {return raw_layers.at(indx).second;};
+    // Layer painting the terrain at every point of a row: the highest
+    // numbered enabled layer above the ground, 0 where there is none.
+    // The fragment shader colors the terrain with it and tests the
+    // heights themselves only where neighbouring points differ. Throws
+    // std::out_of_range like readHeightRow()
+    void readMaterialRow(uint32_t row, uint8_t* out);
+
+    // Layers with a mesh, i.e. enabled and drawn as a surface
+    std::vector<int> drawnLayers();
+
+    // Heights stored as 16-bit unorm, height = bias + scale * value / 65535
+    struct QuantizedLayer {
+        std::vector<uint16_t> values;
+        GLfloat scale = 0;      // Max - min of the layer
+        GLfloat bias = 0;       // Min of the layer
+        GLfloat maxError = 0;   // Largest difference to the float heights
+    };
+    // Keep heights quantized after evaluation instead of as floats, for
+    // half the memory and half the texture upload
+    void setQuantizeHeights(bool q) {quantize_heights = q;};
+    bool getQuantizeHeights() {return quantize_heights;};
+    bool isQuantized() {return !quantized_layers.empty();};
+
+    // Reuse layers evaluated before with the same seed, size and
+    // functions, nullptr turns caching off
+    void setCache(std::shared_ptr<HeightCache> c) {cache = c;};
+    std::shared_ptr<HeightCache> getCache() {return cache;};
+    const QuantizedLayer& getQuantizedLayer(int indx) {return quantized_layers.at(indx);};
+
 protected:
     // Member variables storing the terrain specifications
     int64_t seed = 0;       // Random generator seed
@@ -106,24 +186,41 @@ protected:
     uint32_t width;
     uint32_t length;
 
-    // Vertex structure for rendering
-    struct Vertex {
-		glm::vec3 pos;			// Position
-		glm::vec3 face_norm;	// Face normal
-		glm::vec3 smooth_norm;	// Smoothed normal
-        glm::vec2 texture_coord;
-		// Vertex();
-	};
+    uint32_t tile_size = EVAL_TILE_SIZE;
+    unsigned thread_count = 0;
+    std::unique_ptr<TaskScheduler> own_scheduler;  // For other counts
+    bool quantize_heights = false;
+
+    std::shared_ptr<HeightCache> cache;
+    // Cache key of every layer and whether it came from the cache
+    std::vector<uint64_t> layer_keys;
+    std::vector<bool> layer_cached;
+
+    // Smoothed normal of a grid point, two octahedral snorm components.
+    // There are no vertex buffers: the shader finds the grid point of a
+    // vertex from gl_VertexID and the layer from gl_InstanceID, reads
+    // the height and normal from the texture arrays and derives the
+    // face normal from the screen space derivatives of the position
+    struct PackedNormal {
+        int16_t oct[2];
+    };
+    static_assert(sizeof(PackedNormal) == 4, "Packed normal layout");
     
     // Layers of terrain, get generated everytime by calling evaluate()
-    // double[][]   : layer height
+    // vector       : layer height, indexed by row * length + col
     // PhongConfig  : layer lighting configuration
     // first one is the terrain and color is ignored
-    std::vector<std::pair<GLfloat**, PhongConfig>> raw_layers;
+    // The float heights are dropped once quantized_layers is filled
+    std::vector<std::pair<std::vector<GLfloat>, PhongConfig>> raw_layers;
+    std::vector<QuantizedLayer> quantized_layers;
 
     // Function controlling each layer
     std::vector<std::pair<std::vector<std::string>, PhongConfig>> layers_functions;
 
+    // Profiler event names of every layer and layer function
+    std::vector<const char*> layer_event_names;
+    std::vector<std::vector<const char*>> func_event_names;
+
     // TODO Add light configuration
 
     class TerrainFuncParser : public FunctionParser {
@@ -166,11 +263,108 @@ protected:
             // sy: standard dev for y axis
             static double normal(const double* xysxsy);
 
+            // Geometry of plane() and pyramid() that only depends on
+            // the non-xy arguments, which are constants at almost every
+            // call site. Built once per distinct argument set and looked
+            // up per sample instead of being rebuilt for every point
+            struct FacePlane {
+                glm::vec3 point;    // Corner lying on the face
+                glm::vec3 normal;   // Normalized face normal
+            };
+
+            struct PlaneShape {
+                double params[3];   // c1, c2, c3
+                FacePlane face;
+            };
+
+            struct PyramidShape {
+                double params[7];   // c1, c2, c3, c4, apex xyz
+                FacePlane faces[4];
+                // Projected edges of each face triangle (p1, p2, apex)
+                // used for the point-in-triangle test on the z = 0 plane
+                glm::vec2 p1[4], p2[4];
+                glm::vec2 v1[4], v2[4], v3[4];
+            };
+
+            // Small per-thread memo of recently used shapes, so several
+            // call sites in one expression do not evict each other
+            static const int SHAPE_CACHE_SIZE = 8;
+            template<typename Shape, int N>
+            struct ShapeCache {
+                Shape entries[SHAPE_CACHE_SIZE];
+                int count = 0;
+                int last  = 0;  // Entry hit by the previous lookup
+                int next  = 0;  // Round robin slot to replace
+
+                // Find the shape built for params, or nullptr
+                const Shape* find(const double* params);
+                // Claim a slot for params, evicting the oldest entry
+                Shape& insert(const double* params);
+            };
+
+            static const PlaneShape& planeShape(const double* c1c2c3);
+            static const PyramidShape& pyramidShape(const double* c1c2c3c4xyz);
+
             // TODO Allow loading object file?
     };
 
     TerrainFuncParser terrainParser;
 
+    void checkLayerRoom() const {
+        if (layers_functions.size() >= (size_t)MAX_LAYERS)
+            throw std::runtime_error("A terrain holds at most " + std::to_string(MAX_LAYERS) + " surfaces");
+    };
+
+    // Scheduler of the thread count
+    TaskScheduler& scheduler();
+
+    // Run body over [0, count) on the scheduler and report how well the
+    // workers were kept busy
+    void runParallel(size_t count, size_t grain, const TaskScheduler::RangeBody& body, const char* stage);
+
+    // Evaluate every layer over rows [row_begin, row_end) and
+    // cols [col_begin, col_end), one parser per layer function
+    void evaluateTile(std::vector<std::vector<TerrainFuncParser>>& parsers,
+        uint32_t row_begin, uint32_t row_end, uint32_t col_begin, uint32_t col_end);
+
+    // Parse the layer functions into one set of parsers per worker and
+    // allocate zeroed layers
+    void prepareEvaluation(std::vector<std::vector<std::vector<TerrainFuncParser>>>& worker_parsers);
+    uint32_t evalTileSize();
+
+    // Normals of every grid point of the drawn layers, without touching
+    // OpenGL. Layers not drawn are left empty
+    void buildMesh(std::vector<std::vector<PackedNormal>>& normals);
+    // readMaterialRow() of every row, in parallel
+    void buildMaterials(std::vector<uint8_t>& materials);
+
+    // Store the layers that were not read from the cache
+    void storeInCache();
+
+    // Convert every layer to 16 bits and free its floats
+    void quantizeLayers();
+    // Float heights of rows [row_begin, row_end) of a quantized layer
+    void dequantizeRows(int layer_idx, size_t row_begin, size_t row_end, GLfloat* out);
+
+    // Face normals of the cells in rows [row_begin, row_end),
+    // accumulated into the per point normals of the row above
+    void buildCells(int layer_idx, std::vector<glm::vec3>& accumulated_normals,
+        size_t row_begin, size_t row_end);
+    // Pack the accumulated normals of grid rows [row_begin, row_end),
+    // needs buildCells() done for the cell rows below them
+    void assignSmoothNormals(std::vector<PackedNormal>& normals,
+        const std::vector<glm::vec3>& accumulated_normals, size_t row_begin, size_t row_end);
+
+    // Create the height, normal and material map textures without
+    // contents, then fill them piece by piece
+    // Contents can be handed over right away: height_data and
+    // normal_data hold every layer in texture array order
+    void allocateGL(const void* height_data = nullptr, const void* normal_data = nullptr);
+    void uploadNormalRows(const std::vector<std::vector<PackedNormal>>& normals, size_t row_begin, size_t row_end);
+    void uploadHeightRows(size_t row_begin, size_t row_end);
+    void uploadMaterialRows(const std::vector<uint8_t>& materials, size_t row_begin, size_t row_end);
+    void uploadPhongConfigs();
+
     void release();		// Release OpenGL resources
 
 	// Bounding box
@@ -179,10 +373,9 @@ protected:
 
 	// OpenGL resources
     static const GLuint BIND_PT = 1;
-	GLuint shader;	// GPU shader program
-	GLuint vaos[MAX_LAYERS];	// Multiple Vertex array object
-	GLuint vbufs[MAX_LAYERS];	// Vertex buffer
-	GLsizei vcount;	// Number of vertices
+	ShaderProgram* shader = nullptr;	// GPU shader program
+	GLuint vao = 0;		// Vertex array object without attributes
+	GLsizei vcount = 0;	// Number of vertices of a layer
     
     GLuint ambStrLoc;
     GLuint diffStrLoc;
@@ -193,8 +386,11 @@ protected:
     GLuint coverBottomLoc;
 
     GLuint phongConfigsUBO;
-    GLuint heightMap;
-    // GLuint heightMapTextureLoc;
+    GLuint heightMap = 0;
+    GLuint normalMap = 0;
+    GLuint materialMap = 0;     // Config index of every grid point
+    int gridSizeLoc = -1;       // Uniform indices in shader
+    int drawnLayersLoc = -1;
 
     PhongConfig testConfig;
 };
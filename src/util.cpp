@@ -1,24 +1,55 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#ifdef QT_CORE_LIB
+#include <QFile>
+#endif
 #include "util.hpp"
+#include "programcache.hpp"
 
-// Compile a single shader stage
-GLuint compileShader(GLenum type, const std::string& filename) {
-	// Read the file
-	std::ifstream file(filename);
+// Read a shader, from the resources of the application if it has them
+std::string readShader(const std::string& filename, const std::string& defines) {
+	std::string bufStr;
+#ifdef QT_CORE_LIB
+	QFile file(QString::fromStdString(filename));
+	if (!file.open(QIODevice::ReadOnly)) {
+		std::stringstream ss;
+		ss << "Failed to open " << filename << std::endl;
+		throw std::runtime_error(ss.str());
+	}
+	bufStr = file.readAll().toStdString();
+#else
+	// Resource paths are relative to the working directory
+	std::string path = filename.compare(0, 2, ":/") == 0 ? filename.substr(2) : filename;
+	std::ifstream file(path);
 	if (!file.is_open()) {
 		std::stringstream ss;
 		ss << "Failed to open " << filename << std::endl;
 		throw std::runtime_error(ss.str());
 	}
-
-	// Read the shader source
 	std::stringstream buffer;
 	buffer << file.rdbuf();
-	std::string bufStr = buffer.str();
-	const char* bufCStr = bufStr.c_str();
-	GLint length = (GLint)bufStr.length();
+	bufStr = buffer.str();
+#endif
+
+	if (!defines.empty()) {
+		size_t lineEnd = bufStr.compare(0, 8, "#version") == 0 ? bufStr.find('\n') : std::string::npos;
+		if (lineEnd == std::string::npos)
+			bufStr.insert(0, defines);
+		else
+			bufStr.insert(lineEnd + 1, defines);
+	}
+	return bufStr;
+}
+
+// Compile a single shader stage
+GLuint compileShader(GLenum type, const std::string& filename, const std::string& defines) {
+	return compileShaderSource(type, filename, readShader(filename, defines));
+}
+
+GLuint compileShaderSource(GLenum type, const std::string& name, const std::string& source) {
+	const char* bufCStr = source.c_str();
+	GLint length = (GLint)source.length();
 
 	// Compile the shader
 	GLuint shader = glCreateShader(type);
@@ -37,7 +68,7 @@ GLuint compileShader(GLenum type, const std::string& filename) {
 
 		// Construct an error message with the compile log
 		std::stringstream ss;
-		ss << "Error compiling " << filename << ":" << std::endl << std::endl;
+		ss << "Error compiling " << name << ":" << std::endl << std::endl;
 		ss << logText.data() << std::endl;
 
 		// Cleanup shader and throw an exception
@@ -49,8 +80,9 @@ GLuint compileShader(GLenum type, const std::string& filename) {
 }
 
 // Link compiled shader stages into a single program
-GLuint linkProgram(std::vector<GLuint>& shaders) {
-	GLuint program = glCreateProgram();
+GLuint linkProgram(std::vector<GLuint>& shaders, GLuint program) {
+	if (!program)
+		program = glCreateProgram();
 
 	// Attach the shaders and link the program
 	for (auto it = shaders.begin(); it != shaders.end(); ++it)
@@ -83,3 +115,41 @@ GLuint linkProgram(std::vector<GLuint>& shaders) {
 
 	return program;
 }
+
+GLuint loadProgram(const std::string& vertexFile, const std::string& fragmentFile, const std::string& defines) {
+	std::vector<std::string> sources = {readShader(vertexFile, defines), readShader(fragmentFile, defines)};
+	std::string name = vertexFile + "\n" + fragmentFile + "\n" + defines;
+	uint64_t key = ProgramCache::fingerprint(sources);
+	GLuint program = ProgramCache::load(name, key);
+	if (program)
+		return program;
+
+	std::vector<GLuint> shaders;
+	try {
+		shaders.push_back(compileShaderSource(GL_VERTEX_SHADER, vertexFile, sources[0]));
+		shaders.push_back(compileShaderSource(GL_FRAGMENT_SHADER, fragmentFile, sources[1]));
+	} catch (std::runtime_error& e) {
+		for (auto s : shaders)
+			glDeleteShader(s);
+		// Name the variant that failed
+		if (defines.empty())
+			throw;
+		throw std::runtime_error(std::string(e.what()) + "With defines:\n" + defines);
+	}
+
+	// Shaders are only needed until linked, failed or not
+	program = glCreateProgram();
+	ProgramCache::prepare(program);
+	try {
+		linkProgram(shaders, program);
+	} catch (...) {
+		for (auto s : shaders)
+			glDeleteShader(s);
+		throw;
+	}
+	for (auto s : shaders)
+		glDeleteShader(s);
+
+	ProgramCache::store(name, key, program);
+	return program;
+}
@@ -5,7 +5,18 @@
 #include <vector>
 #include "gl_core_3_3.h"
 
-GLuint compileShader(GLenum type, const std::string& filename);
-GLuint linkProgram(std::vector<GLuint>& shaders);
+// Shader files are compiled into the application as Qt resources under
+// ":/shaders/", builds without Qt read the same paths from disk.
+// defines are inserted after the #version line of the source
+std::string readShader(const std::string& filename, const std::string& defines = "");
+GLuint compileShader(GLenum type, const std::string& filename, const std::string& defines = "");
+// Compile source, name only appears in errors
+GLuint compileShaderSource(GLenum type, const std::string& name, const std::string& source);
+// Links into program if given, or a new one
+GLuint linkProgram(std::vector<GLuint>& shaders, GLuint program = 0);
+
+// Compile and link a vertex and fragment shader, or load the program
+// linked from the same sources by an earlier run (see programcache.hpp)
+GLuint loadProgram(const std::string& vertexFile, const std::string& fragmentFile, const std::string& defines = "");
 
 #endif